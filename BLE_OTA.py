@@ -1,20 +1,233 @@
+import io
 import os
 import sys
 import asyncio
+import hashlib
 import struct
 import time
 import argparse
 import threading
+import zlib
 from collections import deque
+from dataclasses import dataclass
 from bleak import BleakClient, BleakScanner
 from bleak.exc import BleakError
 from queue import Queue
 import tkinter as tk
 from tkinter import filedialog, messagebox
+from BLE_OTA_patch import make_patch
+from BLE_OTA_sparse import make_sparse
+from BLE_OTA_l2cap import DEFAULT_PSM, open_channel, get_send_mtu, send_sdu
 
 SERVICE_UUID = "4e8cbb5e-bc0f-4aab-a6e8-55e662418bef"
 CHARACTERISTIC_UUID = "513fcda9-f46d-4e41-ac4f-42b768495a85"
 
+HEADER_MAGIC = 0x41544F46  # "FOTA"
+HEADER_VERSION = 1
+HEADER_FORMAT = "<IBBBBIIBBH32s"
+QUERY_MAGIC = 0x51544F46  # "FOTQ"
+QUERY_FORMAT = "<I32s32s"
+QUERY_TIMEOUT = 5.0
+
+FLAG_SEQUENCED = 0x01
+FLAG_RESUMABLE = 0x02
+FLAG_PROGRESS = 0x04
+FLAG_CRC = 0x08
+SEQUENCE_FORMAT = "<H"
+CRC_FORMAT = "<I"
+
+NOTIFY_ACK = 1
+NOTIFY_ERROR = 2
+NOTIFY_START = 3
+NOTIFY_PROGRESS = 4
+NOTIFY_QUERY = 5
+START_FORMAT = "<BBI"
+PROGRESS_FORMAT = "<BBII"
+ACK_FORMAT = "<BBHHI"
+ACK_RETRANSMIT = 0x01
+ACK_TIMEOUT = 2.0
+DEFAULT_WINDOW = 8
+
+COMPRESSION_NONE = 0
+COMPRESSION_DEFLATE = 1
+
+ENCODING_RAW = 0
+ENCODING_DELTA = 1
+ENCODING_SPARSE = 2
+
+TARGET_APP = 0
+TARGET_FILESYSTEM = 1
+
+STATS_FORMAT = "<HBB16IHHBBHIIH"
+STATS_FIELDS = ("size", "state", "last_error", "chunks_received", "heap_allocations", "flash_writes", "bytes_received",
+                "ingest_time_us", "chunk_time_p50_us", "chunk_time_p99_us", "chunk_time_max_us", "callback_time_us",
+                "flash_time_us", "flash_time_max_us", "queue_high_water", "heap_low_water", "hash_time_us",
+                "crc_time_us", "crc_errors", "conn_interval", "conn_latency", "tx_phy", "rx_phy", "data_length",
+                "erase_time_us", "erase_stall_time_us", "erase_ahead_min")
+NOT_MEASURED = 0xFFFFFFFF
+PHY_NAMES = {1: "1M", 2: "2M", 3: "Coded"}
+STATE_NAMES = ("idle", "receiving", "complete", "error")
+
+
+@dataclass
+class SessionOptions:
+    legacy_size: bool = False
+    compress: bool = False
+    delta_from: str = None
+    sparse: bool = False
+    window: int = 0
+    resume: bool = False
+    stats: bool = False
+    device_progress: bool = False
+    crc: bool = False
+    l2cap_psm: int = 0
+    filesystem: bool = False
+    skip_identical: bool = False
+
+
+def build_session(file_path, options):
+    """Returns the first write of the session and the payload that follows it."""
+    with open(file_path, 'rb') as f:
+        image = f.read()
+
+    # Firmware that predates the session header only understands the image size
+    if options.legacy_size:
+        return struct.pack("<I", len(image)), image
+
+    payload = image
+    encoding = ENCODING_RAW
+    if options.delta_from:
+        with open(options.delta_from, 'rb') as f:
+            payload = make_patch(f.read(), image)
+        encoding = ENCODING_DELTA
+    elif options.sparse:
+        payload = make_sparse(image)
+        encoding = ENCODING_SPARSE
+
+    compression = COMPRESSION_NONE
+    if options.compress:
+        payload = zlib.compress(payload, 9)
+        compression = COMPRESSION_DEFLATE
+
+    flags = 0
+    if options.window:
+        flags |= FLAG_SEQUENCED
+    if options.resume:
+        flags |= FLAG_RESUMABLE
+    if options.device_progress:
+        flags |= FLAG_PROGRESS
+    if options.crc:
+        flags |= FLAG_CRC
+
+    target = TARGET_FILESYSTEM if options.filesystem else TARGET_APP
+    header = struct.pack(HEADER_FORMAT, HEADER_MAGIC, HEADER_VERSION, struct.calcsize(HEADER_FORMAT),
+                         compression, encoding, len(image), len(payload), flags, target, options.window,
+                         hashlib.sha256(image).digest())
+    return header, payload
+
+
+def build_query(file_path):
+    """Returns the query asking whether the device already runs the firmware, or None if the file is not an app image."""
+    with open(file_path, 'rb') as f:
+        image = f.read()
+
+    # esp_image_header_t, the first segment header and esp_app_desc_t, whose version field starts 16 bytes in
+    if len(image) < 288 or image[0] != 0xE9:
+        return None
+    version = image[48:80]
+    # The device reports the digest appended to the image when there is one, otherwise the digest of the image
+    digest = image[-32:] if image[23] else hashlib.sha256(image).digest()
+    return struct.pack(QUERY_FORMAT, QUERY_MAGIC, version, digest)
+
+
+class DeviceNotifications:
+    """Collects the notifications the device sends on the OTA characteristic."""
+
+    def __init__(self):
+        self.start_offset = None
+        self.error = None
+        self.on_ack = None
+        self.on_progress = None
+        self.installed = None
+        self.started = asyncio.Event()
+        self.answered = asyncio.Event()
+        self.event = asyncio.Event()
+
+    def handle(self, _, data: bytearray):
+        if data[0] == NOTIFY_START:
+            _, _, self.start_offset = struct.unpack_from(START_FORMAT, data)
+            self.started.set()
+        elif data[0] == NOTIFY_ACK:
+            if self.on_ack:
+                self.on_ack(*struct.unpack_from(ACK_FORMAT, data)[1:])
+        elif data[0] == NOTIFY_PROGRESS:
+            if self.on_progress:
+                self.on_progress(*struct.unpack_from(PROGRESS_FORMAT, data)[2:])
+        elif data[0] == NOTIFY_QUERY:
+            self.installed = bool(data[1])
+            self.answered.set()
+        elif data[0] == NOTIFY_ERROR:
+            self.error = data[1]
+            self.started.set()
+            self.answered.set()
+        self.event.set()
+
+    def raise_for_error(self):
+        if self.error is not None:
+            raise RuntimeError(f"Device reported OTA error {self.error}")
+
+
+async def send_windowed(client, notifications, payload, offset, chunk_size, window, report, crc=False):
+    """Sends the payload from offset as sequenced chunks, keeping as many unacknowledged as the device grants credits for.
+
+    With crc every chunk ends with the CRC-32 of its sequence number and data. Returns the number of packets written,
+    including retransmissions.
+    """
+    chunk_size -= struct.calcsize(SEQUENCE_FORMAT)
+    if crc:
+        chunk_size -= struct.calcsize(CRC_FORMAT)
+    chunks = [payload[i:i + chunk_size] for i in range(offset, len(payload), chunk_size)]
+    state = {"acked": 0, "credits": window, "retransmit": False}
+
+    def handle_ack(flags, next_sequence, credits, received_size):
+        # Sequence numbers are 16 bits, the device never acknowledges more than a window past the last ACK
+        state["acked"] += (next_sequence - state["acked"]) & 0xFFFF
+        state["credits"] = credits
+        if flags & ACK_RETRANSMIT:
+            state["retransmit"] = True
+        percentage = (received_size / len(payload)) * 100
+        report(f"Acknowledged {received_size}/{len(payload)} bytes ({percentage:.2f}%)")
+
+    notifications.on_ack = handle_ack
+
+    next_index = 0
+    packets_sent = 0
+    while state["acked"] < len(chunks):
+        notifications.raise_for_error()
+
+        if state["retransmit"]:
+            report(f"Device lost a chunk, resending from packet {state['acked'] + 1}")
+            next_index = state["acked"]
+            state["retransmit"] = False
+
+        notifications.event.clear()
+        while next_index < len(chunks) and next_index < state["acked"] + state["credits"]:
+            packet = struct.pack(SEQUENCE_FORMAT, next_index & 0xFFFF) + chunks[next_index]
+            if crc:
+                packet += struct.pack(CRC_FORMAT, zlib.crc32(packet))
+            await client.write_gatt_char(CHARACTERISTIC_UUID, packet, response=False)
+            next_index += 1
+            packets_sent += 1
+
+        if state["acked"] < len(chunks):
+            try:
+                await asyncio.wait_for(notifications.event.wait(), ACK_TIMEOUT)
+            except asyncio.TimeoutError:
+                report(f"No acknowledgement received, resending from packet {state['acked'] + 1}")
+                next_index = state["acked"]
+
+    return packets_sent
+
 
 def calculate_time_remaining(elapsed_times_deque, bytes_remaining, chunk_size):
     if len(elapsed_times_deque) == 0:
@@ -27,117 +240,83 @@ def calculate_time_remaining(elapsed_times_deque, bytes_remaining, chunk_size):
     return f"{int(minutes)} minutes and {seconds:.2f} seconds remaining"
 
 
-async def send_firmware(address, file_path):
-    time_deque = deque(maxlen=10)
+def print_output(message, color=None):
+    print(message)
+
+
+def parse_stats(data):
+    """Decodes the statistics read from the OTA characteristic, fields added by newer firmware are ignored."""
+    data = bytes(data).ljust(struct.calcsize(STATS_FORMAT), b'\0')
+    return dict(zip(STATS_FIELDS, struct.unpack_from(STATS_FORMAT, data)))
+
+
+def report_stats(stats, report, elapsed_time=None):
+    state = STATE_NAMES[stats["state"]] if stats["state"] < len(STATE_NAMES) else stats["state"]
+    report(f"Device state: {state}, last error: {stats['last_error']}")
+    report(f"Received {stats['bytes_received']} bytes in {stats['chunks_received']} chunks, "
+           f"{stats['flash_writes']} flash writes")
+    report(f"Processing time: {stats['ingest_time_us'] / 1000:.1f} ms, of which flash {stats['flash_time_us'] / 1000:.1f} ms "
+           f"(longest write {stats['flash_time_max_us'] / 1000:.1f} ms), hashing {stats['hash_time_us'] / 1000:.1f} ms "
+           f"and callbacks {stats['callback_time_us'] / 1000:.1f} ms")
+    if stats["crc_errors"] or stats["crc_time_us"]:
+        report(f"CRC checks: {stats['crc_time_us'] / 1000:.1f} ms, {stats['crc_errors']} corrupt chunks resent")
+    if stats["erase_time_us"]:
+        report(f"Pre-erase: {stats['erase_time_us'] / 1000:.1f} ms erasing, {stats['erase_stall_time_us'] / 1000:.1f} ms "
+               f"of flash time stalled on it, at least {stats['erase_ahead_min']} sectors ahead")
+    if stats["conn_interval"]:
+        tuned = f", data length {stats['data_length']} bytes requested" if stats["data_length"] else ""
+        report(f"Link: {stats['conn_interval'] * 1.25:.2f} ms interval, latency {stats['conn_latency']}, "
+               f"{PHY_NAMES.get(stats['tx_phy'], '?')}/{PHY_NAMES.get(stats['rx_phy'], '?')} PHY{tuned}")
+    report(f"Chunk time p50/p99/max: {stats['chunk_time_p50_us']}/{stats['chunk_time_p99_us']}/{stats['chunk_time_max_us']} us")
+    report(f"Writer queue high-water mark: {stats['queue_high_water']}, heap low-water mark: {stats['heap_low_water']} bytes")
+    # Firmware built without heap hooks cannot count allocations and says so, rather than reporting none
+    allocations = stats["heap_allocations"]
+    report(f"Heap allocations while ingesting: {'not measured' if allocations == NOT_MEASURED else allocations}")
+
+    if elapsed_time:
+        # A device busy for most of the transfer is what limits it, otherwise it spends its time waiting on the radio
+        busy = stats["ingest_time_us"] / 1e6 / elapsed_time
+        if busy < 0.8:
+            report(f"Device was busy {busy * 100:.0f}% of the transfer: radio-bound")
+        elif stats["flash_time_us"] * 2 >= stats["ingest_time_us"]:
+            report(f"Device was busy {busy * 100:.0f}% of the transfer: flash-bound")
+        else:
+            report(f"Device was busy {busy * 100:.0f}% of the transfer: processing-bound")
+
+
+async def read_stats(address, update_output=print_output):
     device = await BleakScanner.find_device_by_address(address, timeout=10.0)
-    disconnected_event = asyncio.Event()
-
     if not device:
-        print(f"Device with address {address} could not be found.")
+        update_output(f"Device with address {address} could not be found.")
         return
 
-    def handle_disconnect(_: BleakClient):
-        print("Device disconnected")
-        disconnected_event.set()
-
-    async def send_data(client: BleakClient, data: bytearray, response: bool):
-        start_time = time.time()
-        await client.write_gatt_char(CHARACTERISTIC_UUID, data, response)
-        end_time = time.time()
-        elapsed_time = end_time - start_time
-        return elapsed_time
-
-    try:
-        async with BleakClient(device, disconnected_callback=handle_disconnect) as client:
-            mtu_size = client.mtu_size
-            print(f"Negotiated MTU size: {mtu_size}")
-            chunk_size = mtu_size - 3  # Adjust as needed
-            print(f"Using chunk size: {chunk_size} bytes")
-
-            file_size = os.path.getsize(file_path)
-            await client.write_gatt_char(CHARACTERISTIC_UUID, struct.pack("<I", file_size), response=True)
-            print(f"Sent file size: {file_size} bytes")
-
-            total_packets = (file_size + chunk_size - 1) // chunk_size
-            packet_number = 0
-
-            total_sent = 0
-            total_start_time = time.time()
-            initial_estimated_time_printed = False
-
-            with open(file_path, 'rb') as f:
-                while True:
-                    chunk = f.read(chunk_size)
-                    if not chunk:
-                        break
-                    packet_number += 1
-
-                    elapsed_time = await send_data(client, chunk, response=False)
-                    time_deque.append(elapsed_time)
-                    total_sent += len(chunk)
-
-                    if packet_number == 5 and not initial_estimated_time_printed:
-                        average_time = sum(time_deque) / len(time_deque)
-                        estimated_time_total = average_time * total_packets
-                        est_minutes, est_seconds = divmod(estimated_time_total, 60)
-                        print(f"Initial estimated time to complete: {int(est_minutes)} minutes and {est_seconds:.2f} seconds")
-                        initial_estimated_time_printed = True
-
-                    percentage = (total_sent / file_size) * 100
-                    bytes_remaining = file_size - total_sent
-                    time_remaining = calculate_time_remaining(time_deque, bytes_remaining, chunk_size)
-                    print(f"Packet {packet_number}/{total_packets}: Sent {total_sent}/{file_size} bytes ({percentage:.2f}%) in {elapsed_time:.4f} seconds. {time_remaining}")
-
-            total_end_time = time.time()
-            total_elapsed_time = total_end_time - total_start_time
-            elapsed_minutes, elapsed_seconds = divmod(total_elapsed_time, 60)
-            print(f"\nTotal time elapsed: {int(elapsed_minutes)} minutes and {elapsed_seconds:.2f} seconds")
-
-            if initial_estimated_time_printed:
-                time_difference = total_elapsed_time - estimated_time_total
-                diff_minutes, diff_seconds = divmod(abs(time_difference), 60)
-                if time_difference > 0:
-                    print(f"The update took {int(diff_minutes)} minutes and {diff_seconds:.2f} seconds longer than estimated.")
-                else:
-                    print(f"The update was completed {int(diff_minutes)} minutes and {diff_seconds:.2f} seconds faster than estimated.")
-
-            if packet_number > 0:
-                average_time_per_packet = total_elapsed_time / packet_number
-                throughput_bytes_per_second = total_sent / total_elapsed_time
-                throughput_megabytes_per_second = throughput_bytes_per_second / (1024 * 1024)
-                print(f"Average time per packet: {average_time_per_packet:.4f} seconds")
-                print(f"Average throughput: {throughput_bytes_per_second:.2f} bytes/second ({throughput_megabytes_per_second:.2f} MB/s)")
-
-            print("All data sent, waiting for the device to disconnect...")
-            await disconnected_event.wait()
+    async with BleakClient(device) as client:
+        report_stats(parse_stats(await client.read_gatt_char(CHARACTERISTIC_UUID)), update_output)
 
-    except BleakError as e:
-        print(f"Bleak error occurred: {e}")
-    except OSError as e:
-        print(f"An OS error occurred: {e}")
-    except Exception as e:
-        print(f"Unexpected error: {e}")
 
-
-async def send_firmware_gui(address, file_path, update_output, on_complete):
+async def send_firmware(address, file_path, options=None, update_output=print_output):
+    options = options or SessionOptions()
     time_deque = deque(maxlen=10)
     device = await BleakScanner.find_device_by_address(address, timeout=10.0)
     disconnected_event = asyncio.Event()
+    all_data_sent = False
+    skipped = False
+    channel = None
 
     if not device:
-        message = f"Device with address {address} could not be found."
-        update_output(message)
-        on_complete()
+        update_output(f"Device with address {address} could not be found.")
         return
 
     def handle_disconnect(_: BleakClient):
-        message = "Device disconnected"
-        update_output(message, color='green')
+        update_output("Device disconnected", color='green')
         disconnected_event.set()
 
     async def send_data(client: BleakClient, data: bytearray, response: bool):
         start_time = time.time()
-        await client.write_gatt_char(CHARACTERISTIC_UUID, data, response)
+        if channel:
+            await send_sdu(channel, data)
+        else:
+            await client.write_gatt_char(CHARACTERISTIC_UUID, data, response)
         end_time = time.time()
         elapsed_time = end_time - start_time
         return elapsed_time
@@ -145,86 +324,138 @@ async def send_firmware_gui(address, file_path, update_output, on_complete):
     try:
         async with BleakClient(device, disconnected_callback=handle_disconnect) as client:
             mtu_size = client.mtu_size
-            message = f"Negotiated MTU size: {mtu_size}"
-            update_output(message)
+            update_output(f"Negotiated MTU size: {mtu_size}")
             chunk_size = mtu_size - 3  # Adjust as needed
-            message = f"Using chunk size: {chunk_size} bytes"
-            update_output(message)
-
-            file_size = os.path.getsize(file_path)
-            await client.write_gatt_char(CHARACTERISTIC_UUID, struct.pack("<I", file_size), response=True)
-            message = f"Sent file size: {file_size} bytes"
-            update_output(message)
-
-            total_packets = (file_size + chunk_size - 1) // chunk_size
+            if options.l2cap_psm:
+                # The characteristic still carries the header and notifications, only the image goes over the channel
+                random_address = device.details.get("props", {}).get("AddressType") == "random" \
+                    if isinstance(device.details, dict) else False
+                channel = await open_channel(device.address, options.l2cap_psm, random_address)
+                chunk_size = get_send_mtu(channel)
+                update_output(f"Opened L2CAP channel on PSM {options.l2cap_psm:#06x}")
+            update_output(f"Using chunk size: {chunk_size} bytes")
+
+            notifications = DeviceNotifications()
+            if options.device_progress:
+                notifications.on_progress = lambda received, expected: update_output(
+                    f"Device wrote {received}/{expected} bytes ({received / expected * 100:.2f}%)")
+            if options.window or options.resume or options.device_progress or options.skip_identical:
+                await client.start_notify(CHARACTERISTIC_UUID, notifications.handle)
+
+            query = build_query(file_path) if options.skip_identical and not options.filesystem else None
+            if query:
+                await client.write_gatt_char(CHARACTERISTIC_UUID, query, response=True)
+                try:
+                    await asyncio.wait_for(notifications.answered.wait(), QUERY_TIMEOUT)
+                except asyncio.TimeoutError:
+                    pass
+                if notifications.installed:
+                    update_output("The device already runs this firmware, skipping the transfer", color='green')
+                    skipped = True
+                    return
+                # Firmware that predates the query rejects it as a malformed header, which only ends that exchange
+                notifications.error = None
+                notifications.started.clear()
+
+            header, payload = build_session(file_path, options)
+            file_size = len(payload)
+            await client.write_gatt_char(CHARACTERISTIC_UUID, header, response=True)
+            if options.compress or options.delta_from or options.sparse:
+                image_size = os.path.getsize(file_path)
+                update_output(f"Sent encoded size: {file_size} bytes ({file_size / image_size * 100:.1f}% of {image_size} bytes)")
+            else:
+                update_output(f"Sent file size: {file_size} bytes")
+
+            offset = 0
+            if options.resume:
+                await asyncio.wait_for(notifications.started.wait(), ACK_TIMEOUT)
+                notifications.raise_for_error()
+                offset = notifications.start_offset
+                if offset > 0:
+                    update_output(f"Resuming from byte {offset} ({offset / file_size * 100:.2f}%)")
+
+            total_packets = (file_size - offset + chunk_size - 1) // chunk_size
             packet_number = 0
 
-            total_sent = 0
+            total_sent = offset
             total_start_time = time.time()
             initial_estimated_time_printed = False
 
-            with open(file_path, 'rb') as f:
-                while True:
-                    chunk = f.read(chunk_size)
-                    if not chunk:
-                        break
-                    packet_number += 1
-
-                    elapsed_time = await send_data(client, chunk, response=False)
-                    time_deque.append(elapsed_time)
-                    total_sent += len(chunk)
-
-                    if packet_number == 5 and not initial_estimated_time_printed:
-                        average_time = sum(time_deque) / len(time_deque)
-                        estimated_time_total = average_time * total_packets
-                        est_minutes, est_seconds = divmod(estimated_time_total, 60)
-                        message = f"Initial estimated time to complete: {int(est_minutes)} minutes and {est_seconds:.2f} seconds"
-                        update_output(message)
-                        initial_estimated_time_printed = True
-
-                    percentage = (total_sent / file_size) * 100
-                    bytes_remaining = file_size - total_sent
-                    time_remaining = calculate_time_remaining(time_deque, bytes_remaining, chunk_size)
-                    message = f"Packet {packet_number}/{total_packets}: Sent {total_sent}/{file_size} bytes ({percentage:.2f}%) in {elapsed_time:.4f} seconds. {time_remaining}"
-                    update_output(message)
+            if options.window:
+                packet_number = await send_windowed(client, notifications, payload, offset, chunk_size, options.window,
+                                                    update_output, options.crc)
+                total_sent = file_size
+            else:
+                with io.BytesIO(payload) as f:
+                    f.seek(offset)
+                    while True:
+                        chunk = f.read(chunk_size)
+                        if not chunk:
+                            break
+                        packet_number += 1
+
+                        elapsed_time = await send_data(client, chunk, response=False)
+                        time_deque.append(elapsed_time)
+                        total_sent += len(chunk)
+
+                        if packet_number == 5 and not initial_estimated_time_printed:
+                            average_time = sum(time_deque) / len(time_deque)
+                            estimated_time_total = average_time * total_packets
+                            est_minutes, est_seconds = divmod(estimated_time_total, 60)
+                            update_output(f"Initial estimated time to complete: {int(est_minutes)} minutes and {est_seconds:.2f} seconds")
+                            initial_estimated_time_printed = True
+
+                        percentage = (total_sent / file_size) * 100
+                        bytes_remaining = file_size - total_sent
+                        time_remaining = calculate_time_remaining(time_deque, bytes_remaining, chunk_size)
+                        update_output(f"Packet {packet_number}/{total_packets}: Sent {total_sent}/{file_size} bytes ({percentage:.2f}%) in {elapsed_time:.4f} seconds. {time_remaining}")
 
             total_end_time = time.time()
             total_elapsed_time = total_end_time - total_start_time
             elapsed_minutes, elapsed_seconds = divmod(total_elapsed_time, 60)
-            message = f"\nTotal time elapsed: {int(elapsed_minutes)} minutes and {elapsed_seconds:.2f} seconds"
-            update_output(message)
+            update_output(f"\nTotal time elapsed: {int(elapsed_minutes)} minutes and {elapsed_seconds:.2f} seconds")
 
             if initial_estimated_time_printed:
                 time_difference = total_elapsed_time - estimated_time_total
                 diff_minutes, diff_seconds = divmod(abs(time_difference), 60)
                 if time_difference > 0:
-                    message = f"The update took {int(diff_minutes)} minutes and {diff_seconds:.2f} seconds longer than estimated."
+                    update_output(f"The update took {int(diff_minutes)} minutes and {diff_seconds:.2f} seconds longer than estimated.")
                 else:
-                    message = f"The update was completed {int(diff_minutes)} minutes and {diff_seconds:.2f} seconds faster than estimated."
-                update_output(message)
+                    update_output(f"The update was completed {int(diff_minutes)} minutes and {diff_seconds:.2f} seconds faster than estimated.")
 
             if packet_number > 0:
                 average_time_per_packet = total_elapsed_time / packet_number
-                throughput_bytes_per_second = total_sent / total_elapsed_time
+                throughput_bytes_per_second = (total_sent - offset) / total_elapsed_time
                 throughput_megabytes_per_second = throughput_bytes_per_second / (1024 * 1024)
-                message = f"Average time per packet: {average_time_per_packet:.4f} seconds"
-                update_output(message)
-                message = f"Average throughput: {throughput_bytes_per_second:.2f} bytes/second ({throughput_megabytes_per_second:.2f} MB/s)"
-                update_output(message)
+                update_output(f"Average time per packet: {average_time_per_packet:.4f} seconds")
+                update_output(f"Average throughput: {throughput_bytes_per_second:.2f} bytes/second ({throughput_megabytes_per_second:.2f} MB/s)")
+
+            if options.stats:
+                # Read straight away, the device usually restarts shortly after the update completes
+                report_stats(parse_stats(await client.read_gatt_char(CHARACTERISTIC_UUID)), update_output,
+                             total_elapsed_time)
 
-            message = "All data sent, waiting for the device to disconnect..."
-            update_output(message)
+            all_data_sent = True
+            update_output("All data sent, waiting for the device to disconnect...")
             await disconnected_event.wait()
 
     except BleakError as e:
-        message = f"Bleak error occurred: {e}"
-        update_output(message)
+        update_output(f"Bleak error occurred: {e}")
     except OSError as e:
-        message = f"An OS error occurred: {e}"
-        update_output(message)
+        update_output(f"An OS error occurred: {e}")
     except Exception as e:
-        message = f"Unexpected error: {e}"
-        update_output(message)
+        update_output(f"Unexpected error: {e}")
+    finally:
+        if channel:
+            channel.close()
+
+    if options.resume and not all_data_sent and not skipped:
+        update_output("The transfer can be resumed by starting it again with the same firmware.")
+
+
+async def send_firmware_gui(address, file_path, update_output, on_complete, options=None):
+    try:
+        await send_firmware(address, file_path, options, update_output)
     finally:
         # Call the on_complete callback when the upload is finished
         on_complete()
@@ -242,6 +473,11 @@ def open_gui():
     selected_device_address = tk.StringVar()
     selected_device_name = tk.StringVar()
     firmware_file_path = tk.StringVar()
+    compress_image = tk.BooleanVar(value=False)
+    use_flow_control = tk.BooleanVar(value=False)
+    resume_transfer = tk.BooleanVar(value=False)
+    filesystem_image = tk.BooleanVar(value=False)
+    skip_identical = tk.BooleanVar(value=False)
     message_queue = Queue()
 
     def select_device():
@@ -272,16 +508,24 @@ def open_gui():
         output_text.configure(state=tk.NORMAL)
         address = selected_device_address.get()
         file_path = firmware_file_path.get()
+        options = SessionOptions(compress=compress_image.get(), window=DEFAULT_WINDOW if use_flow_control.get() else 0,
+                                 resume=resume_transfer.get(), filesystem=filesystem_image.get(),
+                                 skip_identical=skip_identical.get())
 
         if not os.path.exists(file_path):
             messagebox.showerror("Error", f"File not found: {file_path}")
             upload_button.config(state=tk.NORMAL)
             return
 
+        if options.resume and options.compress:
+            messagebox.showerror("Error", "Resumable transfers cannot be compressed")
+            upload_button.config(state=tk.NORMAL)
+            return
+
         def on_upload_complete():
             root.after(0, upload_button.config, {'state': tk.NORMAL})
 
-        threading.Thread(target=lambda: asyncio.run(send_firmware_gui(address, file_path, update_output, on_upload_complete))).start()
+        threading.Thread(target=lambda: asyncio.run(send_firmware_gui(address, file_path, update_output, on_upload_complete, options))).start()
 
     def update_output(text, color=None):
         message_queue.put((text, color))
@@ -336,6 +580,12 @@ def open_gui():
     tk.Button(root, text="Select Firmware File", command=select_file).pack(pady=5)
     tk.Label(root, textvariable=firmware_file_path).pack()
 
+    tk.Checkbutton(root, text="Compress firmware", variable=compress_image).pack()
+    tk.Checkbutton(root, text="Use flow control", variable=use_flow_control).pack()
+    tk.Checkbutton(root, text="Resume interrupted transfer", variable=resume_transfer).pack()
+    tk.Checkbutton(root, text="Filesystem image", variable=filesystem_image).pack()
+    tk.Checkbutton(root, text="Skip if already installed", variable=skip_identical).pack()
+
     upload_button = tk.Button(root, text="Upload Firmware", command=start_upload, state=tk.DISABLED)
     upload_button.pack(pady=5)
 
@@ -359,10 +609,36 @@ def main():
     else:
         parser = argparse.ArgumentParser(description="BLE OTA Firmware Uploader")
         parser.add_argument('--address', type=str, help='BLE device address', required=True)
-        parser.add_argument('--file', type=str, help='Firmware file path', required=True)
+        parser.add_argument('--file', type=str, help='Firmware file path, omit with --stats to only read statistics')
+        parser.add_argument('--compress', action='store_true', help='Compress the firmware before sending it')
+        parser.add_argument('--delta-from', type=str, help='Firmware running on the device, sends a patch against it')
+        parser.add_argument('--sparse', action='store_true',
+                            help='Send runs of 0xFF and 0x00 padding as fill records instead of the bytes themselves')
+        parser.add_argument('--window', type=int, nargs='?', const=DEFAULT_WINDOW, default=0,
+                            help='Use flow control, keeping up to this many chunks unacknowledged')
+        parser.add_argument('--resume', action='store_true', help='Continue an interrupted transfer of the same firmware')
+        parser.add_argument('--crc', action='store_true',
+                            help='Protect every chunk with a CRC-32 so corrupt chunks are resent, implies --window')
+        parser.add_argument('--l2cap', type=lambda value: int(value, 0), nargs='?', const=DEFAULT_PSM, default=0,
+                            help='Send the firmware over an L2CAP channel on this PSM instead of GATT writes (Linux only)')
+        parser.add_argument('--filesystem', action='store_true',
+                            help='The file is a LittleFS or SPIFFS image for the data partition instead of firmware')
+        parser.add_argument('--skip-identical', action='store_true',
+                            help='Ask the device first and skip the transfer if it already runs this firmware')
+        parser.add_argument('--device-progress', action='store_true',
+                            help='Print the progress the device notifies as it writes the firmware')
+        parser.add_argument('--legacy-size', action='store_true',
+                            help='Start the session with the bare image size, for firmware without the session header')
+        parser.add_argument('--stats', action='store_true', help='Read and print the OTA statistics of the device')
 
         args = parser.parse_args()
 
+        if not args.file:
+            if not args.stats:
+                parser.error("--file is required unless --stats is given")
+            asyncio.run(read_stats(args.address))
+            return
+
         address = args.address
         firmware_path = args.file
 
@@ -370,7 +646,39 @@ def main():
             print(f"File not found: {firmware_path}")
             sys.exit(1)
 
-        asyncio.run(send_firmware(address, firmware_path))
+        if args.delta_from and not os.path.exists(args.delta_from):
+            print(f"File not found: {args.delta_from}")
+            sys.exit(1)
+
+        if args.resume and (args.compress or args.delta_from or args.sparse):
+            print("--resume can only be used with uncompressed full images")
+            sys.exit(1)
+
+        if args.legacy_size and (args.compress or args.delta_from or args.sparse or args.window or args.resume or
+                                 args.crc or args.device_progress or args.filesystem or args.skip_identical):
+            print("--legacy-size sends a plain firmware image and cannot be combined with other session options")
+            sys.exit(1)
+
+        if args.sparse and args.delta_from:
+            print("--sparse and --delta-from are both encodings, only one can be used")
+            sys.exit(1)
+
+        if args.filesystem and args.delta_from:
+            print("--delta-from patches firmware, it cannot be used with --filesystem")
+            sys.exit(1)
+
+        if args.l2cap and (args.window or args.crc):
+            print("--l2cap already has flow control and integrity checks, it cannot be combined with --window or --crc")
+            sys.exit(1)
+
+        if args.crc and not args.window:
+            args.window = DEFAULT_WINDOW
+
+        options = SessionOptions(legacy_size=args.legacy_size, compress=args.compress, delta_from=args.delta_from,
+                                 sparse=args.sparse, window=args.window, resume=args.resume, stats=args.stats,
+                                 device_progress=args.device_progress, crc=args.crc, l2cap_psm=args.l2cap,
+                                 filesystem=args.filesystem, skip_identical=args.skip_identical)
+        asyncio.run(send_firmware(address, firmware_path, options))
 
 
 if __name__ == "__main__":
@@ -0,0 +1,58 @@
+import asyncio
+import ctypes
+import socket
+
+SOL_BLUETOOTH = 274
+BT_SNDMTU = 12
+BT_RCVMTU = 13
+
+BDADDR_LE_PUBLIC = 0x01
+BDADDR_LE_RANDOM = 0x02
+
+DEFAULT_PSM = 0x0080
+
+
+class SockaddrL2(ctypes.Structure):
+    """struct sockaddr_l2 from the Linux Bluetooth headers, Python's own L2CAP addresses cannot select an LE address."""
+    _fields_ = [
+        ("l2_family", ctypes.c_ushort),
+        ("l2_psm", ctypes.c_ushort),
+        ("l2_bdaddr", ctypes.c_uint8 * 6),
+        ("l2_cid", ctypes.c_ushort),
+        ("l2_bdaddr_type", ctypes.c_uint8),
+    ]
+
+
+def connect_channel(address, psm=DEFAULT_PSM, random_address=False):
+    """Opens an LE credit based L2CAP channel to the device and returns the socket. Linux only, blocks until connected."""
+    sock = socket.socket(socket.AF_BLUETOOTH, socket.SOCK_SEQPACKET, socket.BTPROTO_L2CAP)
+
+    sockaddr = SockaddrL2()
+    sockaddr.l2_family = socket.AF_BLUETOOTH
+    sockaddr.l2_psm = psm
+    # bdaddr_t stores the address least significant byte first
+    sockaddr.l2_bdaddr[:] = bytes.fromhex(address.replace(':', ''))[::-1]
+    sockaddr.l2_bdaddr_type = BDADDR_LE_RANDOM if random_address else BDADDR_LE_PUBLIC
+
+    libc = ctypes.CDLL(None, use_errno=True)
+    if libc.connect(sock.fileno(), ctypes.byref(sockaddr), ctypes.sizeof(sockaddr)) != 0:
+        errno = ctypes.get_errno()
+        sock.close()
+        raise OSError(errno, f"L2CAP connection to {address} PSM {psm:#06x} failed")
+
+    sock.setblocking(False)
+    return sock
+
+
+def get_send_mtu(sock):
+    """Largest SDU the device accepts on the channel."""
+    return sock.getsockopt(SOL_BLUETOOTH, BT_SNDMTU)
+
+
+async def open_channel(address, psm=DEFAULT_PSM, random_address=False):
+    return await asyncio.get_running_loop().run_in_executor(None, connect_channel, address, psm, random_address)
+
+
+async def send_sdu(sock, data):
+    """Sends one SDU, waiting while the device has no credits left."""
+    await asyncio.get_running_loop().sock_sendall(sock, data)
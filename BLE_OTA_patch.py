@@ -0,0 +1,91 @@
+import sys
+import struct
+import argparse
+import zlib
+
+try:
+    from bsdiff4 import core as bsdiff_core
+except ImportError:
+    bsdiff_core = None
+
+CONTROL_FORMAT = "<IIi"
+
+
+def make_patch(old, new):
+    """Returns a FastBLEOTA delta patch that rebuilds new from old.
+
+    The patch is a sequence of records, each a control block of (diff length, extra length, seek) followed by
+    diff length bytes that are added to old and extra length literal bytes, the streamable layout of bsdiff.
+    """
+    if bsdiff_core is not None:
+        control, diff_block, extra_block = bsdiff_core.diff(old, new)
+    else:
+        # Without bsdiff4 fall back to diffing the images in place, unchanged regions still become runs of zeros
+        overlap = min(len(old), len(new))
+        control = [(overlap, len(new) - overlap, 0)]
+        diff_block = bytes((new[i] - old[i]) & 0xFF for i in range(overlap))
+        extra_block = new[overlap:]
+
+    patch = bytearray()
+    diff_pos = 0
+    extra_pos = 0
+    for diff_length, extra_length, seek in control:
+        patch += struct.pack(CONTROL_FORMAT, diff_length, extra_length, seek)
+        patch += diff_block[diff_pos:diff_pos + diff_length]
+        patch += extra_block[extra_pos:extra_pos + extra_length]
+        diff_pos += diff_length
+        extra_pos += extra_length
+    return bytes(patch)
+
+
+def apply_patch(old, patch):
+    """Rebuilds the new image the same way the device does, used to check a patch before sending it."""
+    new = bytearray()
+    old_pos = 0
+    pos = 0
+    control_size = struct.calcsize(CONTROL_FORMAT)
+    while pos < len(patch):
+        diff_length, extra_length, seek = struct.unpack_from(CONTROL_FORMAT, patch, pos)
+        pos += control_size
+        if old_pos + diff_length > len(old):
+            raise ValueError("Patch reads past the end of the old image")
+        new += bytes((old[old_pos + i] + patch[pos + i]) & 0xFF for i in range(diff_length))
+        pos += diff_length
+        old_pos += diff_length
+        new += patch[pos:pos + extra_length]
+        pos += extra_length
+        old_pos += seek
+    return bytes(new)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="FastBLEOTA delta patch generator")
+    parser.add_argument('--old', type=str, help='Firmware currently running on the device', required=True)
+    parser.add_argument('--new', type=str, help='Firmware to update to', required=True)
+    parser.add_argument('--output', type=str, help='Patch file path', required=True)
+
+    args = parser.parse_args()
+
+    with open(args.old, 'rb') as f:
+        old = f.read()
+    with open(args.new, 'rb') as f:
+        new = f.read()
+
+    if bsdiff_core is None:
+        print("bsdiff4 is not installed, falling back to an in-place diff (pip install bsdiff4 for smaller patches)")
+
+    patch = make_patch(old, new)
+    if apply_patch(old, patch) != new:
+        print("Generated patch does not reproduce the new image")
+        sys.exit(1)
+
+    with open(args.output, 'wb') as f:
+        f.write(patch)
+
+    compressed_size = len(zlib.compress(patch, 9))
+    print(f"Image size: {len(new)} bytes")
+    print(f"Patch size: {len(patch)} bytes, {compressed_size} bytes compressed ({compressed_size / len(new) * 100:.2f}% of the image)")
+
+
+if __name__ == "__main__":
+    main()
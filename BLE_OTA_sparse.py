@@ -0,0 +1,124 @@
+import sys
+import time
+import struct
+import argparse
+import zlib
+
+RECORD_FORMAT = "<BBI"
+SPARSE_LITERAL = 0
+SPARSE_FILL = 1
+FILL_VALUES = (0xFF, 0x00)
+# A fill record splits a literal in two, so shorter runs would cost more than they save
+MIN_FILL_RUN = 2 * struct.calcsize(RECORD_FORMAT)
+
+
+def find_runs(image, min_run=MIN_FILL_RUN):
+    """Yields (offset, length, value) for every run of 0xFF or 0x00 of at least min_run bytes."""
+    for value in FILL_VALUES:
+        pattern = bytes((value,)) * min_run
+        pos = image.find(pattern)
+        while pos != -1:
+            end = pos + min_run
+            while end < len(image) and image[end] == value:
+                end += 1
+            yield pos, end - pos, value
+            pos = image.find(pattern, end)
+
+
+def make_sparse(image, min_run=MIN_FILL_RUN):
+    """Returns the FastBLEOTA sparse encoding of image.
+
+    The stream is a sequence of records, each a (type, value, length) header followed, for a literal record, by
+    length bytes of the image. Fill records stand for length bytes of value, which the device expands itself.
+    """
+    stream = bytearray()
+    pos = 0
+    for offset, length, value in sorted(find_runs(image, min_run)):
+        if offset > pos:
+            stream += struct.pack(RECORD_FORMAT, SPARSE_LITERAL, 0, offset - pos)
+            stream += image[pos:offset]
+        stream += struct.pack(RECORD_FORMAT, SPARSE_FILL, value, length)
+        pos = offset + length
+    if pos < len(image):
+        stream += struct.pack(RECORD_FORMAT, SPARSE_LITERAL, 0, len(image) - pos)
+        stream += image[pos:]
+    return bytes(stream)
+
+
+def expand_sparse(stream):
+    """Rebuilds the image the same way the device does, used to check a stream before sending it."""
+    image = bytearray()
+    pos = 0
+    record_size = struct.calcsize(RECORD_FORMAT)
+    while pos < len(stream):
+        record_type, value, length = struct.unpack_from(RECORD_FORMAT, stream, pos)
+        pos += record_size
+        if record_type == SPARSE_LITERAL:
+            if pos + length > len(stream):
+                raise ValueError("Literal record runs past the end of the stream")
+            image += stream[pos:pos + length]
+            pos += length
+        elif record_type == SPARSE_FILL:
+            image += bytes((value,)) * length
+        else:
+            raise ValueError(f"Unknown sparse record type {record_type}")
+    return bytes(image)
+
+
+def benchmark(path):
+    with open(path, 'rb') as f:
+        image = f.read()
+
+    start = time.perf_counter()
+    stream = make_sparse(image)
+    encode_time = time.perf_counter() - start
+
+    start = time.perf_counter()
+    expanded = expand_sparse(stream)
+    expand_time = time.perf_counter() - start
+    if expanded != image:
+        raise ValueError(f"Sparse stream of {path} does not reproduce the image")
+
+    runs = list(find_runs(image))
+    fill_bytes = sum(length for _, length, _ in runs)
+    erased_bytes = sum(length for _, length, value in runs if value == 0xFF)
+    deflated = len(zlib.compress(image, 9))
+    sparse_deflated = len(zlib.compress(stream, 9))
+    size = max(len(image), 1)
+
+    print(path)
+    print(f"  Image: {len(image)} bytes, {fill_bytes} in fill runs ({fill_bytes / size * 100:.1f}%), "
+          f"{erased_bytes} of them 0xFF")
+    print(f"  Sparse: {len(stream)} bytes ({len(stream) / size * 100:.1f}%), "
+          f"encoded at {len(image) / max(encode_time, 1e-9) / 1e6:.1f} MB/s, "
+          f"expanded at {len(image) / max(expand_time, 1e-9) / 1e6:.1f} MB/s")
+    print(f"  Compressed: {deflated} bytes ({deflated / size * 100:.1f}%), "
+          f"sparse and compressed: {sparse_deflated} bytes ({sparse_deflated / size * 100:.1f}%)")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="FastBLEOTA sparse image encoder")
+    parser.add_argument('files', nargs='+', help='Firmware or filesystem images')
+    parser.add_argument('--output', type=str, help='Write the sparse stream of the single image to this path')
+
+    args = parser.parse_args()
+
+    if args.output:
+        if len(args.files) != 1:
+            parser.error("--output takes a single image")
+        with open(args.files[0], 'rb') as f:
+            image = f.read()
+        stream = make_sparse(image)
+        if expand_sparse(stream) != image:
+            print("Sparse stream does not reproduce the image")
+            sys.exit(1)
+        with open(args.output, 'wb') as f:
+            f.write(stream)
+
+    # Compare the ratios, and how fast the host encodes, for every image given
+    for path in args.files:
+        benchmark(path)
+
+
+if __name__ == "__main__":
+    main()
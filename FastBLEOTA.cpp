@@ -1,111 +1,2132 @@
 #include "FastBLEOTA.h"
+#include <Preferences.h>
+#include <esp_ota_ops.h>
+#include <esp_image_format.h>
+#include <esp_flash.h>
+#include <rom/miniz.h>
+#include <mbedtls/sha256.h>
+#include <esp_rom_crc.h>
+#include <new>
 
-NimBLEService* FastBLEOTA::_pService = nullptr;
-NimBLECharacteristic* FastBLEOTA::_pCharacteristic = nullptr;
-size_t FastBLEOTA::_expectedSize = 0;
-size_t FastBLEOTA::_receivedSize = 0;
-bool FastBLEOTA::_sizeReceived = false;
+#if defined(CONFIG_BT_NIMBLE_L2CAP_COC_MAX_NUM) && CONFIG_BT_NIMBLE_L2CAP_COC_MAX_NUM > 0
+#define FASTBLEOTA_L2CAP_SUPPORTED 1
+#if defined(CONFIG_NIMBLE_CPP_IDF)
+#include "host/ble_hs.h"
+#else
+#include "nimble/nimble/host/include/host/ble_hs.h"
+#endif
+#endif
 
-FastBLEOTACallbacks* FastBLEOTA::_callbacks = nullptr;
+#define OTA_SERVICE_UUID        "4e8cbb5e-bc0f-4aab-a6e8-55e662418bef"
+#define OTA_CHARACTERISTIC_UUID "513fcda9-f46d-4e41-ac4f-42b768495a85"
+
+#define FLASH_SECTOR_SIZE 4096
+
+#define WATCHDOG_RETRY_MS 50 //!< How soon the watchdog checks again when a chunk is being written as it fires
+
+static_assert(FASTBLEOTA_IMAGE_HEAD_SIZE ==
+              sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t),
+              "FASTBLEOTA_IMAGE_HEAD_SIZE must cover the image header, first segment header and app description");
+static_assert(FASTBLEOTA_WRITE_BLOCK_SIZE >= FASTBLEOTA_IMAGE_HEAD_SIZE,
+              "FASTBLEOTA_WRITE_BLOCK_SIZE must hold the whole image head, so it is checked before anything is written");
+
+#define RESUME_NAMESPACE "fastbleota"
+#define RESUME_KEY       "resume" //!< Followed by the partition address, so every partition keeps a record of its own
+
+#define CLAIM_SLOTS 4 //!< Partitions that can have a session open at once, across every engine
+
+#define CHARACTERISTIC_SLOTS 4 //!< Targets that can add their characteristic to the OTA service
+
+// Persisted identity and progress of a resumable transfer
+typedef struct {
+  uint32_t partitionAddress;
+  uint32_t imageSize;
+  uint8_t sha256[32];
+  uint32_t offset; //!< Sector aligned, everything before it is on flash
+} resume_record_t;
+
+// Arduino partition tables mark LittleFS partitions with the SPIFFS subtype too, which is also what Update looks for
+static const esp_partition_t* findTargetPartition(fastbleota_target_t target) {
+  if (target == FASTBLEOTA_TARGET_FILESYSTEM) {
+    return esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, nullptr);
+  }
+  return esp_ota_get_next_update_partition(nullptr);
+}
+
+static inline size_t alignToSector(size_t offset) {
+  return (offset + FLASH_SECTOR_SIZE - 1) & ~(size_t)(FLASH_SECTOR_SIZE - 1);
+}
+
+static void resumeKey(char (&key)[16], const esp_partition_t* partition) {
+  snprintf(key, sizeof(key), RESUME_KEY "%08lx", (unsigned long)partition->address);
+}
+
+// Partitions with a session open on them, shared by every engine so two engines never write the same partition
+static portMUX_TYPE claimsMux = portMUX_INITIALIZER_UNLOCKED;
+static const esp_partition_t* claims[CLAIM_SLOTS] = {};
+
+static bool claimPartition(const esp_partition_t* partition) {
+  int8_t slot = -1;
+  bool claimed = false;
+
+  portENTER_CRITICAL(&claimsMux);
+  for (int8_t i = 0; i < CLAIM_SLOTS; i++) {
+    if (!claims[i]) {
+      if (slot < 0) slot = i;
+    }
+    else if (claims[i]->address == partition->address) {
+      slot = -1;
+      break;
+    }
+  }
+  if (slot >= 0) {
+    claims[slot] = partition;
+    claimed = true;
+  }
+  portEXIT_CRITICAL(&claimsMux);
+  return claimed;
+}
+
+static void unclaimPartition(const esp_partition_t* partition) {
+  portENTER_CRITICAL(&claimsMux);
+  for (int8_t i = 0; i < CLAIM_SLOTS; i++) {
+    if (claims[i] == partition) claims[i] = nullptr;
+  }
+  portEXIT_CRITICAL(&claimsMux);
+}
+
+/**
+ * Erases the sectors ahead of the write cursor from a low priority task, so writes that program the partition
+ * directly only ever program flash that is already erased. Update and esp_ota_write erase every sector they
+ * write themselves, so only the partition sink and resumable transfers use it.
+ */
+class PreEraser {
+  public:
+    bool start() {
+      if (_taskHandle) return true;
+
+      _lock = xSemaphoreCreateMutex();
+      _erased = xSemaphoreCreateBinary();
+      if (!_lock || !_erased) return false;
+
+      BaseType_t created = xTaskCreatePinnedToCore(
+        PreEraser::eraserTask,
+        "FastBLEOTAErase",
+        FASTBLEOTA_ERASER_TASK_STACK_SIZE,
+        this,
+        FASTBLEOTA_ERASER_TASK_PRIORITY,
+        &_taskHandle,
+        FASTBLEOTA_ERASER_TASK_CORE
+      );
+
+      if (created != pdPASS) {
+        _taskHandle = nullptr;
+        return false;
+      }
+      return true;
+    }
+
+    // Everything before erasedSize is already erased, nothing at or past limit is ever erased
+    void begin(const esp_partition_t* partition, size_t erasedSize, size_t limit) {
+      xSemaphoreTake(_lock, portMAX_DELAY);
+      _partition = partition;
+      _cursor = erasedSize;
+      _erasedSize = erasedSize;
+      _limit = limit;
+      _failed = false;
+      _stopped = false;
+      _aheadMin = UINT16_MAX;
+      _stallTimeUs = 0;
+      _eraseTimeUs = 0;
+      xSemaphoreGive(_lock);
+
+      xTaskNotifyGive(_taskHandle);
+    }
+
+    // Waits, only if the eraser has fallen behind, until everything up to end is erased
+    bool prepare(size_t offset, size_t end) {
+      if (_stopped || end > _limit) return false;
+
+      // The window is kept ahead of the end of the write, a single write may span more sectors than the window
+      _cursor = end;
+      xTaskNotifyGive(_taskHandle);
+
+      size_t erasedSize = _erasedSize;
+      uint16_t ahead = erasedSize > offset ? (erasedSize - offset) / FLASH_SECTOR_SIZE : 0;
+      if (ahead < _aheadMin) _aheadMin = ahead;
+      if (end <= erasedSize) return true;
+
+      uint32_t start = micros();
+      while (end > _erasedSize && !_failed && !_stopped) xSemaphoreTake(_erased, portMAX_DELAY);
+      _stallTimeUs += micros() - start;
+      return end <= _erasedSize && !_failed;
+    }
+
+    // Returns once the sector being erased is done, so the partition can be handed to another writer. A write still
+    // waiting for its sectors is woken and fails
+    void stop() {
+      if (!_lock) return;
+      xSemaphoreTake(_lock, portMAX_DELAY);
+      _partition = nullptr;
+      _stopped = true;
+      xSemaphoreGive(_lock);
+      xSemaphoreGive(_erased);
+    }
+
+    uint16_t aheadMin() const { return _aheadMin == UINT16_MAX ? 0 : _aheadMin; }
+    uint32_t stallTimeUs() const { return _stallTimeUs; }
+    uint32_t eraseTimeUs() const { return _eraseTimeUs; }
+
+  private:
+    static void eraserTask(void* pvParameters) {
+      PreEraser* eraser = (PreEraser*)pvParameters;
+      for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // One sector at a time, so a session ending never waits for more than a single erase
+        for (;;) {
+          xSemaphoreTake(eraser->_lock, portMAX_DELAY);
+          size_t target = alignToSector(eraser->_cursor) + FASTBLEOTA_ERASE_AHEAD_SECTORS * FLASH_SECTOR_SIZE;
+          if (target > eraser->_limit) target = eraser->_limit;
+
+          bool erasing = eraser->_partition && !eraser->_failed && eraser->_erasedSize < target;
+          if (erasing) {
+            uint32_t start = micros();
+            if (esp_partition_erase_range(eraser->_partition, eraser->_erasedSize, FLASH_SECTOR_SIZE) == ESP_OK) {
+              eraser->_erasedSize += FLASH_SECTOR_SIZE;
+            }
+            else {
+              eraser->_failed = true;
+            }
+            eraser->_eraseTimeUs += micros() - start;
+          }
+          xSemaphoreGive(eraser->_lock);
+
+          if (!erasing) break;
+          xSemaphoreGive(eraser->_erased);
+        }
+      }
+    }
+
+    TaskHandle_t _taskHandle = nullptr;
+    SemaphoreHandle_t _lock = nullptr;
+    SemaphoreHandle_t _erased = nullptr;
+    const esp_partition_t* _partition = nullptr;
+    volatile size_t _cursor = 0;
+    volatile size_t _erasedSize = 0;
+    size_t _limit = 0;
+    volatile bool _failed = false;
+    volatile bool _stopped = true;
+    uint16_t _aheadMin = UINT16_MAX;
+    uint32_t _stallTimeUs = 0;
+    volatile uint32_t _eraseTimeUs = 0;
+};
+
+/**
+ * Flash sinks share the same interface, so the one chosen with FASTBLEOTA_SINK is called directly and inlined into
+ * the write path. Each engine owns its sink, and every sink must tolerate abort() without a session in progress and
+ * fail write() and skip() once the session is ended or aborted.
+ * Sinks that program the partition directly can skip() a range of 0xFF, leaving it erased instead of programming it.
+ */
+class UpdateSink {
+  public:
+    bool begin(size_t size, fastbleota_target_t target) {
+      return _update.begin(size, target == FASTBLEOTA_TARGET_FILESYSTEM ? U_SPIFFS : U_FLASH);
+    }
+
+    bool write(const uint8_t* data, size_t length) {
+      return _update.isRunning() && _update.write((uint8_t*)data, length) == length;
+    }
+    bool end() { return _update.end(); }
+    void abort() { _update.abort(); }
+    void printError() { _update.printError(Serial); }
+    void setEraser(PreEraser* eraser) {}
+    bool canSkip() const { return false; }
+    bool skip(size_t length) { return false; }
+
+  private:
+    // An UpdateClass of its own rather than the Update singleton, so targets updating at once do not share state
+    UpdateClass _update;
+};
+
+// Programs the target partition with no image checks until an app image is made bootable
+class PartitionSink {
+  public:
+    // A resumed transfer starts at the sector aligned offset it saved, sectors past it are erased again
+    bool begin(size_t size, fastbleota_target_t target, size_t offset = 0) {
+      _partition = findTargetPartition(target);
+      _target = target;
+      _offset = offset;
+      _erasedSize = offset;
+      _error = !_partition ? ESP_ERR_NOT_FOUND : size > _partition->size ? ESP_ERR_INVALID_SIZE : ESP_OK;
+      if (_error == ESP_OK && _eraser) _eraser->begin(_partition, offset, alignToSector(size));
+      if (_error != ESP_OK) _partition = nullptr;
+      return _error == ESP_OK;
+    }
+
+    bool write(const uint8_t* data, size_t length) {
+      if (!_partition || !erase(_offset + length)) return false;
+
+      _error = esp_partition_write(_partition, _offset, data, length);
+      _offset += length;
+      return _error == ESP_OK;
+    }
+
+    bool skip(size_t length) {
+      if (!_partition || !erase(_offset + length)) return false;
+      _offset += length;
+      return true;
+    }
+
+    // Flash encryption stores 0xFF as ciphertext, so only an unencrypted partition reads back 0xFF once erased
+    bool canSkip() const { return _partition && !_partition->encrypted; }
+
+    bool end() {
+      if (!_partition) return false;
+      // Setting the boot partition verifies the image first, so a corrupt image is never booted
+      if (_eraser) _eraser->stop();
+      _error = _target == FASTBLEOTA_TARGET_APP ? esp_ota_set_boot_partition(_partition) : ESP_OK;
+      _partition = nullptr;
+      return _error == ESP_OK;
+    }
+
+    void abort() {
+      if (_eraser) _eraser->stop();
+      _partition = nullptr;
+    }
+
+    void printError() { log_e("OTA write failed: %s", esp_err_to_name(_error)); }
+    void setEraser(PreEraser* eraser) { _eraser = eraser; }
+
+    const esp_partition_t* partition() const { return _partition; }
+    size_t offset() const { return _offset; }
+
+  private:
+    bool erase(size_t end) {
+      if (_eraser) {
+        if (!_eraser->prepare(_offset, end)) {
+          _error = ESP_FAIL;
+          return false;
+        }
+      }
+      else if (end > _erasedSize) {
+        size_t eraseEnd = alignToSector(end);
+        _error = esp_partition_erase_range(_partition, _erasedSize, eraseEnd - _erasedSize);
+        if (_error != ESP_OK) return false;
+        _erasedSize = eraseEnd;
+      }
+      return true;
+    }
+
+    PreEraser* _eraser = nullptr;
+    const esp_partition_t* _partition = nullptr;
+    fastbleota_target_t _target = FASTBLEOTA_TARGET_APP;
+    size_t _offset = 0;
+    size_t _erasedSize = 0;
+    esp_err_t _error = ESP_OK;
+};
+
+// Writes blocks straight to the partition, without Update copying them into its own buffer first
+class EspOtaSink {
+  public:
+    bool begin(size_t size, fastbleota_target_t target) {
+      abort();
+      // esp_ota only writes app partitions, a filesystem image is programmed into its partition as is
+      _filesystem = target == FASTBLEOTA_TARGET_FILESYSTEM;
+      if (_filesystem) return _filesystemSink.begin(size, target);
+
+      _partition = findTargetPartition(target);
+      _error = !_partition ? ESP_ERR_NOT_FOUND : size > _partition->size ? ESP_ERR_INVALID_SIZE : ESP_OK;
+      if (_error != ESP_OK) return false;
+#ifdef OTA_WITH_SEQUENTIAL_WRITES
+      // Sectors are erased as the writes reach them instead of all at once, which would stall the BLE host for seconds
+      _error = esp_ota_begin(_partition, OTA_WITH_SEQUENTIAL_WRITES, &_handle);
+#else
+      _error = esp_ota_begin(_partition, size, &_handle);
+#endif
+      return _error == ESP_OK;
+    }
+
+    bool write(const uint8_t* data, size_t length) {
+      if (_filesystem) return _filesystemSink.write(data, length);
+      if (!_handle) return false;
+
+      _error = esp_ota_write(_handle, data, length);
+      return _error == ESP_OK;
+    }
+
+    bool end() {
+      if (_filesystem) return _filesystemSink.end();
+      if (!_handle) return false;
+
+      _error = esp_ota_end(_handle);
+      _handle = 0;
+      if (_error == ESP_OK) _error = esp_ota_set_boot_partition(_partition);
+      return _error == ESP_OK;
+    }
+
+    void abort() {
+      _filesystemSink.abort();
+      if (_handle) esp_ota_abort(_handle);
+      _handle = 0;
+    }
+
+    void printError() {
+      if (_filesystem) _filesystemSink.printError();
+      else log_e("OTA write failed: %s", esp_err_to_name(_error));
+    }
+
+    void setEraser(PreEraser* eraser) { _filesystemSink.setEraser(eraser); }
+    bool canSkip() const { return _filesystem; }
+    bool skip(size_t length) { return _filesystem && _filesystemSink.skip(length); }
+
+  private:
+    const esp_partition_t* _partition = nullptr;
+    esp_ota_handle_t _handle = 0;
+    esp_err_t _error = ESP_OK;
+    bool _filesystem = false;
+    PartitionSink _filesystemSink;
+};
+
+// Writes the image to a file, which on a workstation lets the whole pipeline run without flash
+class FileSink {
+  public:
+    bool begin(size_t size, fastbleota_target_t target) {
+      abort();
+      _path = target == FASTBLEOTA_TARGET_FILESYSTEM ? FASTBLEOTA_SINK_FILESYSTEM_FILE_PATH : FASTBLEOTA_SINK_FILE_PATH;
+      _file = fopen(_path, "wb");
+      return _file != nullptr;
+    }
+
+    bool write(const uint8_t* data, size_t length) { return _file && fwrite(data, 1, length, _file) == length; }
+
+    bool end() {
+      if (!_file) return false;
+      bool closed = fclose(_file) == 0;
+      _file = nullptr;
+      return closed;
+    }
+
+    void abort() {
+      if (!_file) return;
+      fclose(_file);
+      _file = nullptr;
+      remove(_path);
+    }
+
+    void printError() { log_e("OTA write to %s failed: %s", _path, strerror(errno)); }
+    void setEraser(PreEraser* eraser) {}
+    bool canSkip() const { return false; }
+    bool skip(size_t length) { return false; }
+
+  private:
+    FILE* _file = nullptr;
+    const char* _path = FASTBLEOTA_SINK_FILE_PATH;
+};
+
+#if FASTBLEOTA_SINK == FASTBLEOTA_SINK_ESP_OTA
+typedef EspOtaSink FlashSink;
+#elif FASTBLEOTA_SINK == FASTBLEOTA_SINK_PARTITION
+typedef PartitionSink FlashSink;
+#elif FASTBLEOTA_SINK == FASTBLEOTA_SINK_FILE
+typedef FileSink FlashSink;
+#else
+typedef UpdateSink FlashSink;
+#endif
+
+struct FastBLEOTAEngine::Sink : public FlashSink {};
+struct FastBLEOTAEngine::ResumeSink : public PartitionSink {};
+struct FastBLEOTAEngine::Eraser : public PreEraser {};
+
+// Counter of the engine whose chunk the current task is ingesting, heap allocations the task makes meanwhile are
+// attributed to that engine's hot path. Kept per task, so engines ingesting on different tasks at once count apart
+static thread_local volatile uint32_t* ingestAllocations = nullptr;
+
+class IngestScope {
+  public:
+    IngestScope(volatile uint32_t* allocations) : _previousAllocations(ingestAllocations) {
+      ingestAllocations = allocations;
+    }
+
+    ~IngestScope() {
+      ingestAllocations = _previousAllocations;
+    }
+
+  private:
+    volatile uint32_t* _previousAllocations;
+};
+
+#if CONFIG_HEAP_USE_HOOKS && !defined(FASTBLEOTA_NO_HEAP_HOOKS)
+#include <esp_heap_caps.h>
+
+extern "C" void esp_heap_trace_alloc_hook(void* ptr, size_t size, uint32_t caps) {
+  // Task local storage only exists once the scheduler runs, and nothing is ingested before then
+  if (xTaskGetSchedulerState() == taskSCHEDULER_NOT_STARTED) return;
+  volatile uint32_t* allocations = ingestAllocations;
+  if (allocations) (*allocations)++;
+}
+
+extern "C" void esp_heap_trace_free_hook(void* ptr) {}
+#endif
+
+enum {
+  EVENT_START,
+  EVENT_PROGRESS,
+  EVENT_COMPLETE,
+  EVENT_ERROR,
+  EVENT_LATCHED //!< Wakes the dispatcher for an outcome latched while the queue was full
+};
+
+struct FastBLEOTAEngine::Event {
+  uint8_t type;
+  uint32_t value; //!< Expected size for EVENT_START, error code for EVENT_ERROR
+};
+
+struct FastBLEOTAEngine::Chunk {
+  uint32_t generation; //!< Session the chunk was received in, chunks of a session reset since are dropped
+  size_t length;
+  uint8_t data[FASTBLEOTA_MAX_CHUNK_SIZE];
+};
+
+// The 32 KB window doubles as the output buffer, so inflated bytes are written to flash straight out of it
+struct FastBLEOTAEngine::Inflater {
+  tinfl_decompressor decompressor;
+  tinfl_status status;
+  size_t windowOffset;
+  uint8_t window[TINFL_LZ_DICT_SIZE];
+};
+
+#if FASTBLEOTA_L2CAP_SUPPORTED
+struct FastBLEOTAEngine::Channel {
+  // Receive buffers handed to the L2CAP channel, an SDU that does not fit one block is chained across several
+  os_membuf_t memory[OS_MEMPOOL_SIZE(FASTBLEOTA_L2CAP_BUFFER_COUNT, FASTBLEOTA_L2CAP_MTU)];
+  struct os_mempool mempool;
+  struct os_mbuf_pool mbufPool;
+  // Chained SDUs are gathered here, since a chunk is processed as one contiguous write
+  uint8_t buffer[FASTBLEOTA_L2CAP_MTU];
+};
+#endif
+
+// NimBLE keeps a pointer to the service definition and reads it when the GATT server starts, so it is static and
+// every target adds its characteristic to it until then
+static ble_uuid_any_t serviceUuid;
+static ble_uuid_any_t characteristicUuids[CHARACTERISTIC_SLOTS];
+static struct ble_gatt_chr_def characteristicDefs[CHARACTERISTIC_SLOTS + 1];
+static struct ble_gatt_svc_def serviceDefs[2];
+static uint8_t characteristicCount = 0;
+
+bool FastBLEOTAEngine::addCharacteristic(const char* uuid) {
+  if (characteristicCount == CHARACTERISTIC_SLOTS) return false;
+  if (characteristicCount == 0) {
+    serviceUuid = *NimBLEUUID(OTA_SERVICE_UUID).getNative();
+    serviceDefs[0].type = BLE_GATT_SVC_TYPE_PRIMARY;
+    serviceDefs[0].uuid = &serviceUuid.u;
+    serviceDefs[0].characteristics = characteristicDefs;
+  }
+
+  struct ble_gatt_chr_def& characteristic = characteristicDefs[characteristicCount];
+  characteristicUuids[characteristicCount] = *NimBLEUUID(uuid).getNative();
+  characteristic.uuid = &characteristicUuids[characteristicCount].u;
+  characteristic.access_cb = FastBLEOTAEngine::gattAccess;
+  characteristic.arg = this;
+  characteristic.flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_NO_RSP |
+                         BLE_GATT_CHR_F_NOTIFY;
+  characteristic.val_handle = &_valueHandle;
+
+  // Reserves the attributes of this characteristic, and of the service along with it, which only the first target
+  // needs but costs an attribute at most for the others
+  struct ble_gatt_chr_def counted[2] = { characteristic, {} };
+  struct ble_gatt_svc_def service[2] = { serviceDefs[0], {} };
+  service[0].characteristics = counted;
+  int rc = ble_gatts_count_cfg(service);
+  if (rc == 0 && characteristicCount == 0) rc = ble_gatts_add_svcs(serviceDefs);
+  if (rc != 0) {
+    characteristic = {};
+    return false;
+  }
+
+  characteristicCount++;
+  return true;
+}
+
+int FastBLEOTAEngine::gattAccess(uint16_t connHandle, uint16_t attrHandle, struct ble_gatt_access_ctxt* ctxt,
+                                 void* arg) {
+  FastBLEOTAEngine* engine = (FastBLEOTAEngine*)arg;
+
+  if (ctxt->op == BLE_GATT_ACCESS_OP_READ_CHR) {
+    fastbleota_stats_t stats = engine->getStats();
+    return os_mbuf_append(ctxt->om, &stats, sizeof(stats)) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+  }
+  if (ctxt->op != BLE_GATT_ACCESS_OP_WRITE_CHR) return 0;
+
+  engine->_connHandle = connHandle;
+  if (!engine->receive(ctxt->om, engine->_valueBuffer, sizeof(engine->_valueBuffer))) {
+    return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+  }
+  return 0;
+}
+
+bool FastBLEOTAEngine::receive(struct os_mbuf* om, uint8_t* buffer, size_t size) {
+  size_t length = OS_MBUF_PKTLEN(om);
+
+  // A value that fits a single mbuf is processed in place, a chain is gathered since a chunk is processed as one
+  // contiguous write. Neither allocates
+  if (om->om_len == length) {
+    write(om->om_data, length);
+  }
+  else if (length <= size && os_mbuf_copydata(om, 0, length, buffer) == 0) {
+    write(buffer, length);
+  }
+  else {
+    rejectChunk(FASTBLEOTA_ERROR_CHUNK_TOO_LARGE);
+    return false;
+  }
+  return true;
+}
+
+FastBLEOTAEngine::FastBLEOTAEngine() {
+  portMUX_INITIALIZE(&_eventMux);
+}
+
+void FastBLEOTAEngine::begin(NimBLEServer* pServer, const char* characteristicUUID) {
+  if (!_lock) _lock = xSemaphoreCreateRecursiveMutex();
+  if (_writerTaskEnabled && !startWriterTask()) {
+    log_e("Failed to start OTA writer task, writing chunks on the BLE host task");
+  }
+  if (_preEraseEnabled && !_eraser) {
+    _eraser = new (std::nothrow) Eraser();
+    if (!_eraser || !_eraser->start()) {
+      delete _eraser;
+      _eraser = nullptr;
+      log_e("Failed to start OTA pre-eraser, erasing sectors as they are written");
+    }
+  }
+  if (_dispatch != FASTBLEOTA_DISPATCH_DIRECT && !startEventDispatch()) {
+    log_e("Failed to start OTA event dispatch, running callbacks directly");
+  }
+  if (!_watchdog) {
+    esp_timer_create_args_t args = {};
+    args.callback = FastBLEOTAEngine::watchdogTimer;
+    args.arg = this;
+    args.name = "FastBLEOTA";
+    if (esp_timer_create(&args, &_watchdog) != ESP_OK) {
+      _watchdog = nullptr;
+      log_e("Failed to create OTA session watchdog, stalled sessions are not torn down");
+    }
+  }
+  // Already registered when begin() is called again
+  ble_gap_event_listener_register(&_gapListener, FastBLEOTAEngine::gapEvent, this);
+
+  reset();
+  _pServer = pServer;
+  // Every target is a characteristic of the same service, registered with the NimBLE host rather than through
+  // NimBLECharacteristic so writes are read straight out of their mbufs instead of being copied for every chunk
+  if (!_characteristicAdded) {
+    _characteristicAdded = addCharacteristic(characteristicUUID ? characteristicUUID : OTA_CHARACTERISTIC_UUID);
+    if (!_characteristicAdded) log_e("Failed to add OTA characteristic, the service holds %d targets", CHARACTERISTIC_SLOTS);
+  }
+}
+
+void FastBLEOTAEngine::write(const uint8_t* data, size_t length) {
+  IngestScope scope(&_heapAllocations);
+  _lastActivity = millis();
+  _stats.chunksReceived++;
+  _stats.bytesReceived += length;
+
+  uint32_t freeHeap = ESP.getFreeHeap();
+  if (freeHeap < _stats.heapLowWater) _stats.heapLowWater = freeHeap;
+
+  if (_writerTaskHandle) {
+    enqueueData(data, length);
+  }
+  else {
+    // Held so the watchdog or a disconnect cannot tear the session down in the middle of a chunk
+    if (_lock) xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+    ingestData(data, length);
+    if (_lock) xSemaphoreGiveRecursive(_lock);
+  }
+}
+
+void FastBLEOTAEngine::ingestData(const uint8_t* data, size_t length) {
+  uint32_t start = micros();
+  processData(data, length);
+  uint32_t elapsed = micros() - start;
+
+  // Bucket i holds chunks that took less than 2^i microseconds, enough resolution for percentiles at no cost
+  uint8_t bucket = elapsed ? 32 - __builtin_clz(elapsed) : 0;
+  if (bucket > 31) bucket = 31;
+  _chunkTimeHistogram[bucket]++;
+
+  _stats.ingestTimeUs += elapsed;
+  if (elapsed > _stats.chunkTimeMaxUs) _stats.chunkTimeMaxUs = elapsed;
+}
+
+void FastBLEOTAEngine::reset() {
+  if (_lock) xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+
+  // Discard chunks the writer task has not consumed yet so they cannot leak into the next session. The writer task
+  // may already have taken one off the queue and be waiting for the lock, it drops it for the generation it carries
+  _generation++;
+  if (_readyQueue) {
+    uint8_t slot;
+    while (xQueueReceive(_readyQueue, &slot, 0) == pdTRUE) {
+      xQueueSend(_freeQueue, &slot, 0);
+    }
+  }
+
+  _expectedSize = 0;
+  _receivedSize = 0;
+  _sizeReceived = false;
+  _expectedStreamSize = 0;
+  _receivedStreamSize = 0;
+  _compression = FASTBLEOTA_COMPRESSION_NONE;
+  _encoding = FASTBLEOTA_ENCODING_RAW;
+  _flags = 0;
+  _windowSize = 0;
+  _nextSequence = 0;
+  _unackedChunks = 0;
+  _retransmitRequested = false;
+  _writeBufferSize = 0;
+  _state = FASTBLEOTA_STATE_IDLE;
+  _stats = {};
+  _stats.heapLowWater = ESP.getFreeHeap();
+  memset(_chunkTimeHistogram, 0, sizeof(_chunkTimeHistogram));
+  _heapAllocations = 0;
+  // A resumable transfer leaves what it wrote on flash and in NVS so the next session can continue it
+  abortFlash();
+  _resumable = false;
+  // Releases the SHA peripheral if a session ended before its hash was finished
+  if (_hasher.enabled) mbedtls_sha256_free(&_hasher.context);
+  _hasher.enabled = false;
+  restoreLink();
+  if (_watchdog) esp_timer_stop(_watchdog);
+
+  if (_lock) xSemaphoreGiveRecursive(_lock);
+}
+
+void FastBLEOTAEngine::setWriterTaskEnabled(bool enabled) {
+  _writerTaskEnabled = enabled;
+}
+
+void FastBLEOTAEngine::setPreEraseEnabled(bool enabled) {
+  _preEraseEnabled = enabled;
+}
+
+bool FastBLEOTAEngine::startWriterTask() {
+  if (_writerTaskHandle) return true;
+
+  // Everything the writer task needs is allocated once here, so receiving a chunk never touches the heap
+  _chunks = (Chunk*)malloc(sizeof(Chunk) * FASTBLEOTA_QUEUE_LENGTH);
+  _freeQueue = xQueueCreate(FASTBLEOTA_QUEUE_LENGTH, sizeof(uint8_t));
+  _readyQueue = xQueueCreate(FASTBLEOTA_QUEUE_LENGTH, sizeof(uint8_t));
+
+  if (!_chunks || !_freeQueue || !_readyQueue) {
+    free(_chunks);
+    if (_freeQueue) vQueueDelete(_freeQueue);
+    if (_readyQueue) vQueueDelete(_readyQueue);
+    _chunks = nullptr;
+    _freeQueue = nullptr;
+    _readyQueue = nullptr;
+    return false;
+  }
+
+  for (uint8_t slot = 0; slot < FASTBLEOTA_QUEUE_LENGTH; slot++) {
+    xQueueSend(_freeQueue, &slot, 0);
+  }
+
+  BaseType_t created = xTaskCreatePinnedToCore(
+    FastBLEOTAEngine::writerTask,
+    "FastBLEOTA",
+    FASTBLEOTA_WRITER_TASK_STACK_SIZE,
+    this,
+    FASTBLEOTA_WRITER_TASK_PRIORITY,
+    &_writerTaskHandle,
+    FASTBLEOTA_WRITER_TASK_CORE
+  );
+
+  if (created != pdPASS) {
+    _writerTaskHandle = nullptr;
+    return false;
+  }
+  return true;
+}
+
+void FastBLEOTAEngine::writerTask(void* pvParameters) {
+  FastBLEOTAEngine* engine = (FastBLEOTAEngine*)pvParameters;
+  uint8_t slot;
+  for (;;) {
+    if (xQueueReceive(engine->_readyQueue, &slot, portMAX_DELAY) != pdTRUE) continue;
+
+    xSemaphoreTakeRecursive(engine->_lock, portMAX_DELAY);
+    Chunk& chunk = engine->_chunks[slot];
+    if (chunk.generation == engine->_generation) {
+      IngestScope scope(&engine->_heapAllocations);
+      engine->ingestData(chunk.data, chunk.length);
+    }
+    xSemaphoreGiveRecursive(engine->_lock);
+
+    xQueueSend(engine->_freeQueue, &slot, 0);
+  }
+}
+
+void FastBLEOTAEngine::setLinkTuningEnabled(bool enabled) {
+  _linkTuningEnabled = enabled;
+}
+
+void FastBLEOTAEngine::tuneLink() {
+  // Sessions fed through write() by another transport have no BLE connection to tune
+  ble_gap_conn_desc desc;
+  if (!_pServer || ble_gap_conn_find(_connHandle, &desc) != 0) return;
+
+  Link& link = _link;
+  if (!link.tuned) {
+    link.interval = desc.conn_itvl;
+    link.latency = desc.conn_latency;
+    link.timeout = desc.supervision_timeout;
+    if (ble_gap_read_le_phy(_connHandle, &link.txPhy, &link.rxPhy) != 0) {
+      link.txPhy = 1;
+      link.rxPhy = 1;
+    }
+    link.tuned = true;
+  }
+
+  // Each request is only a preference, the client or the controller may turn it down without failing the session
+  ble_gap_set_prefered_le_phy(_connHandle, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_2M_MASK,
+                              BLE_GAP_LE_PHY_CODED_ANY);
+  _pServer->setDataLen(_connHandle, FASTBLEOTA_DATA_LENGTH);
+  _pServer->updateConnParams(_connHandle, FASTBLEOTA_CONN_INTERVAL_MIN,
+                                         FASTBLEOTA_CONN_INTERVAL_MAX, 0, link.timeout);
+}
+
+void FastBLEOTAEngine::restoreLink() {
+  Link& link = _link;
+  if (!link.tuned) return;
+  link.tuned = false;
+
+  // Nothing to restore once the client has disconnected
+  ble_gap_conn_desc desc;
+  if (ble_gap_conn_find(_connHandle, &desc) != 0) return;
+
+  // PHY values count from 1 for 1M, the preference masks are the matching bits
+  ble_gap_set_prefered_le_phy(_connHandle, 1 << (link.txPhy - 1), 1 << (link.rxPhy - 1),
+                              BLE_GAP_LE_PHY_CODED_ANY);
+  // The data length in use is not exposed by the host, so it goes back to the size every link starts with
+  _pServer->setDataLen(_connHandle, 27);
+  _pServer->updateConnParams(_connHandle, link.interval, link.interval, link.latency,
+                                         link.timeout);
+}
+
+bool FastBLEOTAEngine::beginL2CAP(uint16_t psm) {
+#if FASTBLEOTA_L2CAP_SUPPORTED
+  if (_l2capListening) return true;
+
+  // The pools are set up once, initialising them again would drop buffers a channel still holds
+  if (!_channel) {
+    Channel* channel = (Channel*)malloc(sizeof(Channel));
+    if (!channel) return false;
+    int rc = os_mempool_init(&channel->mempool, FASTBLEOTA_L2CAP_BUFFER_COUNT, FASTBLEOTA_L2CAP_MTU, channel->memory,
+                             "fastbleota");
+    if (rc == 0) rc = os_mbuf_pool_init(&channel->mbufPool, &channel->mempool, FASTBLEOTA_L2CAP_MTU, FASTBLEOTA_L2CAP_BUFFER_COUNT);
+    if (rc != 0) {
+      free(channel);
+      return false;
+    }
+    _channel = channel;
+  }
+
+  _l2capListening = ble_l2cap_create_server(psm, FASTBLEOTA_L2CAP_MTU, FastBLEOTAEngine::l2capEvent, this) == 0;
+  return _l2capListening;
+#else
+  log_e("L2CAP channels are disabled, build NimBLE with CONFIG_BT_NIMBLE_L2CAP_COC_MAX_NUM set to 1 or more");
+  return false;
+#endif
+}
+
+int FastBLEOTAEngine::l2capEvent(struct ble_l2cap_event* event, void* arg) {
+#if FASTBLEOTA_L2CAP_SUPPORTED
+  FastBLEOTAEngine* engine = (FastBLEOTAEngine*)arg;
+  Channel* channel = engine->_channel;
+
+  switch (event->type) {
+    case BLE_L2CAP_EVENT_COC_ACCEPT: {
+      // A channel without a receive buffer could never be granted credits, so it is refused
+      struct os_mbuf* rx = os_mbuf_get_pkthdr(&channel->mbufPool, 0);
+      if (!rx) {
+        log_e("No L2CAP receive buffer free, refusing the channel");
+        return BLE_HS_ENOMEM;
+      }
+      engine->_connHandle = event->accept.conn_handle;
+      return ble_l2cap_recv_ready(event->accept.chan, rx);
+    }
+
+    case BLE_L2CAP_EVENT_COC_DATA_RECEIVED: {
+      struct os_mbuf* sdu = event->receive.sdu_rx;
+      engine->_connHandle = event->receive.conn_handle;
+
+      engine->receive(sdu, channel->buffer, sizeof(channel->buffer));
+      os_mbuf_free_chain(sdu);
+
+      // Without a buffer for the next SDU the client is never granted another credit and the session would stall
+      // until it times out, so the channel is closed and the session fails at once
+      struct os_mbuf* rx = os_mbuf_get_pkthdr(&channel->mbufPool, 0);
+      int rc = rx ? ble_l2cap_recv_ready(event->receive.chan, rx) : BLE_HS_ENOMEM;
+      if (rc != 0) {
+        if (rx) os_mbuf_free_chain(rx);
+        log_e("No L2CAP receive buffer for the next SDU (%d), closing the channel", rc);
+        ble_l2cap_disconnect(event->receive.chan);
+        if (engine->_lock) xSemaphoreTakeRecursive(engine->_lock, portMAX_DELAY);
+        engine->abortSession(FASTBLEOTA_ERROR_L2CAP_BUFFER);
+        if (engine->_lock) xSemaphoreGiveRecursive(engine->_lock);
+      }
+      return 0;
+    }
+
+    default:
+      return 0;
+  }
+#else
+  return 0;
+#endif
+}
+
+void FastBLEOTAEngine::setSessionTimeout(uint32_t timeoutMs) {
+  _sessionTimeout = timeoutMs;
+}
+
+void FastBLEOTAEngine::armWatchdog() {
+  if (!_watchdog || !_sessionTimeout) return;
+
+  // The hot path only records when a chunk arrived, the timer checks it instead of being restarted for every chunk
+  esp_timer_stop(_watchdog);
+  esp_timer_start_once(_watchdog, (uint64_t)_sessionTimeout * 1000);
+}
+
+void FastBLEOTAEngine::watchdogTimer(void* arg) {
+  FastBLEOTAEngine* engine = (FastBLEOTAEngine*)arg;
+
+  // Never hold up the timer task behind a flash write, a chunk is arriving anyway
+  if (xSemaphoreTakeRecursive(engine->_lock, 0) != pdTRUE) {
+    esp_timer_start_once(engine->_watchdog, WATCHDOG_RETRY_MS * 1000);
+    return;
+  }
+
+  uint32_t idle = millis() - engine->_lastActivity;
+  if (!engine->_sizeReceived || !engine->_sessionTimeout) {
+    // Torn down or disabled since the timer was armed
+  }
+  else if (idle < engine->_sessionTimeout) {
+    esp_timer_start_once(engine->_watchdog, (uint64_t)(engine->_sessionTimeout - idle) * 1000);
+  }
+  else {
+    engine->abortSession(FASTBLEOTA_ERROR_TIMEOUT);
+  }
+
+  xSemaphoreGiveRecursive(engine->_lock);
+}
+
+int FastBLEOTAEngine::gapEvent(struct ble_gap_event* event, void* arg) {
+  FastBLEOTAEngine* engine = (FastBLEOTAEngine*)arg;
+  if (event->type == BLE_GAP_EVENT_SUBSCRIBE) {
+    if (event->subscribe.attr_handle != engine->_valueHandle) return 0;
+    if (event->subscribe.cur_notify) engine->_subscriber = event->subscribe.conn_handle;
+    else if (event->subscribe.conn_handle == engine->_subscriber) engine->_subscriber = BLE_HS_CONN_HANDLE_NONE;
+    return 0;
+  }
+
+  if (event->type != BLE_GAP_EVENT_DISCONNECT) return 0;
+  if (event->disconnect.conn.conn_handle == engine->_subscriber) engine->_subscriber = BLE_HS_CONN_HANDLE_NONE;
+  if (event->disconnect.conn.conn_handle != engine->_connHandle) return 0;
+
+  if (engine->_lock) xSemaphoreTakeRecursive(engine->_lock, portMAX_DELAY);
+  if (engine->_sizeReceived) engine->abortSession(FASTBLEOTA_ERROR_DISCONNECTED);
+  engine->_connHandle = BLE_HS_CONN_HANDLE_NONE;
+  if (engine->_lock) xSemaphoreGiveRecursive(engine->_lock);
+  return 0;
+}
+
+void FastBLEOTAEngine::abortSession(fastbleota_error_t error) {
+  // A session that already completed or failed is only released, the client was told how it ended
+  bool receiving = _state == FASTBLEOTA_STATE_RECEIVING;
+  reset();
+  if (receiving) onOTAError(error);
+}
+
+void FastBLEOTAEngine::setCallbackDispatch(fastbleota_dispatch_t dispatch) {
+  _dispatch = dispatch;
+}
+
+bool FastBLEOTAEngine::startEventDispatch() {
+  if (_eventQueue) return true;
+
+  _eventQueue = xQueueCreate(FASTBLEOTA_EVENT_QUEUE_LENGTH, sizeof(Event));
+  if (!_eventQueue) return false;
+  if (_dispatch != FASTBLEOTA_DISPATCH_TASK) return true;
+
+  BaseType_t created = xTaskCreatePinnedToCore(
+    FastBLEOTAEngine::eventTask,
+    "FastBLEOTAEvents",
+    FASTBLEOTA_CALLBACK_TASK_STACK_SIZE,
+    this,
+    FASTBLEOTA_CALLBACK_TASK_PRIORITY,
+    &_eventTaskHandle,
+    FASTBLEOTA_CALLBACK_TASK_CORE
+  );
+
+  if (created != pdPASS) {
+    vQueueDelete(_eventQueue);
+    _eventQueue = nullptr;
+    _eventTaskHandle = nullptr;
+    return false;
+  }
+  return true;
+}
+
+void FastBLEOTAEngine::eventTask(void* pvParameters) {
+  FastBLEOTAEngine* engine = (FastBLEOTAEngine*)pvParameters;
+  Event event;
+  for (;;) {
+    if (xQueueReceive(engine->_eventQueue, &event, portMAX_DELAY) != pdTRUE) continue;
+    engine->dispatchEvent(event.type, event.value);
+    if (uxQueueMessagesWaiting(engine->_eventQueue) == 0) engine->dispatchLatched();
+  }
+}
+
+void FastBLEOTAEngine::handleEvents() {
+  if (_dispatch != FASTBLEOTA_DISPATCH_LOOP || !_eventQueue) return;
+
+  Event event;
+  while (xQueueReceive(_eventQueue, &event, 0) == pdTRUE) {
+    dispatchEvent(event.type, event.value);
+  }
+  dispatchLatched();
+}
+
+void FastBLEOTAEngine::postEvent(uint8_t type, uint32_t value) {
+  // Never wait for the dispatcher, holding up reception is exactly what queuing events avoids
+  Event event = { type, value };
+  if (xQueueSend(_eventQueue, &event, 0) == pdTRUE) return;
+
+  // How a session ended is never dropped, it is latched and dispatched once the events queued before it are
+  if (type == EVENT_COMPLETE || type == EVENT_ERROR) {
+    portENTER_CRITICAL(&_eventMux);
+    if (type == EVENT_COMPLETE) {
+      _completeLatched = true;
+    }
+    else {
+      _errorLatched = true;
+      _latchedError = (fastbleota_error_t)value;
+    }
+    portEXIT_CRITICAL(&_eventMux);
+
+    // Without room for the wake up the queue still holds events, and the dispatcher checks again once it drains
+    Event wake = { EVENT_LATCHED, 0 };
+    xQueueSend(_eventQueue, &wake, 0);
+    return;
+  }
+
+  log_w("OTA event queue full, dropping event %u", type);
+  if (type == EVENT_PROGRESS) _progressQueued = false;
+}
+
+void FastBLEOTAEngine::dispatchEvent(uint8_t type, uint32_t value) {
+  if (!_callbacks) return;
+
+  switch (type) {
+    case EVENT_START:
+      _callbacks->onOTAStart(value);
+      break;
+    case EVENT_PROGRESS: {
+      portENTER_CRITICAL(&_eventMux);
+      size_t receivedSize = _progressReceived;
+      size_t expectedSize = _progressExpected;
+      _progressQueued = false;
+      portEXIT_CRITICAL(&_eventMux);
+
+      _callbacks->onOTAProgress(receivedSize, expectedSize);
+      break;
+    }
+    case EVENT_COMPLETE:
+      _callbacks->onOTAComplete();
+      break;
+    case EVENT_ERROR:
+      _callbacks->onOTAError((fastbleota_error_t)value);
+      break;
+    case EVENT_LATCHED:
+      dispatchLatched();
+      break;
+  }
+}
+
+void FastBLEOTAEngine::dispatchLatched() {
+  if (!_callbacks || (!_completeLatched && !_errorLatched)) return;
+
+  portENTER_CRITICAL(&_eventMux);
+  bool complete = _completeLatched;
+  bool failed = _errorLatched;
+  fastbleota_error_t error = _latchedError;
+  _completeLatched = false;
+  _errorLatched = false;
+  portEXIT_CRITICAL(&_eventMux);
+
+  // Several outcomes latched at once are reported as one of each, the latest error standing for the others
+  if (complete) _callbacks->onOTAComplete();
+  if (failed) _callbacks->onOTAError(error);
+}
+
+void FastBLEOTAEngine::enqueueData(const uint8_t* data, size_t length) {
+  if (length > FASTBLEOTA_MAX_CHUNK_SIZE) {
+    rejectChunk(FASTBLEOTA_ERROR_CHUNK_TOO_LARGE);
+    return;
+  }
+
+  // Blocking here while flash is busy pushes back on the link instead of dropping the chunk
+  uint8_t slot;
+  if (xQueueReceive(_freeQueue, &slot, pdMS_TO_TICKS(FASTBLEOTA_QUEUE_TIMEOUT_MS)) != pdTRUE) {
+    rejectChunk(FASTBLEOTA_ERROR_QUEUE_FULL);
+    return;
+  }
+
+  _chunks[slot].generation = _generation;
+  memcpy(_chunks[slot].data, data, length);
+  _chunks[slot].length = length;
+  xQueueSend(_readyQueue, &slot, 0);
+
+  // Slots missing from the free queue are waiting or being written, a ring that fills up means flash is the bottleneck
+  uint32_t queued = FASTBLEOTA_QUEUE_LENGTH - uxQueueMessagesWaiting(_freeQueue);
+  if (queued > _stats.queueHighWater) _stats.queueHighWater = queued;
+}
+
+void FastBLEOTAEngine::rejectChunk(fastbleota_error_t error) {
+  // Fails the session like an error in processData does, releasing the sink and the partition at once. Chunks still
+  // queued for the writer task are then dropped, as the session is in error
+  if (_lock) xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+  abortFlash();
+  onOTAError(error);
+  if (_lock) xSemaphoreGiveRecursive(_lock);
+}
+
+void FastBLEOTAEngine::notify(const void* data, size_t length) {
+  // The engine can be driven through write() with no client subscribed, in which case there is no one to notify
+  if (_subscriber == BLE_HS_CONN_HANDLE_NONE) return;
+
+  struct os_mbuf* om = ble_hs_mbuf_from_flat(data, length);
+  if (om) ble_gattc_notify_custom(_subscriber, _valueHandle, om);
+}
+
+void FastBLEOTAEngine::onOTAStart(size_t expectedSize) {
+  _state = FASTBLEOTA_STATE_RECEIVING;
+  if (!_callbacks) return;
+
+  if (_eventQueue) postEvent(EVENT_START, expectedSize);
+  else _callbacks->onOTAStart(expectedSize);
+}
+
+void FastBLEOTAEngine::onOTAProgress(size_t receivedSize, size_t expectedSize) {
+  if (!_callbacks) return;
+
+  if (_eventQueue) {
+    portENTER_CRITICAL(&_eventMux);
+    _progressReceived = receivedSize;
+    _progressExpected = expectedSize;
+    bool queued = _progressQueued;
+    _progressQueued = true;
+    portEXIT_CRITICAL(&_eventMux);
+
+    // A progress event already waiting in the queue reports these values when it is dispatched
+    if (!queued) postEvent(EVENT_PROGRESS, 0);
+    return;
+  }
+
+  uint32_t start = micros();
+  _callbacks->onOTAProgress(receivedSize, expectedSize);
+  _stats.callbackTimeUs += micros() - start;
+}
+
+void FastBLEOTAEngine::onOTAComplete() {
+  _state = FASTBLEOTA_STATE_COMPLETE;
+  restoreLink();
+  if (!_callbacks) return;
+
+  if (_eventQueue) postEvent(EVENT_COMPLETE, 0);
+  else _callbacks->onOTAComplete();
+}
+
+void FastBLEOTAEngine::onOTAError(fastbleota_error_t errorCode) {
+  _state = FASTBLEOTA_STATE_ERROR;
+  _lastError = errorCode;
+  restoreLink();
+
+  fastbleota_error_notify_t notification = { FASTBLEOTA_NOTIFY_ERROR, (uint8_t)errorCode };
+  notify(&notification, sizeof(notification));
+  if (!_callbacks) return;
+
+  if (_eventQueue) postEvent(EVENT_ERROR, errorCode);
+  else _callbacks->onOTAError(errorCode);
+}
+
+void FastBLEOTAEngine::processData(const uint8_t* data, size_t length) {
+  if (!_sizeReceived && length == sizeof(fastbleota_query_t)) {
+    fastbleota_query_t query;
+    memcpy(&query, data, sizeof(query));
+    if (query.magic == FASTBLEOTA_QUERY_MAGIC) {
+      answerQuery(query);
+      return;
+    }
+  }
+
+  if (!_sizeReceived) {
+    fastbleota_error_t error = startSession(data, length);
+    // Armed even for a session that failed to start, which still has to be torn down before the next one
+    if (_sizeReceived) armWatchdog();
+    if (error != FASTBLEOTA_ERROR_NONE) {
+      if (error == FASTBLEOTA_ERROR_START_UPDATE) printFlashError();
+      // Releases the partition at once, rather than when the failed session is torn down
+      abortFlash();
+      onOTAError(error);
+      return;
+    }
+
+    if (length != sizeof(uint32_t)) {
+      fastbleota_start_notify_t notification = { FASTBLEOTA_NOTIFY_START, 0, (uint32_t)_receivedStreamSize };
+      notify(&notification, sizeof(notification));
+    }
+
+    // A resumed transfer reports progress relative to where it continues from
+    _reportedSize = _receivedSize;
+    _reportedTime = millis();
+
+    if (_linkTuningEnabled) tuneLink();
+    onOTAStart(_expectedSize);
+
+    // A resumed transfer may already have every byte on flash and only need finalizing
+    if (_resumable && _receivedStreamSize == _expectedStreamSize) {
+      error = finishSession();
+      if (error != FASTBLEOTA_ERROR_NONE) {
+        onOTAError(error);
+        return;
+      }
+
+      onOTAComplete();
+    }
+  }
+  else {
+    // A failed session has already released its sink, whatever the client still sends is dropped until it is reset
+    if (_state == FASTBLEOTA_STATE_ERROR) return;
+    if ((_flags & FASTBLEOTA_FLAG_SEQUENCED) && !acceptSequence(data, length)) return;
+
+    if (_receivedStreamSize + length > _expectedStreamSize) {
+      abortFlash();
+      onOTAError(FASTBLEOTA_ERROR_RECEIVED_MORE);
+      return;
+    }
+    _receivedStreamSize += length;
+
+    fastbleota_error_t error;
+    if (_compression == FASTBLEOTA_COMPRESSION_DEFLATE) {
+      error = inflateData(data, length);
+    }
+    else {
+      error = decodeData(data, length);
+    }
+
+    if (error != FASTBLEOTA_ERROR_NONE) {
+      if (error == FASTBLEOTA_ERROR_WRITE_CHUNK) printFlashError();
+      onOTAError(error);
+      return;
+    }
 
-#define OTA_SERVICE_UUID        "4e8cbb5e-bc0f-4aab-a6e8-55e662418bef"
-#define OTA_CHARACTERISTIC_UUID "513fcda9-f46d-4e41-ac4f-42b768495a85"
+    reportProgress();
+
+    if (_flags & FASTBLEOTA_FLAG_SEQUENCED) {
+      // Acknowledging every half window keeps the client's pipe full without a notification per chunk
+      _unackedChunks++;
+      if (_unackedChunks >= (_windowSize + 1) / 2 ||
+          _receivedStreamSize == _expectedStreamSize) {
+        sendAck(0);
+      }
+    }
+
+    if (_receivedStreamSize == _expectedStreamSize) {
+      error = finishSession();
+      if (error != FASTBLEOTA_ERROR_NONE) {
+        if (error == FASTBLEOTA_ERROR_WRITE_CHUNK || error == FASTBLEOTA_ERROR_FINALIZE_UPDATE) printFlashError();
+        onOTAError(error);
+        return;
+      }
 
-class FastBLEOTA::CharacteristicCallbacks : public NimBLECharacteristicCallbacks {
-  void onWrite(NimBLECharacteristic* pCharacteristic) {
-    std::string value = pCharacteristic->getValue();
-    FastBLEOTA::processData((uint8_t*)value.data(), value.length());
+      onOTAComplete();
+    }
   }
-};
+}
 
-void FastBLEOTA::begin(NimBLEServer* pServer) {
-  FastBLEOTA::reset();
-  _pService = pServer->createService(OTA_SERVICE_UUID);
+fastbleota_error_t FastBLEOTAEngine::startSession(const uint8_t* data, size_t length) {
+  fastbleota_header_t header = {};
 
-  _pCharacteristic = _pService->createCharacteristic(
-    OTA_CHARACTERISTIC_UUID,
-    NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::WRITE | NIMBLE_PROPERTY::WRITE_NR
-  );
+  if (length == sizeof(uint32_t)) {
+    // Copied out, as the write carrying it is not guaranteed to be aligned
+    uint32_t imageSize;
+    memcpy(&imageSize, data, sizeof(imageSize));
+    _expectedSize = imageSize;
+    _expectedStreamSize = _expectedSize;
+    _compression = FASTBLEOTA_COMPRESSION_NONE;
+    _encoding = FASTBLEOTA_ENCODING_RAW;
+    _target = FASTBLEOTA_TARGET_APP;
+  }
+  else {
+    // Headers from older clients stop before the fields added since, those are left zeroed
+    if (length < offsetof(fastbleota_header_t, flags)) return FASTBLEOTA_ERROR_SIZE_MISMATCH;
+    memcpy(&header, data, length < sizeof(header) ? length : sizeof(header));
+
+    if (header.magic != FASTBLEOTA_HEADER_MAGIC) return FASTBLEOTA_ERROR_SIZE_MISMATCH;
+    if (header.headerSize != length) return FASTBLEOTA_ERROR_INVALID_HEADER;
+    // A newer minor version carries every field known here and appends its own, which are ignored. A new major
+    // version may change the meaning of these fields, so it is rejected rather than misread
+    if (header.version < FASTBLEOTA_HEADER_VERSION ||
+        FASTBLEOTA_HEADER_MAJOR(header.version) != FASTBLEOTA_HEADER_MAJOR(FASTBLEOTA_HEADER_VERSION)) {
+      return FASTBLEOTA_ERROR_INVALID_HEADER;
+    }
+    if (header.version > FASTBLEOTA_HEADER_VERSION && length < sizeof(header)) return FASTBLEOTA_ERROR_INVALID_HEADER;
+    if (header.compression > FASTBLEOTA_COMPRESSION_DEFLATE) return FASTBLEOTA_ERROR_INVALID_HEADER;
+    if (header.encoding > FASTBLEOTA_ENCODING_SPARSE) return FASTBLEOTA_ERROR_INVALID_HEADER;
+    if (header.target > FASTBLEOTA_TARGET_FILESYSTEM) return FASTBLEOTA_ERROR_INVALID_HEADER;
 
-  _pCharacteristic->setCallbacks(new CharacteristicCallbacks());
+    // Delta patches are made against the running firmware, which a filesystem image has nothing in common with
+    if (header.target != FASTBLEOTA_TARGET_APP && header.encoding == FASTBLEOTA_ENCODING_DELTA) {
+      return FASTBLEOTA_ERROR_INVALID_HEADER;
+    }
 
-  _pService->start();
-}
+    // A chunk that fails its CRC is recovered by resending it, which needs sequence numbers
+    if ((header.flags & FASTBLEOTA_FLAG_CRC) && !(header.flags & FASTBLEOTA_FLAG_SEQUENCED)) {
+      return FASTBLEOTA_ERROR_INVALID_HEADER;
+    }
 
-void FastBLEOTA::reset() {
-  FastBLEOTA::_expectedSize = 0;
-  FastBLEOTA::_receivedSize = 0;
-  FastBLEOTA::_sizeReceived = false;
-  Update.abort();
+    // Only a raw image maps stream offsets to flash offsets, so only a raw image can be resumed
+    if ((header.flags & FASTBLEOTA_FLAG_RESUMABLE) &&
+        (header.compression != FASTBLEOTA_COMPRESSION_NONE || header.encoding != FASTBLEOTA_ENCODING_RAW ||
+         header.streamSize != header.imageSize)) {
+      return FASTBLEOTA_ERROR_INVALID_HEADER;
+    }
+
+    // The digest is what identifies the image to resume, without it any image of the same size would continue
+    static const uint8_t noDigest[sizeof(header.sha256)] = {};
+    if ((header.flags & FASTBLEOTA_FLAG_RESUMABLE) && memcmp(header.sha256, noDigest, sizeof(noDigest)) == 0) {
+      return FASTBLEOTA_ERROR_INVALID_HEADER;
+    }
+
+    _expectedSize = header.imageSize;
+    _expectedStreamSize = header.streamSize;
+    _compression = (fastbleota_compression_t)header.compression;
+    _encoding = (fastbleota_encoding_t)header.encoding;
+    _target = (fastbleota_target_t)header.target;
+    _flags = header.flags;
+    _resumable = header.flags & FASTBLEOTA_FLAG_RESUMABLE;
+
+    // With the writer task a chunk is only acknowledged once it leaves the ring, so the ring bounds the window
+    uint16_t windowSize = header.windowSize ? header.windowSize : FASTBLEOTA_DEFAULT_WINDOW;
+    if (windowSize > FASTBLEOTA_MAX_WINDOW) windowSize = FASTBLEOTA_MAX_WINDOW;
+    if (_writerTaskHandle && windowSize > FASTBLEOTA_QUEUE_LENGTH) windowSize = FASTBLEOTA_QUEUE_LENGTH;
+    _windowSize = windowSize;
+  }
+  _sizeReceived = true;
+
+  if (_encoding == FASTBLEOTA_ENCODING_DELTA) {
+    _patcher.source = esp_ota_get_running_partition();
+    _patcher.sourceOffset = 0;
+    _patcher.controlSize = 0;
+    _patcher.diffRemaining = 0;
+    _patcher.extraRemaining = 0;
+    _patcher.seek = 0;
+    if (!_patcher.source) return FASTBLEOTA_ERROR_PATCH;
+  }
+
+  if (_encoding == FASTBLEOTA_ENCODING_SPARSE) {
+    _expander.recordSize = 0;
+    _expander.literalRemaining = 0;
+  }
+
+  if (_compression == FASTBLEOTA_COMPRESSION_DEFLATE) {
+    // Allocated on the first compressed session and kept, so later sessions do not fragment the heap
+    if (!_inflater) _inflater = (Inflater*)malloc(sizeof(Inflater));
+    if (!_inflater) return FASTBLEOTA_ERROR_START_UPDATE;
+
+    tinfl_init(&_inflater->decompressor);
+    _inflater->status = TINFL_STATUS_NEEDS_MORE_INPUT;
+    _inflater->windowOffset = 0;
+  }
+
+  // Legacy sessions and clients that leave the digest zeroed are only checked by size
+  static const uint8_t noDigest[sizeof(header.sha256)] = {};
+  _hasher.enabled = memcmp(header.sha256, noDigest, sizeof(noDigest)) != 0;
+  if (_hasher.enabled) {
+    memcpy(_hasher.expected, header.sha256, sizeof(header.sha256));
+    mbedtls_sha256_init(&_hasher.context);
+    mbedtls_sha256_starts(&_hasher.context, 0);
+  }
+
+  fastbleota_error_t error = beginFlash(header.sha256);
+  if (error != FASTBLEOTA_ERROR_NONE) return error;
+
+  // A resumed transfer checked the head of its image in the session that wrote it
+  _imageCheck.pending = _target == FASTBLEOTA_TARGET_APP && _receivedSize == 0;
+
+  // What a resumed transfer already wrote is hashed back from flash, everything after it as it arrives
+  if (_hasher.enabled && _resumable) {
+    return hashPartition(_resumeSink->offset());
+  }
+  return FASTBLEOTA_ERROR_NONE;
 }
 
-void FastBLEOTA::onOTAStart(size_t expectedSize) {
-  if (FastBLEOTA::_callbacks) FastBLEOTA::_callbacks->onOTAStart(expectedSize);
+void FastBLEOTAEngine::answerQuery(const fastbleota_query_t& query) {
+  const esp_partition_t* running = esp_ota_get_running_partition();
+
+  // Hashing the running image reads all of it, so it is done once, on the first query
+  if (!_runningHashed && running && esp_partition_get_sha256(running, _runningSha256) == ESP_OK) {
+    _runningHashed = true;
+  }
+
+  static const uint8_t noDigest[sizeof(query.sha256)] = {};
+  bool hashed = memcmp(query.sha256, noDigest, sizeof(noDigest)) != 0;
+  bool installed = hashed ? _runningHashed && memcmp(query.sha256, _runningSha256, sizeof(_runningSha256)) == 0
+                          : query.version[0] != '\0';
+
+  if (installed && query.version[0] != '\0') {
+    esp_app_desc_t app;
+    installed = running && esp_ota_get_partition_description(running, &app) == ESP_OK &&
+                strncmp(query.version, app.version, sizeof(query.version)) == 0;
+  }
+
+  fastbleota_query_notify_t notification = { FASTBLEOTA_NOTIFY_QUERY, (uint8_t)installed };
+  notify(&notification, sizeof(notification));
 }
 
-void FastBLEOTA::onOTAProgress(size_t receivedSize, size_t expectedSize) {
-  if (FastBLEOTA::_callbacks) FastBLEOTA::_callbacks->onOTAProgress(receivedSize, expectedSize);
+bool FastBLEOTAEngine::acceptSequence(const uint8_t*& data, size_t& length) {
+  // A write too short for its framing was cut off, which is recovered from like a corrupt chunk
+  size_t framing = sizeof(uint16_t) + ((_flags & FASTBLEOTA_FLAG_CRC) ? sizeof(uint32_t) : 0);
+  if (length < framing) {
+    if (_flags & FASTBLEOTA_FLAG_CRC) _stats.crcErrors++;
+    requestRetransmit();
+    return false;
+  }
+
+  if (_flags & FASTBLEOTA_FLAG_CRC) {
+    uint32_t crc;
+    length -= sizeof(crc);
+    memcpy(&crc, data + length, sizeof(crc));
+
+    // The ROM CRC-32 is table driven and matches zlib's crc32, so clients need nothing beyond the standard library
+    uint32_t start = micros();
+    bool valid = esp_rom_crc32_le(0, data, length) == crc;
+    _stats.crcTimeUs += micros() - start;
+
+    if (!valid) {
+      // The sequence number of a corrupt chunk cannot be trusted, so resend from the first chunk not yet accepted
+      _stats.crcErrors++;
+      requestRetransmit();
+      return false;
+    }
+  }
+
+  uint16_t sequence;
+  memcpy(&sequence, data, sizeof(sequence));
+
+  if (sequence != _nextSequence) {
+    // Chunks from before nextSequence are retransmissions already in flight, only a gap needs a rewind
+    bool ahead = (uint16_t)(sequence - _nextSequence) < 0x8000;
+    if (ahead) requestRetransmit();
+    return false;
+  }
+
+  _nextSequence++;
+  _retransmitRequested = false;
+  data += sizeof(sequence);
+  length -= sizeof(sequence);
+  return true;
 }
 
-void FastBLEOTA::onOTAComplete() {
-  if (FastBLEOTA::_callbacks) FastBLEOTA::_callbacks->onOTAComplete();
+void FastBLEOTAEngine::requestRetransmit() {
+  // Asked once per gap, the chunks the client already sent past it would otherwise each rewind it again
+  if (_retransmitRequested) return;
+  _retransmitRequested = true;
+  sendAck(FASTBLEOTA_ACK_RETRANSMIT);
 }
 
-void FastBLEOTA::onOTAError(fastbleota_error_t errorCode) {
-  if (FastBLEOTA::_callbacks) FastBLEOTA::_callbacks->onOTAError(errorCode);
+void FastBLEOTAEngine::sendAck(uint8_t flags) {
+  fastbleota_ack_t ack = {
+    FASTBLEOTA_NOTIFY_ACK,
+    flags,
+    _nextSequence,
+    _windowSize,
+    (uint32_t)_receivedStreamSize
+  };
+  notify(&ack, sizeof(ack));
+  _unackedChunks = 0;
 }
 
-void FastBLEOTA::processData(const uint8_t* data, size_t length) {
-  if (!FastBLEOTA::_sizeReceived) {
-    if (length != sizeof(uint32_t)) {
-      FastBLEOTA::onOTAError(FASTBLEOTA_ERROR_SIZE_MISMATCH);
-      return;
-    }
-    FastBLEOTA::_expectedSize = *((uint32_t*)data);
-    FastBLEOTA::_sizeReceived = true;
+void FastBLEOTAEngine::reportProgress() {
+  size_t receivedSize = _receivedSize;
+  size_t reportedBytes = receivedSize - _reportedSize;
+  if (reportedBytes == 0) return;
 
-    if (!Update.begin(FastBLEOTA::_expectedSize)) {
-      Update.printError(Serial);
-      FastBLEOTA::onOTAError(FASTBLEOTA_ERROR_START_UPDATE);
-      return;
+  bool due = _progressInterval == 0 || receivedSize == _expectedSize;
+  if (!due) {
+    switch (_progressUnit) {
+      case FASTBLEOTA_PROGRESS_BYTES:
+        due = reportedBytes >= _progressInterval;
+        break;
+      case FASTBLEOTA_PROGRESS_PERCENT:
+        due = (uint64_t)reportedBytes * 100 >= (uint64_t)_progressInterval * _expectedSize;
+        break;
+      case FASTBLEOTA_PROGRESS_MS:
+        due = millis() - _reportedTime >= _progressInterval;
+        break;
     }
+  }
+  if (!due) return;
+
+  _reportedSize = receivedSize;
+  _reportedTime = millis();
 
-    FastBLEOTA::onOTAStart(FastBLEOTA::_expectedSize);
+  if (_flags & FASTBLEOTA_FLAG_PROGRESS) {
+    fastbleota_progress_notify_t notification = {
+      FASTBLEOTA_NOTIFY_PROGRESS,
+      0,
+      (uint32_t)receivedSize,
+      (uint32_t)_expectedSize
+    };
+    notify(&notification, sizeof(notification));
   }
-  else {
-    size_t chunkSize = length;
-    size_t written = Update.write((uint8_t*)data, chunkSize);
-    if (written != chunkSize) {
-      Update.printError(Serial);
-      FastBLEOTA::onOTAError(FASTBLEOTA_ERROR_WRITE_CHUNK);
-      return;
+
+  onOTAProgress(receivedSize, _expectedSize);
+}
+
+fastbleota_error_t FastBLEOTAEngine::finishSession() {
+  if (_compression == FASTBLEOTA_COMPRESSION_DEFLATE && _inflater->status != TINFL_STATUS_DONE) {
+    abortFlash();
+    return FASTBLEOTA_ERROR_DECOMPRESS;
+  }
+
+  if (_encoding == FASTBLEOTA_ENCODING_DELTA) {
+    const Patcher& patcher = _patcher;
+    if (patcher.controlSize != 0 || patcher.diffRemaining != 0 || patcher.extraRemaining != 0) {
+      abortFlash();
+      return FASTBLEOTA_ERROR_PATCH;
     }
+  }
 
-    FastBLEOTA::_receivedSize += written;
-    FastBLEOTA::onOTAProgress(FastBLEOTA::_receivedSize, FastBLEOTA::_expectedSize);
+  if (_encoding == FASTBLEOTA_ENCODING_SPARSE &&
+      (_expander.recordSize != 0 || _expander.literalRemaining != 0)) {
+    abortFlash();
+    return FASTBLEOTA_ERROR_DECOMPRESS;
+  }
 
-    if (FastBLEOTA::_receivedSize > FastBLEOTA::_expectedSize) {
-      Update.end();
-      FastBLEOTA::onOTAError(FASTBLEOTA_ERROR_RECEIVED_MORE);
-      return;
+  if (_receivedSize != _expectedSize) {
+    abortFlash();
+    return _encoding == FASTBLEOTA_ENCODING_DELTA ? FASTBLEOTA_ERROR_PATCH : FASTBLEOTA_ERROR_DECOMPRESS;
+  }
+
+  if (!flushWriteBuffer()) return FASTBLEOTA_ERROR_WRITE_CHUNK;
+
+  if (_hasher.enabled && !verifyHash()) {
+    // Resuming would only continue the corrupt image, the next attempt has to start over
+    if (_resumable) clearResumeRecord();
+    abortFlash();
+    return FASTBLEOTA_ERROR_HASH_MISMATCH;
+  }
+
+  if (!endFlash()) return FASTBLEOTA_ERROR_FINALIZE_UPDATE;
+
+  return FASTBLEOTA_ERROR_NONE;
+}
+
+fastbleota_error_t FastBLEOTAEngine::inflateData(const uint8_t* data, size_t length) {
+  Inflater* inflater = _inflater;
+
+  uint32_t flags = TINFL_FLAG_PARSE_ZLIB_HEADER;
+  if (_receivedStreamSize < _expectedStreamSize) flags |= TINFL_FLAG_HAS_MORE_INPUT;
+
+  while (length > 0 || inflater->status == TINFL_STATUS_HAS_MORE_OUTPUT) {
+    if (inflater->status == TINFL_STATUS_DONE) return FASTBLEOTA_ERROR_RECEIVED_MORE;
+
+    size_t inBytes = length;
+    size_t outBytes = TINFL_LZ_DICT_SIZE - inflater->windowOffset;
+    inflater->status = tinfl_decompress(
+      &inflater->decompressor,
+      data, &inBytes,
+      inflater->window, inflater->window + inflater->windowOffset, &outBytes,
+      flags
+    );
+    data += inBytes;
+    length -= inBytes;
+
+    if (inflater->status < TINFL_STATUS_DONE) return FASTBLEOTA_ERROR_DECOMPRESS;
+
+    if (outBytes > 0) {
+      fastbleota_error_t error = decodeData(inflater->window + inflater->windowOffset, outBytes);
+      if (error != FASTBLEOTA_ERROR_NONE) return error;
+      inflater->windowOffset = (inflater->windowOffset + outBytes) & (TINFL_LZ_DICT_SIZE - 1);
+    }
+    else if (inBytes == 0) {
+      return FASTBLEOTA_ERROR_DECOMPRESS;
     }
+  }
+  return FASTBLEOTA_ERROR_NONE;
+}
 
-    if (FastBLEOTA::_receivedSize == FastBLEOTA::_expectedSize) {
-      if (Update.end()) {
-        FastBLEOTA::onOTAComplete();
+fastbleota_error_t FastBLEOTAEngine::decodeData(const uint8_t* data, size_t length) {
+  if (_encoding == FASTBLEOTA_ENCODING_DELTA) return patchData(data, length);
+  if (_encoding == FASTBLEOTA_ENCODING_SPARSE) return expandData(data, length);
+  return writeImage(data, length);
+}
+
+fastbleota_error_t FastBLEOTAEngine::expandData(const uint8_t* data, size_t length) {
+  Expander& expander = _expander;
+
+  while (length > 0) {
+    if (expander.literalRemaining == 0) {
+      size_t copyBytes = sizeof(expander.record) - expander.recordSize;
+      if (copyBytes > length) copyBytes = length;
+      memcpy(expander.record + expander.recordSize, data, copyBytes);
+      expander.recordSize += copyBytes;
+      data += copyBytes;
+      length -= copyBytes;
+
+      if (expander.recordSize < sizeof(expander.record)) break;
+      expander.recordSize = 0;
+
+      fastbleota_sparse_record_t record;
+      memcpy(&record, expander.record, sizeof(record));
+      if (record.type == FASTBLEOTA_SPARSE_LITERAL) {
+        expander.literalRemaining = record.length;
+      }
+      else if (record.type == FASTBLEOTA_SPARSE_FILL) {
+        fastbleota_error_t error = fillImage(record.value, record.length);
+        if (error != FASTBLEOTA_ERROR_NONE) return error;
       }
       else {
-        Update.printError(Serial);
-        FastBLEOTA::onOTAError(FASTBLEOTA_ERROR_FINALIZE_UPDATE);
+        return FASTBLEOTA_ERROR_DECOMPRESS;
+      }
+    }
+    else {
+      size_t literalBytes = expander.literalRemaining;
+      if (literalBytes > length) literalBytes = length;
+
+      fastbleota_error_t error = writeImage(data, literalBytes);
+      if (error != FASTBLEOTA_ERROR_NONE) return error;
+
+      expander.literalRemaining -= literalBytes;
+      data += literalBytes;
+      length -= literalBytes;
+    }
+  }
+  return FASTBLEOTA_ERROR_NONE;
+}
+
+fastbleota_error_t FastBLEOTAEngine::fillImage(uint8_t value, size_t length) {
+  if (_receivedSize + length > _expectedSize) return FASTBLEOTA_ERROR_RECEIVED_MORE;
+
+  uint8_t* fill = _expander.fill;
+  memset(fill, value, sizeof(_expander.fill));
+
+  while (length > 0) {
+    // Erased flash already reads 0xFF, so whole blocks of it are hashed but left unprogrammed
+    if (value == 0xFF && _writeBufferSize == 0 && length >= FASTBLEOTA_WRITE_BLOCK_SIZE && !_resumable &&
+        !_imageCheck.pending && _sink->canSkip()) {
+      size_t blockBytes = length - (length % FASTBLEOTA_WRITE_BLOCK_SIZE);
+
+      if (_hasher.enabled) {
+        uint32_t start = micros();
+        for (size_t hashed = 0; hashed < blockBytes; hashed += sizeof(_expander.fill)) {
+          size_t hashBytes = blockBytes - hashed;
+          if (hashBytes > sizeof(_expander.fill)) hashBytes = sizeof(_expander.fill);
+          mbedtls_sha256_update(&_hasher.context, fill, hashBytes);
+        }
+        _stats.hashTimeUs += micros() - start;
+      }
+
+      if (!_sink->skip(blockBytes)) return FASTBLEOTA_ERROR_WRITE_CHUNK;
+      _receivedSize += blockBytes;
+      length -= blockBytes;
+      continue;
+    }
+
+    // Stopping at the end of the write block lets the rest of a long run of 0xFF be skipped
+    size_t fillBytes = sizeof(_expander.fill);
+    if (fillBytes > FASTBLEOTA_WRITE_BLOCK_SIZE - _writeBufferSize) fillBytes = FASTBLEOTA_WRITE_BLOCK_SIZE - _writeBufferSize;
+    if (fillBytes > length) fillBytes = length;
+
+    fastbleota_error_t error = writeImage(fill, fillBytes);
+    if (error != FASTBLEOTA_ERROR_NONE) return error;
+    length -= fillBytes;
+  }
+  return FASTBLEOTA_ERROR_NONE;
+}
+
+fastbleota_error_t FastBLEOTAEngine::patchData(const uint8_t* data, size_t length) {
+  Patcher& patcher = _patcher;
+
+  while (length > 0) {
+    if (patcher.diffRemaining == 0 && patcher.extraRemaining == 0) {
+      size_t copyBytes = sizeof(patcher.control) - patcher.controlSize;
+      if (copyBytes > length) copyBytes = length;
+      memcpy(patcher.control + patcher.controlSize, data, copyBytes);
+      patcher.controlSize += copyBytes;
+      data += copyBytes;
+      length -= copyBytes;
+
+      if (patcher.controlSize < sizeof(patcher.control)) break;
+      patcher.controlSize = 0;
+      memcpy(&patcher.diffRemaining, patcher.control, sizeof(uint32_t));
+      memcpy(&patcher.extraRemaining, patcher.control + 4, sizeof(uint32_t));
+      memcpy(&patcher.seek, patcher.control + 8, sizeof(int32_t));
+    }
+    else if (patcher.diffRemaining > 0) {
+      size_t diffBytes = patcher.diffRemaining;
+      if (diffBytes > length) diffBytes = length;
+      if (diffBytes > sizeof(patcher.buffer)) diffBytes = sizeof(patcher.buffer);
+      if (patcher.sourceOffset + diffBytes > patcher.source->size) return FASTBLEOTA_ERROR_PATCH;
+
+      if (esp_partition_read(patcher.source, patcher.sourceOffset, patcher.buffer, diffBytes) != ESP_OK) {
+        return FASTBLEOTA_ERROR_PATCH;
       }
+      for (size_t i = 0; i < diffBytes; i++) patcher.buffer[i] += data[i];
+
+      fastbleota_error_t error = writeImage(patcher.buffer, diffBytes);
+      if (error != FASTBLEOTA_ERROR_NONE) return error;
+
+      patcher.sourceOffset += diffBytes;
+      patcher.diffRemaining -= diffBytes;
+      data += diffBytes;
+      length -= diffBytes;
+    }
+    else {
+      size_t extraBytes = patcher.extraRemaining;
+      if (extraBytes > length) extraBytes = length;
+
+      fastbleota_error_t error = writeImage(data, extraBytes);
+      if (error != FASTBLEOTA_ERROR_NONE) return error;
+
+      patcher.extraRemaining -= extraBytes;
+      data += extraBytes;
+      length -= extraBytes;
+    }
+
+    if (patcher.controlSize == 0 && patcher.diffRemaining == 0 && patcher.extraRemaining == 0 && patcher.seek != 0) {
+      if (patcher.seek < 0 && (size_t)(-(int64_t)patcher.seek) > patcher.sourceOffset) return FASTBLEOTA_ERROR_PATCH;
+      patcher.sourceOffset += patcher.seek;
+      patcher.seek = 0;
+    }
+  }
+  return FASTBLEOTA_ERROR_NONE;
+}
+
+fastbleota_error_t FastBLEOTAEngine::writeImage(const uint8_t* data, size_t length) {
+  if (_receivedSize + length > _expectedSize) return FASTBLEOTA_ERROR_RECEIVED_MORE;
+
+  if (_imageCheck.pending) {
+    fastbleota_error_t error = checkImage(data, length);
+    if (error != FASTBLEOTA_ERROR_NONE) {
+      abortFlash();
+      return error;
+    }
+  }
+  _receivedSize += length;
+
+  if (_hasher.enabled) {
+    uint32_t start = micros();
+    mbedtls_sha256_update(&_hasher.context, data, length);
+    _stats.hashTimeUs += micros() - start;
+  }
+
+  while (length > 0) {
+    // Whole blocks that start on a block boundary are written straight from the chunk without copying
+    if (_writeBufferSize == 0 && length >= FASTBLEOTA_WRITE_BLOCK_SIZE) {
+      size_t blockBytes = length - (length % FASTBLEOTA_WRITE_BLOCK_SIZE);
+      if (!writeFlash(data, blockBytes)) return FASTBLEOTA_ERROR_WRITE_CHUNK;
+      data += blockBytes;
+      length -= blockBytes;
+      continue;
+    }
+
+    size_t copyBytes = FASTBLEOTA_WRITE_BLOCK_SIZE - _writeBufferSize;
+    if (copyBytes > length) copyBytes = length;
+    memcpy(_writeBuffer + _writeBufferSize, data, copyBytes);
+    _writeBufferSize += copyBytes;
+    data += copyBytes;
+    length -= copyBytes;
+
+    if (_writeBufferSize == FASTBLEOTA_WRITE_BLOCK_SIZE && !flushWriteBuffer()) {
+      return FASTBLEOTA_ERROR_WRITE_CHUNK;
+    }
+  }
+  return FASTBLEOTA_ERROR_NONE;
+}
+
+bool FastBLEOTAEngine::flushWriteBuffer() {
+  if (_writeBufferSize == 0) return true;
+
+  size_t blockBytes = _writeBufferSize;
+  _writeBufferSize = 0;
+  return writeFlash(_writeBuffer, blockBytes);
+}
+
+fastbleota_error_t FastBLEOTAEngine::hashPartition(size_t length) {
+  uint32_t start = micros();
+
+  // The write buffer is empty until the first chunk arrives, so it doubles as the read buffer
+  for (size_t offset = 0; offset < length; offset += sizeof(_writeBuffer)) {
+    size_t readBytes = length - offset;
+    if (readBytes > sizeof(_writeBuffer)) readBytes = sizeof(_writeBuffer);
+
+    if (esp_partition_read(_resumeSink->partition(), offset, _writeBuffer, readBytes) != ESP_OK) {
+      return FASTBLEOTA_ERROR_RESUME;
+    }
+    mbedtls_sha256_update(&_hasher.context, _writeBuffer, readBytes);
+  }
+
+  _stats.hashTimeUs += micros() - start;
+  return FASTBLEOTA_ERROR_NONE;
+}
+
+bool FastBLEOTAEngine::verifyHash() {
+  uint8_t digest[sizeof(_hasher.expected)];
+
+  uint32_t start = micros();
+  mbedtls_sha256_finish(&_hasher.context, digest);
+  mbedtls_sha256_free(&_hasher.context);
+  _hasher.enabled = false;
+  _stats.hashTimeUs += micros() - start;
+
+  return memcmp(digest, _hasher.expected, sizeof(digest)) == 0;
+}
+
+fastbleota_error_t FastBLEOTAEngine::checkImage(const uint8_t* data, size_t length) {
+  // Flash is written a block at a time, so the head is complete before any of the image reaches flash
+  size_t copyBytes = FASTBLEOTA_IMAGE_HEAD_SIZE - _receivedSize;
+  if (copyBytes > length) copyBytes = length;
+  memcpy(_imageCheck.head + _receivedSize, data, copyBytes);
+  if (_receivedSize + copyBytes < FASTBLEOTA_IMAGE_HEAD_SIZE) return FASTBLEOTA_ERROR_NONE;
+  _imageCheck.pending = false;
+
+  esp_image_header_t image;
+  esp_app_desc_t app;
+  memcpy(&image, _imageCheck.head, sizeof(image));
+  memcpy(&app, _imageCheck.head + sizeof(image) + sizeof(esp_image_segment_header_t), sizeof(app));
+
+  if (image.magic != ESP_IMAGE_HEADER_MAGIC || app.magic_word != ESP_APP_DESC_MAGIC_WORD) {
+    return FASTBLEOTA_ERROR_INVALID_IMAGE;
+  }
+  if (image.chip_id != CONFIG_IDF_FIRMWARE_CHIP_ID) return FASTBLEOTA_ERROR_WRONG_CHIP;
+
+  uint32_t flashSize;
+  if (esp_flash_get_size(NULL, &flashSize) == ESP_OK && ((uint32_t)(1024 * 1024) << image.spi_size) > flashSize) {
+    return FASTBLEOTA_ERROR_FLASH_SIZE;
+  }
+
+#if FASTBLEOTA_CHECK_PROJECT_NAME
+  esp_app_desc_t running;
+  if (esp_ota_get_partition_description(esp_ota_get_running_partition(), &running) == ESP_OK &&
+      strncmp(app.project_name, running.project_name, sizeof(app.project_name)) != 0) {
+    return FASTBLEOTA_ERROR_WRONG_PROJECT;
+  }
+#endif
+
+  return FASTBLEOTA_ERROR_NONE;
+}
+
+fastbleota_error_t FastBLEOTAEngine::beginFlash(const uint8_t* sha256) {
+  // Another engine may be writing the same target, whatever the sink the partition can only take one image
+  const esp_partition_t* partition = findTargetPartition(_target);
+  if (!partition) return FASTBLEOTA_ERROR_START_UPDATE;
+  if (!claimPartition(partition)) {
+    log_e("OTA partition %s is already being updated", partition->label);
+    return FASTBLEOTA_ERROR_START_UPDATE;
+  }
+  _claimedPartition = partition;
+
+  if (!_resumable) {
+    // The sink is about to overwrite the partition a resumable transfer may have been written to
+    clearResumeRecord();
+    // Allocated on the first session and kept, like the inflater
+    if (!_sink) {
+      _sink = new (std::nothrow) Sink();
+      if (_sink) _sink->setEraser(_eraser);
+    }
+    if (!_sink || !_sink->begin(_expectedSize, _target)) return FASTBLEOTA_ERROR_START_UPDATE;
+    return FASTBLEOTA_ERROR_NONE;
+  }
+
+  // Update always restarts from the first byte, so resumable transfers write the target partition directly
+  if (!_resumeSink) {
+    _resumeSink = new (std::nothrow) ResumeSink();
+    if (_resumeSink) _resumeSink->setEraser(_eraser);
+  }
+  if (!_resumeSink || _expectedSize > partition->size) return FASTBLEOTA_ERROR_START_UPDATE;
+
+  char key[16];
+  resumeKey(key, partition);
+
+  resume_record_t record = {};
+  Preferences preferences;
+  if (preferences.begin(RESUME_NAMESPACE, true)) {
+    preferences.getBytes(key, &record, sizeof(record));
+    preferences.end();
+  }
+
+  bool resuming = record.partitionAddress == partition->address &&
+                  record.imageSize == _expectedSize &&
+                  memcmp(record.sha256, sha256, sizeof(record.sha256)) == 0 &&
+                  record.offset <= _expectedSize;
+
+  if (!resuming) {
+    record.partitionAddress = partition->address;
+    record.imageSize = _expectedSize;
+    memcpy(record.sha256, sha256, sizeof(record.sha256));
+    record.offset = 0;
+
+    if (!preferences.begin(RESUME_NAMESPACE, false)) return FASTBLEOTA_ERROR_RESUME;
+    bool saved = preferences.putBytes(key, &record, sizeof(record)) == sizeof(record);
+    preferences.end();
+    if (!saved) return FASTBLEOTA_ERROR_RESUME;
+  }
+
+  if (!_resumeSink->begin(_expectedSize, _target, record.offset)) return FASTBLEOTA_ERROR_START_UPDATE;
+  _savedOffset = record.offset;
+  _receivedSize = record.offset;
+  _receivedStreamSize = record.offset;
+  return FASTBLEOTA_ERROR_NONE;
+}
+
+bool FastBLEOTAEngine::writeFlash(const uint8_t* data, size_t length) {
+  _stats.flashWrites++;
+
+  uint32_t start = micros();
+  bool written = _resumable ? writePartition(data, length)
+                                        : _sink->write(data, length);
+  uint32_t elapsed = micros() - start;
+
+  _stats.flashTimeUs += elapsed;
+  if (elapsed > _stats.flashTimeMaxUs) _stats.flashTimeMaxUs = elapsed;
+  return written;
+}
+
+bool FastBLEOTAEngine::writePartition(const uint8_t* data, size_t length) {
+  if (!_resumeSink->write(data, length)) return false;
+
+  // Failing to save only means a later resume starts further back, so it does not fail the transfer
+  if (_resumeSink->offset() - _savedOffset >= FASTBLEOTA_RESUME_SAVE_INTERVAL &&
+      !saveResumeOffset()) {
+    log_w("Failed to save OTA resume offset");
+  }
+  return true;
+}
+
+bool FastBLEOTAEngine::endFlash() {
+  bool ended = _resumable ? _resumeSink->end() : _sink->end();
+  if (ended && _resumable) clearResumeRecord();
+  releasePartition();
+  return ended;
+}
+
+// A resumable transfer only releases the partition, what it wrote stays on flash and in NVS for the next session
+void FastBLEOTAEngine::abortFlash() {
+  if (_resumable && _resumeSink) _resumeSink->abort();
+  else if (!_resumable && _sink) _sink->abort();
+  releasePartition();
+}
+
+void FastBLEOTAEngine::releasePartition() {
+  if (!_claimedPartition) return;
+  unclaimPartition(_claimedPartition);
+  _claimedPartition = nullptr;
+}
+
+void FastBLEOTAEngine::printFlashError() {
+  if (_resumable && _resumeSink) _resumeSink->printError();
+  else if (!_resumable && _sink) _sink->printError();
+}
+
+bool FastBLEOTAEngine::saveResumeOffset() {
+  char key[16];
+  resumeKey(key, _claimedPartition);
+
+  Preferences preferences;
+  if (!preferences.begin(RESUME_NAMESPACE, false)) return false;
+
+  resume_record_t record = {};
+  bool saved = preferences.getBytes(key, &record, sizeof(record)) == sizeof(record);
+  if (saved) {
+    record.offset = _resumeSink->offset() & ~(size_t)(FLASH_SECTOR_SIZE - 1);
+    saved = preferences.putBytes(key, &record, sizeof(record)) == sizeof(record);
+  }
+  preferences.end();
+
+  if (saved) _savedOffset = record.offset;
+  return saved;
+}
+
+// Only the record of this session's partition, another engine may be resuming a transfer to a different one
+void FastBLEOTAEngine::clearResumeRecord() {
+  if (!_claimedPartition) return;
+  char key[16];
+  resumeKey(key, _claimedPartition);
+
+  Preferences preferences;
+  if (!preferences.begin(RESUME_NAMESPACE, false)) return;
+  if (preferences.isKey(key)) preferences.remove(key);
+  preferences.end();
+}
+
+void FastBLEOTAEngine::setCallbacks(FastBLEOTACallbacks* callbacks) {
+  if (callbacks) _callbacks = callbacks;
+}
+
+fastbleota_target_t FastBLEOTAEngine::getTarget() {
+  return _target;
+}
+
+void FastBLEOTAEngine::setProgressInterval(fastbleota_progress_unit_t unit, uint32_t interval) {
+  _progressUnit = unit;
+  _progressInterval = interval;
+}
+
+fastbleota_stats_t FastBLEOTAEngine::getStats() {
+  fastbleota_stats_t stats = _stats;
+  stats.size = sizeof(stats);
+  stats.state = _state;
+  stats.lastError = _lastError;
+#if CONFIG_HEAP_USE_HOOKS && !defined(FASTBLEOTA_NO_HEAP_HOOKS)
+  stats.heapAllocations = _heapAllocations;
+#else
+  // Nothing is counted without the heap hooks, which must not read as a hot path that never allocates
+  stats.heapAllocations = FASTBLEOTA_NOT_MEASURED;
+#endif
+
+  ble_gap_conn_desc desc;
+  if (ble_gap_conn_find(_connHandle, &desc) == 0) {
+    stats.connInterval = desc.conn_itvl;
+    stats.connLatency = desc.conn_latency;
+    if (ble_gap_read_le_phy(_connHandle, &stats.txPhy, &stats.rxPhy) != 0) {
+      stats.txPhy = 0;
+      stats.rxPhy = 0;
     }
   }
+  if (_link.tuned) stats.dataLength = FASTBLEOTA_DATA_LENGTH;
+  if (_eraser) {
+    stats.eraseAheadMin = _eraser->aheadMin();
+    stats.eraseTimeUs = _eraser->eraseTimeUs();
+    stats.eraseStallTimeUs = _eraser->stallTimeUs();
+  }
+
+  uint32_t chunks = 0;
+  for (uint8_t i = 0; i < 32; i++) chunks += _chunkTimeHistogram[i];
+
+  uint32_t counted = 0;
+  for (uint8_t i = 0; i < 32 && chunks > 0; i++) {
+    counted += _chunkTimeHistogram[i];
+    uint32_t bound = i ? (1UL << i) : 0;
+    if (!stats.chunkTimeP50Us && counted * 2 >= chunks) stats.chunkTimeP50Us = bound;
+    if (!stats.chunkTimeP99Us && counted * 100 >= chunks * 99) stats.chunkTimeP99Us = bound;
+  }
+  return stats;
+}
+
+void FastBLEOTAEngine::printStats(Print& output) {
+  fastbleota_stats_t stats = getStats();
+  uint32_t nsPerByte = stats.bytesReceived ? (uint32_t)((uint64_t)stats.ingestTimeUs * 1000 / stats.bytesReceived) : 0;
+
+  char heapAllocations[12] = "null";
+  if (stats.heapAllocations != FASTBLEOTA_NOT_MEASURED) {
+    snprintf(heapAllocations, sizeof(heapAllocations), "%lu", (unsigned long)stats.heapAllocations);
+  }
+
+  output.printf(
+    "{\"chunksReceived\":%lu,\"bytesReceived\":%lu,\"flashWrites\":%lu,\"heapAllocations\":%s,"
+    "\"ingestTimeUs\":%lu,\"nsPerByte\":%lu,\"chunkTimeP50Us\":%lu,\"chunkTimeP99Us\":%lu,"
+    "\"chunkTimeMaxUs\":%lu,\"callbackTimeUs\":%lu,\"flashTimeUs\":%lu,\"flashTimeMaxUs\":%lu,"
+    "\"queueHighWater\":%lu,\"heapLowWater\":%lu,\"hashTimeUs\":%lu,"
+    "\"crcTimeUs\":%lu,\"crcErrors\":%lu,\"connInterval\":%u,\"connLatency\":%u,"
+    "\"txPhy\":%u,\"rxPhy\":%u,\"dataLength\":%u,\"eraseAheadMin\":%u,\"eraseTimeUs\":%lu,"
+    "\"eraseStallTimeUs\":%lu,\"state\":%u,\"lastError\":%u}\n",
+    (unsigned long)stats.chunksReceived, (unsigned long)stats.bytesReceived,
+    (unsigned long)stats.flashWrites, heapAllocations,
+    (unsigned long)stats.ingestTimeUs, (unsigned long)nsPerByte,
+    (unsigned long)stats.chunkTimeP50Us, (unsigned long)stats.chunkTimeP99Us,
+    (unsigned long)stats.chunkTimeMaxUs, (unsigned long)stats.callbackTimeUs,
+    (unsigned long)stats.flashTimeUs, (unsigned long)stats.flashTimeMaxUs,
+    (unsigned long)stats.queueHighWater, (unsigned long)stats.heapLowWater, (unsigned long)stats.hashTimeUs,
+    (unsigned long)stats.crcTimeUs, (unsigned long)stats.crcErrors,
+    (unsigned)stats.connInterval, (unsigned)stats.connLatency,
+    (unsigned)stats.txPhy, (unsigned)stats.rxPhy, (unsigned)stats.dataLength,
+    (unsigned)stats.eraseAheadMin, (unsigned long)stats.eraseTimeUs, (unsigned long)stats.eraseStallTimeUs,
+    (unsigned)stats.state, (unsigned)stats.lastError
+  );
+}
+
+FastBLEOTAEngine& FastBLEOTA::getDefault() {
+  static FastBLEOTAEngine engine;
+  return engine;
+}
+
+void FastBLEOTA::begin(NimBLEServer* pServer) {
+  FastBLEOTA::getDefault().begin(pServer);
+}
+
+void FastBLEOTA::reset() {
+  FastBLEOTA::getDefault().reset();
+}
+
+void FastBLEOTA::write(const uint8_t* data, size_t length) {
+  FastBLEOTA::getDefault().write(data, length);
 }
 
 void FastBLEOTA::setCallbacks(FastBLEOTACallbacks* callbacks) {
-  if (callbacks) FastBLEOTA::_callbacks = callbacks;
+  FastBLEOTA::getDefault().setCallbacks(callbacks);
+}
+
+fastbleota_target_t FastBLEOTA::getTarget() {
+  return FastBLEOTA::getDefault().getTarget();
+}
+
+void FastBLEOTA::setProgressInterval(fastbleota_progress_unit_t unit, uint32_t interval) {
+  FastBLEOTA::getDefault().setProgressInterval(unit, interval);
+}
+
+void FastBLEOTA::setWriterTaskEnabled(bool enabled) {
+  FastBLEOTA::getDefault().setWriterTaskEnabled(enabled);
+}
+
+void FastBLEOTA::setPreEraseEnabled(bool enabled) {
+  FastBLEOTA::getDefault().setPreEraseEnabled(enabled);
+}
+
+void FastBLEOTA::setCallbackDispatch(fastbleota_dispatch_t dispatch) {
+  FastBLEOTA::getDefault().setCallbackDispatch(dispatch);
+}
+
+void FastBLEOTA::setLinkTuningEnabled(bool enabled) {
+  FastBLEOTA::getDefault().setLinkTuningEnabled(enabled);
+}
+
+void FastBLEOTA::setSessionTimeout(uint32_t timeoutMs) {
+  FastBLEOTA::getDefault().setSessionTimeout(timeoutMs);
+}
+
+bool FastBLEOTA::beginL2CAP(uint16_t psm) {
+  return FastBLEOTA::getDefault().beginL2CAP(psm);
+}
+
+void FastBLEOTA::handleEvents() {
+  FastBLEOTA::getDefault().handleEvents();
 }
 
 const char* FastBLEOTA::getServiceUUID() {
   return OTA_SERVICE_UUID;
-}
\ No newline at end of file
+}
+
+fastbleota_stats_t FastBLEOTA::getStats() {
+  return FastBLEOTA::getDefault().getStats();
+}
+
+void FastBLEOTA::printStats(Print& output) {
+  FastBLEOTA::getDefault().printStats(output);
+}
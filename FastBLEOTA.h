@@ -4,16 +4,345 @@
 #include <Arduino.h>
 #include <NimBLEDevice.h>
 #include <Update.h>
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+#include <esp_timer.h>
+
+#ifndef FASTBLEOTA_MAX_CHUNK_SIZE
+#define FASTBLEOTA_MAX_CHUNK_SIZE 512 //!< Largest chunk the writer task ring can hold (max attribute length)
+#endif
+
+#ifndef FASTBLEOTA_QUEUE_LENGTH
+#define FASTBLEOTA_QUEUE_LENGTH 16 //!< Number of chunk buffers in the writer task ring
+#endif
+
+#ifndef FASTBLEOTA_QUEUE_TIMEOUT_MS
+#define FASTBLEOTA_QUEUE_TIMEOUT_MS 1000 //!< How long onWrite waits for a free chunk buffer before failing
+#endif
+
+#ifndef FASTBLEOTA_WRITE_BLOCK_SIZE
+#define FASTBLEOTA_WRITE_BLOCK_SIZE 4096 //!< Chunks are coalesced into blocks of this size before being written to flash
+#endif
+
+#define FASTBLEOTA_SINK_UPDATE    0 //!< Arduino Update, which copies every write into its own sector buffer
+#define FASTBLEOTA_SINK_ESP_OTA   1 //!< esp_ota_write straight from the coalesced block, validated like Update
+#define FASTBLEOTA_SINK_PARTITION 2 //!< esp_partition_write to the next OTA partition, validated when it is made bootable
+#define FASTBLEOTA_SINK_FILE      3 //!< A file at FASTBLEOTA_SINK_FILE_PATH, for host builds or a mounted filesystem
+
+#ifndef FASTBLEOTA_SINK
+#define FASTBLEOTA_SINK FASTBLEOTA_SINK_UPDATE //!< Where the image is written, chosen at build time so writes inline
+#endif
+
+#ifndef FASTBLEOTA_SINK_FILE_PATH
+#define FASTBLEOTA_SINK_FILE_PATH "firmware.bin" //!< File written by FASTBLEOTA_SINK_FILE
+#endif
+
+#ifndef FASTBLEOTA_SINK_FILESYSTEM_FILE_PATH
+#define FASTBLEOTA_SINK_FILESYSTEM_FILE_PATH "filesystem.bin" //!< File written by FASTBLEOTA_SINK_FILE for filesystem images
+#endif
+
+#define FASTBLEOTA_HEADER_MAGIC   0x41544F46 //!< "FOTA", marks a session header instead of a bare 4-byte size
+#define FASTBLEOTA_HEADER_VERSION 1 //!< High nibble is the major version, a minor revision only appends fields
+#define FASTBLEOTA_HEADER_MAJOR(version) ((version) >> 4)
+#define FASTBLEOTA_QUERY_MAGIC    0x51544F46 //!< "FOTQ", marks a query for whether an image is already installed
+
+#ifndef FASTBLEOTA_PATCH_BUFFER_SIZE
+#define FASTBLEOTA_PATCH_BUFFER_SIZE 512 //!< Bytes of the running image read at a time when applying a delta patch
+#endif
+
+#ifndef FASTBLEOTA_DEFAULT_WINDOW
+#define FASTBLEOTA_DEFAULT_WINDOW 8 //!< Sequenced chunks a client may keep unacknowledged when it does not ask for a window
+#endif
+
+#ifndef FASTBLEOTA_MAX_WINDOW
+#define FASTBLEOTA_MAX_WINDOW 32 //!< Upper bound on the window granted to a client, also bounded by the writer task ring
+#endif
+
+#ifndef FASTBLEOTA_RESUME_SAVE_INTERVAL
+#define FASTBLEOTA_RESUME_SAVE_INTERVAL 65536 //!< Bytes written between saves of the resume offset to NVS
+#endif
+
+#ifndef FASTBLEOTA_PROGRESS_UNIT
+#define FASTBLEOTA_PROGRESS_UNIT FASTBLEOTA_PROGRESS_BYTES //!< Default unit of the progress interval
+#endif
+
+#ifndef FASTBLEOTA_PROGRESS_INTERVAL
+#define FASTBLEOTA_PROGRESS_INTERVAL 0 //!< Default progress interval, 0 reports progress after every chunk
+#endif
+
+#ifndef FASTBLEOTA_FILL_BUFFER_SIZE
+#define FASTBLEOTA_FILL_BUFFER_SIZE 256 //!< Bytes of a sparse fill record expanded at a time
+#endif
+
+#ifndef FASTBLEOTA_CHECK_PROJECT_NAME
+#define FASTBLEOTA_CHECK_PROJECT_NAME 1 //!< Reject app images built for another project than the running firmware
+#endif
+
+#define FASTBLEOTA_IMAGE_HEAD_SIZE 288 //!< Image header, first segment header and app description, checked before flashing
+
+#ifndef FASTBLEOTA_WRITER_TASK_STACK_SIZE
+#define FASTBLEOTA_WRITER_TASK_STACK_SIZE 4096
+#endif
+
+#ifndef FASTBLEOTA_WRITER_TASK_PRIORITY
+#define FASTBLEOTA_WRITER_TASK_PRIORITY 5
+#endif
+
+#ifndef FASTBLEOTA_WRITER_TASK_CORE
+#define FASTBLEOTA_WRITER_TASK_CORE tskNO_AFFINITY
+#endif
+
+#ifndef FASTBLEOTA_ERASE_AHEAD_SECTORS
+#define FASTBLEOTA_ERASE_AHEAD_SECTORS 4 //!< Sectors the pre-eraser keeps erased ahead of the write cursor
+#endif
+
+#ifndef FASTBLEOTA_ERASER_TASK_STACK_SIZE
+#define FASTBLEOTA_ERASER_TASK_STACK_SIZE 2048
+#endif
+
+#ifndef FASTBLEOTA_ERASER_TASK_PRIORITY
+#define FASTBLEOTA_ERASER_TASK_PRIORITY 1 //!< Below the writer task, so erasing only uses time nothing else needs
+#endif
+
+#ifndef FASTBLEOTA_ERASER_TASK_CORE
+#define FASTBLEOTA_ERASER_TASK_CORE tskNO_AFFINITY
+#endif
+
+#ifndef FASTBLEOTA_CONN_INTERVAL_MIN
+#define FASTBLEOTA_CONN_INTERVAL_MIN 6 //!< Shortest connection interval requested by link tuning, in units of 1.25 ms
+#endif
+
+#ifndef FASTBLEOTA_CONN_INTERVAL_MAX
+#define FASTBLEOTA_CONN_INTERVAL_MAX 12 //!< Longest connection interval requested by link tuning, in units of 1.25 ms
+#endif
+
+#ifndef FASTBLEOTA_DATA_LENGTH
+#define FASTBLEOTA_DATA_LENGTH 251 //!< Link layer payload size requested by link tuning (Data Length Extension)
+#endif
+
+#ifndef FASTBLEOTA_L2CAP_PSM
+#define FASTBLEOTA_L2CAP_PSM 0x0080 //!< LE PSM the L2CAP channel listens on, in the dynamic range
+#endif
+
+#ifndef FASTBLEOTA_L2CAP_MTU
+#define FASTBLEOTA_L2CAP_MTU FASTBLEOTA_MAX_CHUNK_SIZE //!< Largest SDU accepted on the L2CAP channel
+#endif
+
+#ifndef FASTBLEOTA_L2CAP_BUFFER_COUNT
+#define FASTBLEOTA_L2CAP_BUFFER_COUNT 3 //!< Receive buffers of FASTBLEOTA_L2CAP_MTU bytes reserved for the L2CAP channel
+#endif
+
+#ifndef FASTBLEOTA_SESSION_TIMEOUT_MS
+#define FASTBLEOTA_SESSION_TIMEOUT_MS 15000 //!< A session that receives nothing for this long is torn down, 0 never times out
+#endif
+
+#ifndef FASTBLEOTA_EVENT_QUEUE_LENGTH
+#define FASTBLEOTA_EVENT_QUEUE_LENGTH 8 //!< OTA events that can wait for dispatch, progress events take at most one slot
+#endif
+
+#ifndef FASTBLEOTA_CALLBACK_TASK_STACK_SIZE
+#define FASTBLEOTA_CALLBACK_TASK_STACK_SIZE 4096
+#endif
+
+#ifndef FASTBLEOTA_CALLBACK_TASK_PRIORITY
+#define FASTBLEOTA_CALLBACK_TASK_PRIORITY 1
+#endif
+
+#ifndef FASTBLEOTA_CALLBACK_TASK_CORE
+#define FASTBLEOTA_CALLBACK_TASK_CORE tskNO_AFFINITY
+#endif
 
 typedef enum {
-  FASTBLEOTA_ERROR_NONE,           //!< No error
-  FASTBLEOTA_ERROR_SIZE_MISMATCH,  //!< Received size data of incorrect length
-  FASTBLEOTA_ERROR_START_UPDATE,   //!< Failed to start update
-  FASTBLEOTA_ERROR_WRITE_CHUNK,    //!< Failed to write firmware chunk
-  FASTBLEOTA_ERROR_RECEIVED_MORE,  //!< Received more data than expected
-  FASTBLEOTA_ERROR_FINALIZE_UPDATE //!< Failed to finalize update
+  FASTBLEOTA_ERROR_NONE,            //!< No error
+  FASTBLEOTA_ERROR_SIZE_MISMATCH,   //!< Received size data of incorrect length
+  FASTBLEOTA_ERROR_START_UPDATE,    //!< Failed to start update
+  FASTBLEOTA_ERROR_WRITE_CHUNK,     //!< Failed to write firmware chunk
+  FASTBLEOTA_ERROR_RECEIVED_MORE,   //!< Received more data than expected
+  FASTBLEOTA_ERROR_FINALIZE_UPDATE, //!< Failed to finalize update
+  FASTBLEOTA_ERROR_CHUNK_TOO_LARGE, //!< Received a chunk larger than FASTBLEOTA_MAX_CHUNK_SIZE
+  FASTBLEOTA_ERROR_QUEUE_FULL,      //!< Writer task did not free a chunk buffer in time
+  FASTBLEOTA_ERROR_INVALID_HEADER,  //!< Received a session header that is malformed or unsupported
+  FASTBLEOTA_ERROR_DECOMPRESS,      //!< Compressed stream is corrupt or does not match the image size
+  FASTBLEOTA_ERROR_PATCH,           //!< Delta patch is corrupt or reaches outside the running partition
+  FASTBLEOTA_ERROR_RESUME,          //!< Failed to save or restore the progress of a resumable transfer
+  FASTBLEOTA_ERROR_HASH_MISMATCH,   //!< SHA-256 of the received image does not match the session header
+  FASTBLEOTA_ERROR_TIMEOUT,         //!< Session received nothing for the session timeout and was torn down
+  FASTBLEOTA_ERROR_DISCONNECTED,    //!< Client disconnected before the image was complete, the session was torn down
+  FASTBLEOTA_ERROR_INVALID_IMAGE,   //!< App image does not start with a valid image header and app description
+  FASTBLEOTA_ERROR_WRONG_CHIP,      //!< App image is built for another chip
+  FASTBLEOTA_ERROR_FLASH_SIZE,      //!< App image is built for a larger flash chip than the one fitted
+  FASTBLEOTA_ERROR_WRONG_PROJECT,   //!< App image is built from another project than the running firmware
+  FASTBLEOTA_ERROR_L2CAP_BUFFER     //!< No receive buffer was free for the next SDU, the L2CAP channel was closed
 } fastbleota_error_t;
 
+typedef enum {
+  FASTBLEOTA_DISPATCH_DIRECT, //!< Callbacks run on the task that receives the chunk
+  FASTBLEOTA_DISPATCH_TASK,   //!< Callbacks run on a dedicated low priority task
+  FASTBLEOTA_DISPATCH_LOOP    //!< Callbacks run from FastBLEOTA::handleEvents(), typically called in loop()
+} fastbleota_dispatch_t;
+
+typedef enum {
+  FASTBLEOTA_PROGRESS_BYTES,   //!< Report progress every interval image bytes
+  FASTBLEOTA_PROGRESS_PERCENT, //!< Report progress every interval percent of the image
+  FASTBLEOTA_PROGRESS_MS       //!< Report progress at most once every interval milliseconds
+} fastbleota_progress_unit_t;
+
+typedef enum : uint8_t {
+  FASTBLEOTA_COMPRESSION_NONE,   //!< Image is sent as is
+  FASTBLEOTA_COMPRESSION_DEFLATE //!< Image is sent as a zlib stream
+} fastbleota_compression_t;
+
+typedef enum : uint8_t {
+  FASTBLEOTA_ENCODING_RAW,  //!< Stream is the image itself
+  FASTBLEOTA_ENCODING_DELTA, //!< Stream is a patch against the running app partition
+  FASTBLEOTA_ENCODING_SPARSE //!< Stream is a sequence of fastbleota_sparse_record_t
+} fastbleota_encoding_t;
+
+typedef enum : uint8_t {
+  FASTBLEOTA_SPARSE_LITERAL, //!< The record is followed by length bytes of the image
+  FASTBLEOTA_SPARSE_FILL     //!< The next length bytes of the image are all value
+} fastbleota_sparse_type_t;
+
+/**
+ * Record of a sparse encoded stream, so runs of padding cost six bytes instead of their length.
+ * Runs of 0xFF are left erased rather than programmed where the partition is written directly.
+ */
+typedef struct __attribute__((packed)) {
+  uint8_t type;    //!< fastbleota_sparse_type_t
+  uint8_t value;   //!< Byte a fill record repeats, 0 for a literal record
+  uint32_t length; //!< Image bytes the record covers
+} fastbleota_sparse_record_t;
+
+typedef enum : uint8_t {
+  FASTBLEOTA_TARGET_APP,       //!< Image is firmware for the next OTA app partition
+  FASTBLEOTA_TARGET_FILESYSTEM //!< Image is a LittleFS or SPIFFS image for the first SPIFFS data partition
+} fastbleota_target_t;
+
+#define FASTBLEOTA_FLAG_SEQUENCED 0x01 //!< Every write after the header starts with a little endian uint16_t sequence number
+#define FASTBLEOTA_FLAG_RESUMABLE 0x02 //!< Continue an interrupted transfer of the same image, identified by sha256
+#define FASTBLEOTA_FLAG_PROGRESS  0x04 //!< Notify fastbleota_progress_notify_t at the configured progress interval
+#define FASTBLEOTA_FLAG_CRC       0x08 //!< Sequenced writes end with a little endian CRC-32 of the sequence number and data
+
+/**
+ * Optional session header sent as the first write instead of the bare 4-byte image size.
+ * Fields are little endian, headerSize lets later versions append fields.
+ */
+typedef struct __attribute__((packed)) {
+  uint32_t magic;       //!< FASTBLEOTA_HEADER_MAGIC
+  uint8_t version;      //!< FASTBLEOTA_HEADER_VERSION of the client, newer minor versions are accepted
+  uint8_t headerSize;   //!< Size of the header as sent, fields past those of this version are ignored
+  uint8_t compression;  //!< fastbleota_compression_t
+  uint8_t encoding;     //!< fastbleota_encoding_t, applied after decompression
+  uint32_t imageSize;   //!< Size of the image once decoded, as written to flash
+  uint32_t streamSize;  //!< Number of bytes that follow the header
+  uint8_t flags;        //!< FASTBLEOTA_FLAG_* bits
+  uint8_t target;       //!< fastbleota_target_t, the partition the image is written to
+  uint16_t windowSize;  //!< Sequenced chunks the client wants to keep in flight, 0 for FASTBLEOTA_DEFAULT_WINDOW
+  uint8_t sha256[32];   //!< SHA-256 of the image, verified before the update is finalized unless all zeros
+} fastbleota_header_t;
+
+/**
+ * Optional write before a session, asking whether the running firmware already is the image the client is about
+ * to send. Answered with a fastbleota_query_notify_t, and does not start a session.
+ */
+typedef struct __attribute__((packed)) {
+  uint32_t magic;     //!< FASTBLEOTA_QUERY_MAGIC
+  char version[32];   //!< esp_app_desc_t version of the image, compared as well unless empty
+  uint8_t sha256[32]; //!< SHA-256 of the image as esp_partition_get_sha256() reports it, all zeros to only compare version
+} fastbleota_query_t;
+
+typedef enum : uint8_t {
+  FASTBLEOTA_NOTIFY_ACK = 1,  //!< fastbleota_ack_t
+  FASTBLEOTA_NOTIFY_ERROR,    //!< fastbleota_error_notify_t
+  FASTBLEOTA_NOTIFY_START,    //!< fastbleota_start_notify_t
+  FASTBLEOTA_NOTIFY_PROGRESS, //!< fastbleota_progress_notify_t
+  FASTBLEOTA_NOTIFY_QUERY     //!< fastbleota_query_notify_t
+} fastbleota_notify_type_t;
+
+/**
+ * Notified once a session started with a header is accepted. The client sends the stream from offset onwards,
+ * which is only non-zero when a resumable transfer continues.
+ */
+typedef struct __attribute__((packed)) {
+  uint8_t type;    //!< FASTBLEOTA_NOTIFY_START
+  uint8_t reserved;
+  uint32_t offset; //!< Stream offset the device continues from
+} fastbleota_start_notify_t;
+
+#define FASTBLEOTA_ACK_RETRANSMIT 0x01 //!< A chunk was lost, the client must resend from nextSequence
+
+/**
+ * Notified on the OTA characteristic for sequenced sessions, cumulatively acknowledging every chunk before
+ * nextSequence. The client may keep up to credits chunks past nextSequence in flight.
+ */
+typedef struct __attribute__((packed)) {
+  uint8_t type;          //!< FASTBLEOTA_NOTIFY_ACK
+  uint8_t flags;         //!< FASTBLEOTA_ACK_* bits
+  uint16_t nextSequence; //!< Sequence number the device expects next
+  uint16_t credits;
+  uint32_t receivedSize; //!< Stream bytes accepted so far
+} fastbleota_ack_t;
+
+typedef struct __attribute__((packed)) {
+  uint8_t type;  //!< FASTBLEOTA_NOTIFY_ERROR
+  uint8_t error; //!< fastbleota_error_t
+} fastbleota_error_notify_t;
+
+typedef struct __attribute__((packed)) {
+  uint8_t type;          //!< FASTBLEOTA_NOTIFY_PROGRESS
+  uint8_t reserved;
+  uint32_t receivedSize; //!< Image bytes written so far
+  uint32_t expectedSize; //!< Size of the image
+} fastbleota_progress_notify_t;
+
+typedef struct __attribute__((packed)) {
+  uint8_t type;      //!< FASTBLEOTA_NOTIFY_QUERY
+  uint8_t installed; //!< 1 when the running firmware is the queried image, so the transfer can be skipped
+} fastbleota_query_notify_t;
+
+typedef enum : uint8_t {
+  FASTBLEOTA_STATE_IDLE,      //!< Waiting for a session to start
+  FASTBLEOTA_STATE_RECEIVING, //!< Session started, receiving the image
+  FASTBLEOTA_STATE_COMPLETE,  //!< Image written and finalized
+  FASTBLEOTA_STATE_ERROR      //!< Session failed with lastError
+} fastbleota_state_t;
+
+#define FASTBLEOTA_NOT_MEASURED 0xFFFFFFFF //!< Reported for statistics this build cannot measure, rather than 0
+
+/**
+ * Statistics of the current session, also returned when the OTA characteristic is read.
+ * Fields are little endian, size lets later versions append fields.
+ */
+typedef struct __attribute__((packed)) {
+  uint16_t size;            //!< Size of the statistics as sent
+  uint8_t state;            //!< fastbleota_state_t
+  uint8_t lastError;        //!< fastbleota_error_t of the most recent failure, kept across sessions
+  uint32_t chunksReceived;  //!< Chunks received over BLE this session
+  uint32_t heapAllocations; //!< Heap allocations made while ingesting chunks, FASTBLEOTA_NOT_MEASURED without heap hooks
+  uint32_t flashWrites;     //!< Flash writes issued after coalescing, one per chunk without it
+  uint32_t bytesReceived;   //!< Bytes received over BLE this session, including framing
+  uint32_t ingestTimeUs;    //!< Total time spent processing chunks
+  uint32_t chunkTimeP50Us;  //!< Median time to process a chunk, rounded up to a power of two
+  uint32_t chunkTimeP99Us;  //!< 99th percentile time to process a chunk, rounded up to a power of two
+  uint32_t chunkTimeMaxUs;  //!< Longest time to process a chunk
+  uint32_t callbackTimeUs;  //!< Part of ingestTimeUs spent in onOTAProgress callbacks
+  uint32_t flashTimeUs;     //!< Part of ingestTimeUs spent writing to flash
+  uint32_t flashTimeMaxUs;  //!< Longest single flash write
+  uint32_t queueHighWater;  //!< Most chunks held in the writer task ring at once
+  uint32_t heapLowWater;    //!< Least free heap seen while receiving chunks
+  uint32_t hashTimeUs;      //!< Time spent hashing the image to verify it
+  uint32_t crcTimeUs;       //!< Time spent checking chunk CRCs
+  uint32_t crcErrors;       //!< Chunks rejected because their CRC did not match or they were too short to carry one
+  uint16_t connInterval;    //!< Connection interval in units of 1.25 ms, 0 without a connection
+  uint16_t connLatency;     //!< Peripheral latency in connection events
+  uint8_t txPhy;            //!< PHY used to transmit, 1 for 1M, 2 for 2M and 3 for Coded, 0 when unknown
+  uint8_t rxPhy;            //!< PHY used to receive
+  uint16_t dataLength;      //!< Link layer payload size requested by link tuning, 0 while the link is not tuned
+  uint32_t eraseTimeUs;     //!< Time the pre-eraser spent erasing, off the write path
+  uint32_t eraseStallTimeUs; //!< Part of flashTimeUs spent waiting for the pre-eraser to catch up
+  uint16_t eraseAheadMin;   //!< Fewest sectors the pre-eraser was ahead of a flash write, 0 without pre-erase
+} fastbleota_stats_t;
+
 class FastBLEOTACallbacks {
   public:
     virtual ~FastBLEOTACallbacks() {}
@@ -24,6 +353,296 @@ class FastBLEOTACallbacks {
     virtual void onOTAError(fastbleota_error_t errorCode) {}
 };
 
+/**
+ * One OTA target with its own session state, flash sink and callbacks. Each engine serves its own characteristic,
+ * so several targets can be updated at the same time over separate characteristics or connections.
+ * An engine holds its write block buffer, so allocate it statically or on the heap rather than on a task stack.
+ */
+class FastBLEOTAEngine {
+  public:
+    FastBLEOTAEngine();
+
+    /**
+     * Add the characteristic of this target to the OTA service, creating the service if no other target has yet.
+     * Call it for every target before advertising starts, which starts the GATT server. The service is registered
+     * with the NimBLE host directly, so it is not among the services NimBLE-Arduino restores when services added
+     * after the server started make it rebuild the GATT table.
+     */
+    void begin(NimBLEServer* pServer, const char* characteristicUUID = nullptr);
+
+    void reset();
+
+    /**
+     * Feed a chunk to the OTA engine exactly as if it had been written to the OTA characteristic.
+     * Lets another transport, or a test harness on a workstation, drive an update without a BLE connection.
+     */
+    void write(const uint8_t* data, size_t length);
+
+    void setCallbacks(FastBLEOTACallbacks* callbacks);
+
+    /**
+     * Partition the current or most recent session writes to, so callbacks can tell a filesystem image from firmware.
+     */
+    fastbleota_target_t getTarget();
+
+    /**
+     * Limit how often progress is reported to onOTAProgress and, when the client asks for it, notified to the client.
+     * Progress in between is skipped so only the latest value is reported, and the end of the image always is.
+     * An interval of 0 reports progress after every chunk.
+     */
+    void setProgressInterval(fastbleota_progress_unit_t unit, uint32_t interval);
+
+    /**
+     * Hand received chunks to a dedicated writer task instead of writing them to flash on the NimBLE host task.
+     * Must be called before begin().
+     */
+    void setWriterTaskEnabled(bool enabled);
+
+    /**
+     * Erase flash sectors ahead of the write cursor from a low priority task, so the write path only programs flash.
+     * Applies where the partition is written directly: the partition sink, filesystem images through the esp_ota sink
+     * and resumable sessions. Update and esp_ota_write erase each sector themselves. Must be called before begin().
+     */
+    void setPreEraseEnabled(bool enabled);
+
+    /**
+     * Choose where FastBLEOTACallbacks run. Outside FASTBLEOTA_DISPATCH_DIRECT events are posted to a bounded queue,
+     * so a slow callback never holds up reception, and consecutive progress events coalesce into the latest one.
+     * Must be called before begin().
+     */
+    void setCallbackDispatch(fastbleota_dispatch_t dispatch);
+
+    /**
+     * When a session starts, ask the connected client for the 2M PHY, the largest data length and a short connection
+     * interval, and go back to the previous parameters when the session ends.
+     */
+    void setLinkTuningEnabled(bool enabled);
+
+    /**
+     * Tear down a session that receives nothing for timeoutMs, releasing the flash sink so the next client starts a
+     * new session. A session is also torn down as soon as its client disconnects. A timeout of 0 never times out.
+     */
+    void setSessionTimeout(uint32_t timeoutMs);
+
+    /**
+     * Also accept the session on an LE L2CAP connection-oriented channel, each SDU handled like a write to the
+     * OTA characteristic, which stays available for the header and for notifications.
+     * Needs NimBLE built with CONFIG_BT_NIMBLE_L2CAP_COC_MAX_NUM of at least 1, returns false otherwise.
+     * Once the engine is listening, calling it again does nothing and returns true.
+     */
+    bool beginL2CAP(uint16_t psm = FASTBLEOTA_L2CAP_PSM);
+
+    /**
+     * Run the callbacks for queued OTA events. Call it regularly, e.g. from loop(), with FASTBLEOTA_DISPATCH_LOOP.
+     */
+    void handleEvents();
+
+    fastbleota_stats_t getStats();
+
+    /**
+     * Print the statistics of the current session as a single line of JSON, for collecting benchmark results.
+     */
+    void printStats(Print& output);
+
+  private:
+    void processData(const uint8_t* data, size_t length);
+    void ingestData(const uint8_t* data, size_t length);
+    void enqueueData(const uint8_t* data, size_t length);
+    void rejectChunk(fastbleota_error_t error);
+    fastbleota_error_t startSession(const uint8_t* data, size_t length);
+    void answerQuery(const fastbleota_query_t& query);
+    bool acceptSequence(const uint8_t*& data, size_t& length);
+    void requestRetransmit();
+    void sendAck(uint8_t flags);
+    void reportProgress();
+    void tuneLink();
+    void restoreLink();
+    bool addCharacteristic(const char* uuid);
+    static int gattAccess(uint16_t connHandle, uint16_t attrHandle, struct ble_gatt_access_ctxt* ctxt, void* arg);
+    bool receive(struct os_mbuf* om, uint8_t* buffer, size_t size);
+    static int l2capEvent(struct ble_l2cap_event* event, void* arg);
+    void notify(const void* data, size_t length);
+    void armWatchdog();
+    void abortSession(fastbleota_error_t error);
+    static void watchdogTimer(void* arg);
+    static int gapEvent(struct ble_gap_event* event, void* arg);
+    fastbleota_error_t beginFlash(const uint8_t* sha256);
+    bool writeFlash(const uint8_t* data, size_t length);
+    bool writePartition(const uint8_t* data, size_t length);
+    bool endFlash();
+    void abortFlash();
+    void releasePartition();
+    void printFlashError();
+    bool saveResumeOffset();
+    void clearResumeRecord();
+    fastbleota_error_t finishSession();
+    fastbleota_error_t inflateData(const uint8_t* data, size_t length);
+    fastbleota_error_t decodeData(const uint8_t* data, size_t length);
+    fastbleota_error_t patchData(const uint8_t* data, size_t length);
+    fastbleota_error_t writeImage(const uint8_t* data, size_t length);
+    bool flushWriteBuffer();
+    fastbleota_error_t hashPartition(size_t length);
+    bool verifyHash();
+    fastbleota_error_t expandData(const uint8_t* data, size_t length);
+    fastbleota_error_t fillImage(uint8_t value, size_t length);
+    fastbleota_error_t checkImage(const uint8_t* data, size_t length);
+    bool startWriterTask();
+    static void writerTask(void* pvParameters);
+    bool startEventDispatch();
+    static void eventTask(void* pvParameters);
+    void postEvent(uint8_t type, uint32_t value);
+    void dispatchEvent(uint8_t type, uint32_t value);
+    void dispatchLatched();
+
+    void onOTAStart(size_t expectedSize);
+    void onOTAProgress(size_t receivedSize, size_t expectedSize);
+    void onOTAComplete();
+    void onOTAError(fastbleota_error_t errorCode);
+
+    /**
+     * Streaming bsdiff-style patch applier. The patch is a sequence of records, each a control block of
+     * { uint32_t diffLength, uint32_t extraLength, int32_t seek } followed by diffLength bytes that are added to the
+     * running image and extraLength literal bytes. After a record the running image offset moves by seek.
+     */
+    struct Patcher {
+      const esp_partition_t* source;
+      size_t sourceOffset;
+      uint8_t control[12];
+      size_t controlSize;
+      uint32_t diffRemaining;
+      uint32_t extraRemaining;
+      int32_t seek;
+      uint8_t buffer[FASTBLEOTA_PATCH_BUFFER_SIZE];
+    };
+
+    // Hashes the image as it is written, mbedtls hands the work to the SHA peripheral on chips that have one
+    struct Hasher {
+      bool enabled;
+      uint8_t expected[32];
+      mbedtls_sha256_context context;
+    };
+
+    // Sparse record being expanded, with the run of its fill value it is written from
+    struct Expander {
+      uint8_t record[sizeof(fastbleota_sparse_record_t)];
+      size_t recordSize;
+      uint32_t literalRemaining;
+      uint8_t fill[FASTBLEOTA_FILL_BUFFER_SIZE];
+    };
+
+    // Gathers the start of an app image so it is checked before the transfer goes any further
+    struct ImageCheck {
+      bool pending;
+      uint8_t head[FASTBLEOTA_IMAGE_HEAD_SIZE];
+    };
+
+    // Link parameters in use before tuning, restored when the session ends
+    struct Link {
+      bool tuned;
+      uint16_t interval;
+      uint16_t latency;
+      uint16_t timeout;
+      uint8_t txPhy;
+      uint8_t rxPhy;
+    };
+
+    NimBLEServer* _pServer = nullptr;
+    bool _characteristicAdded = false;
+    uint16_t _valueHandle = 0; //!< Assigned by NimBLE when the GATT server starts
+    uint16_t _subscriber = BLE_HS_CONN_HANDLE_NONE; //!< Connection that enabled notifications of the characteristic
+    alignas(4) uint8_t _valueBuffer[FASTBLEOTA_MAX_CHUNK_SIZE]; //!< Gathers writes NimBLE received in chained mbufs
+
+    size_t _expectedSize = 0;
+    size_t _receivedSize = 0;
+    bool _sizeReceived = false;
+    size_t _expectedStreamSize = 0;
+    size_t _receivedStreamSize = 0;
+    fastbleota_compression_t _compression = FASTBLEOTA_COMPRESSION_NONE;
+    fastbleota_encoding_t _encoding = FASTBLEOTA_ENCODING_RAW;
+    fastbleota_target_t _target = FASTBLEOTA_TARGET_APP;
+    bool _runningHashed = false;
+    uint8_t _runningSha256[32] = {};
+    uint8_t _flags = 0;
+    uint16_t _windowSize = 0;
+    uint16_t _nextSequence = 0;
+    uint16_t _unackedChunks = 0;
+    bool _retransmitRequested = false;
+    fastbleota_progress_unit_t _progressUnit = FASTBLEOTA_PROGRESS_UNIT;
+    uint32_t _progressInterval = FASTBLEOTA_PROGRESS_INTERVAL;
+    size_t _reportedSize = 0;
+    uint32_t _reportedTime = 0;
+
+    bool _resumable = false;
+    size_t _savedOffset = 0;
+    const esp_partition_t* _claimedPartition = nullptr; //!< Target partition of the session, no other engine opens it
+
+    struct Sink;
+    Sink* _sink = nullptr;
+    struct ResumeSink;
+    ResumeSink* _resumeSink = nullptr; //!< Writes resumable transfers, which Update always restarts from the first byte
+
+    bool _preEraseEnabled = false;
+    struct Eraser;
+    Eraser* _eraser = nullptr;
+
+    struct Inflater;
+    Inflater* _inflater = nullptr;
+
+    Patcher _patcher = {};
+    Hasher _hasher = {};
+    Expander _expander = {};
+    ImageCheck _imageCheck = {};
+
+    bool _linkTuningEnabled = false;
+    uint16_t _connHandle = BLE_HS_CONN_HANDLE_NONE;
+    Link _link = {};
+
+    struct Channel;
+    Channel* _channel = nullptr;
+    bool _l2capListening = false;
+
+    uint32_t _sessionTimeout = FASTBLEOTA_SESSION_TIMEOUT_MS;
+    volatile uint32_t _lastActivity = 0;
+    esp_timer_handle_t _watchdog = nullptr;
+    struct ble_gap_event_listener _gapListener = {};
+
+    fastbleota_state_t _state = FASTBLEOTA_STATE_IDLE;
+    fastbleota_error_t _lastError = FASTBLEOTA_ERROR_NONE;
+    fastbleota_stats_t _stats = {};
+    uint32_t _chunkTimeHistogram[32] = {};
+    volatile uint32_t _heapAllocations = 0;
+
+    alignas(4) uint8_t _writeBuffer[FASTBLEOTA_WRITE_BLOCK_SIZE];
+    size_t _writeBufferSize = 0;
+
+    bool _writerTaskEnabled = false;
+    TaskHandle_t _writerTaskHandle = nullptr;
+    QueueHandle_t _freeQueue = nullptr;
+    QueueHandle_t _readyQueue = nullptr;
+    SemaphoreHandle_t _lock = nullptr;
+    struct Chunk;
+    Chunk* _chunks = nullptr;
+    volatile uint32_t _generation = 0; //!< Bumped by every reset, under the lock
+
+    fastbleota_dispatch_t _dispatch = FASTBLEOTA_DISPATCH_DIRECT;
+    QueueHandle_t _eventQueue = nullptr;
+    TaskHandle_t _eventTaskHandle = nullptr;
+    // Guards the latest progress values and latched outcomes shared between the receiving and dispatching tasks
+    portMUX_TYPE _eventMux;
+    volatile bool _progressQueued = false;
+    size_t _progressReceived = 0;
+    size_t _progressExpected = 0;
+    volatile bool _completeLatched = false;
+    volatile bool _errorLatched = false;
+    fastbleota_error_t _latchedError = FASTBLEOTA_ERROR_NONE;
+    struct Event;
+
+    FastBLEOTACallbacks* _callbacks = nullptr;
+};
+
+/**
+ * The original static API, a thin wrapper around a default FastBLEOTAEngine for devices with a single OTA target.
+ */
 class FastBLEOTA {
   public:
     FastBLEOTA() = delete;
@@ -32,28 +651,42 @@ class FastBLEOTA {
 
     static void reset();
 
+    /**
+     * Feed a chunk to the OTA engine exactly as if it had been written to the OTA characteristic.
+     * Lets another transport, or a test harness on a workstation, drive an update without a BLE connection.
+     */
+    static void write(const uint8_t* data, size_t length);
+
     static void setCallbacks(FastBLEOTACallbacks* callbacks);
 
-    static const char* getServiceUUID();
+    static fastbleota_target_t getTarget();
 
-  private:
-    static void processData(const uint8_t* data, size_t length);
+    static void setProgressInterval(fastbleota_progress_unit_t unit, uint32_t interval);
+
+    static void setWriterTaskEnabled(bool enabled);
 
-    static void onOTAStart(size_t expectedSize);
-    static void onOTAProgress(size_t receivedSize, size_t expectedSize);
-    static void onOTAComplete();
-    static void onOTAError(fastbleota_error_t errorCode);
+    static void setPreEraseEnabled(bool enabled);
 
-    static NimBLEService* _pService;
-    static NimBLECharacteristic* _pCharacteristic;
+    static void setCallbackDispatch(fastbleota_dispatch_t dispatch);
+
+    static void setLinkTuningEnabled(bool enabled);
+
+    static void setSessionTimeout(uint32_t timeoutMs);
+
+    static bool beginL2CAP(uint16_t psm = FASTBLEOTA_L2CAP_PSM);
+
+    static void handleEvents();
+
+    static const char* getServiceUUID();
 
-    static size_t _expectedSize;
-    static size_t _receivedSize;
-    static bool _sizeReceived;
+    static fastbleota_stats_t getStats();
 
-    class CharacteristicCallbacks;
+    static void printStats(Print& output);
 
-    static FastBLEOTACallbacks* _callbacks;
+    /**
+     * The engine behind the static API, which serves the default OTA characteristic.
+     */
+    static FastBLEOTAEngine& getDefault();
 };
 
-#endif // FASTBLEOTA_H
\ No newline at end of file
+#endif // FASTBLEOTA_H
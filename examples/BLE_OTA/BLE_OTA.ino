@@ -63,12 +63,16 @@ void setup() {
   NimBLEDevice::createServer()->setCallbacks(new ServerCallbacks());
 
   FastBLEOTA::setCallbacks(new OTACallbacks());
+  FastBLEOTA::setCallbackDispatch(FASTBLEOTA_DISPATCH_LOOP);  // Run the callbacks below from loop(), off the BLE host task
+  FastBLEOTA::setLinkTuningEnabled(true);  // Ask for 2M PHY, a larger data length and a short connection interval while updating
   FastBLEOTA::begin(NimBLEDevice::getServer());
   
   NimBLEDevice::getAdvertising()->start();
 }
 
 void loop() {
+  FastBLEOTA::handleEvents();
+
   if (!NimBLEDevice::getServer()->getConnectedCount()) {
     int brightness = (int)(sin(millis() / 500.0) * 128 + 128);
     ums3.setPixelColor(UMS3::color(0, brightness, 0));  // Fade in and out green when idle and not connected
@@ -0,0 +1,369 @@
+// Benchmarks the ingest path against the host stand-ins and prints one row per measurement as CSV or JSON:
+//   bench_ota_partition [--format csv|json] [--quick]
+//
+// Session rows time every chunk on the modeled clock, so flash latency and Serial output count at their device
+// cost while the engine's own work is measured on the host. Kernel rows time the hashing and CRC of one chunk.
+
+#include "stream.h"
+#include <host.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <esp_rom_crc.h>
+#include <mbedtls/sha256.h>
+#include <zlib.h>
+
+#define SERIAL_BAUD 115200
+
+// Every field is a number, NAN where it does not apply to the row, printed empty in CSV and null in JSON
+typedef struct {
+  std::string scenario;
+  std::string transport;
+  std::string variant;
+  std::string callback;
+  std::string flashModel;
+  double payload = NAN;
+  double imageSize = NAN;
+  double chunks = NAN;
+  double nsPerByte = NAN;
+  double p50Ns = NAN;
+  double p99Ns = NAN;
+  double maxNs = NAN;
+  double allocsPerChunk = NAN;
+  double callbackNsPerChunk = NAN;
+  double flashNsPerChunk = NAN;
+  double hashNsPerChunk = NAN;
+  double crcNsPerChunk = NAN;
+} row_t;
+
+typedef struct {
+  const char* scenario;
+  const char* transport;  //!< "write" calls write(), "characteristic" delivers the chunk as a GATT write, "l2cap"
+                          //!< as an SDU on the L2CAP channel after the header was written to the characteristic
+  const char* variant;    //!< raw, deflate, sparse or crc
+  const char* callback;   //!< "empty" or "serial_println", the example's progress callback
+  const host_flash_model_t* flash;
+  size_t payload;
+  size_t imageSize;
+} session_t;
+
+#if FASTBLEOTA_SINK == FASTBLEOTA_SINK_ESP_OTA
+#define SINK_NAME "esp_ota"
+#elif FASTBLEOTA_SINK == FASTBLEOTA_SINK_PARTITION
+#define SINK_NAME "partition"
+#elif FASTBLEOTA_SINK == FASTBLEOTA_SINK_FILE
+#define SINK_NAME "file"
+#else
+#define SINK_NAME "update"
+#endif
+
+// Times its own progress callback on the modeled clock, finer than the engine's microsecond callbackTimeUs
+class BenchCallbacks : public FastBLEOTACallbacks {
+  public:
+    void onOTAProgress(size_t receivedSize, size_t expectedSize) override {
+      uint64_t start = host_now_ns();
+      if (println) {
+        // What examples/BLE_OTA prints for every chunk
+        float progress = (float)receivedSize / (float)expectedSize * 100.0;
+        Serial.print("OTA: ");
+        Serial.println(progress, 2);
+      }
+      callbackNs += host_now_ns() - start;
+    }
+    void onOTAComplete() override { completes++; }
+    void onOTAError(fastbleota_error_t errorCode) override { errors++; }
+
+    bool println = false;
+    uint64_t callbackNs = 0;
+    int completes = 0;
+    int errors = 0;
+};
+
+static FastBLEOTAEngine* engine;
+static uint16_t characteristic;
+static ble_l2cap_chan* channel;
+static BenchCallbacks callbacks;
+
+static double percentile(std::vector<uint64_t>& sorted, double fraction) {
+  size_t index = (size_t)std::ceil(fraction * sorted.size());
+  return sorted[index ? index - 1 : 0];
+}
+
+static bool runSession(const session_t& session, row_t& row) {
+  bytes_t image = make_image(session.imageSize, session.imageSize ^ session.payload);
+  std::string variant = session.variant;
+
+  session_options_t options;
+  bytes_t stream = image;
+  size_t chunkSize = session.payload;
+  if (variant == "deflate") {
+    options.compression = FASTBLEOTA_COMPRESSION_DEFLATE;
+    stream = deflate(image);
+  }
+  else if (variant == "sparse") {
+    options.encoding = FASTBLEOTA_ENCODING_SPARSE;
+    stream = make_sparse(image);
+  }
+  else if (variant == "crc") {
+    options.flags = FASTBLEOTA_FLAG_SEQUENCED | FASTBLEOTA_FLAG_CRC;
+    options.windowSize = FASTBLEOTA_MAX_WINDOW;
+    chunkSize -= sizeof(uint16_t) + sizeof(uint32_t);
+  }
+
+  // Framed up front, so building the packets is not timed and nothing allocates while the session runs
+  std::vector<bytes_t> chunks = split(stream, chunkSize);
+  if (variant == "crc") {
+    for (size_t i = 0; i < chunks.size(); i++) chunks[i] = sequenced(i, chunks[i], true);
+  }
+  std::vector<uint64_t> latencies;
+  latencies.reserve(chunks.size());
+  bool viaCharacteristic = strcmp(session.transport, "characteristic") == 0;
+  bool viaL2CAP = strcmp(session.transport, "l2cap") == 0;
+
+  host_flash_reset(0xFF);
+  host_set_flash_model(*session.flash);
+  engine->reset();
+  callbacks.println = strcmp(session.callback, "serial_println") == 0;
+  callbacks.callbackNs = 0;
+  callbacks.completes = 0;
+  callbacks.errors = 0;
+
+  bytes_t header = make_header(image, stream.size(), options);
+  if (viaCharacteristic || viaL2CAP) host_write(characteristic, 1, header.data(), header.size());
+  else engine->write(header.data(), header.size());
+  uint32_t headerAllocations = engine->getStats().heapAllocations;
+  callbacks.callbackNs = 0;
+
+  uint64_t total = 0;
+  for (const bytes_t& chunk : chunks) {
+    uint64_t start = host_now_ns();
+    if (viaCharacteristic) host_write(characteristic, 1, chunk.data(), chunk.size());
+    else if (viaL2CAP) host_l2cap_send(channel, chunk.data(), chunk.size());
+    else engine->write(chunk.data(), chunk.size());
+    uint64_t elapsed = host_now_ns() - start;
+    latencies.push_back(elapsed);
+    total += elapsed;
+  }
+  host_take_notifications(characteristic);
+
+  if (callbacks.completes != 1 || callbacks.errors != 0) {
+    fprintf(stderr, "%s %s %s payload %zu: session failed with error %u\n", session.scenario, session.variant,
+            session.transport, session.payload, engine->getStats().lastError);
+    return false;
+  }
+
+  fastbleota_stats_t stats = engine->getStats();
+  std::sort(latencies.begin(), latencies.end());
+  double count = chunks.size();
+
+  row.scenario = session.scenario;
+  row.transport = session.transport;
+  row.variant = session.variant;
+  row.callback = session.callback;
+  row.flashModel = session.flash->name;
+  row.payload = session.payload;
+  row.imageSize = session.imageSize;
+  row.chunks = count;
+  row.nsPerByte = (double)total / session.imageSize;
+  row.p50Ns = percentile(latencies, 0.50);
+  row.p99Ns = percentile(latencies, 0.99);
+  row.maxNs = latencies.back();
+  if (stats.heapAllocations != FASTBLEOTA_NOT_MEASURED) {
+    row.allocsPerChunk = (stats.heapAllocations - headerAllocations) / count;
+  }
+  row.callbackNsPerChunk = callbacks.callbackNs / count;
+  row.flashNsPerChunk = stats.flashTimeUs * 1000.0 / count;
+  row.hashNsPerChunk = stats.hashTimeUs * 1000.0 / count;
+  if (variant == "crc") row.crcNsPerChunk = stats.crcTimeUs * 1000.0 / count;
+  return true;
+}
+
+// Kernel results are stored here so the compiler cannot drop the work
+volatile uint32_t kernelResult;
+
+// Best of several runs of fn, each repeating it enough times to be well above the clock's resolution
+template <typename Fn>
+static double timeKernel(Fn fn) {
+  const int repeats = 2000;
+  double best = INFINITY;
+  for (int run = 0; run < 5; run++) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeats; i++) fn();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count() / repeats;
+    if (ns < best) best = ns;
+  }
+  return best;
+}
+
+static row_t kernelRow(const char* variant, size_t payload) {
+  row_t row;
+  row.scenario = "kernel";
+  row.variant = variant;
+  row.payload = payload;
+  return row;
+}
+
+static void runKernels(const std::vector<size_t>& payloads, std::vector<row_t>& rows) {
+  bytes_t data = make_image(4096, 99);
+
+  for (size_t payload : payloads) {
+    mbedtls_sha256_context context;
+    mbedtls_sha256_init(&context);
+    mbedtls_sha256_starts(&context, 0);
+    row_t host = kernelRow("sha256_host_software", payload);
+    host.hashNsPerChunk = timeKernel([&]() { mbedtls_sha256_update(&context, data.data(), payload); });
+    mbedtls_sha256_free(&context);
+    rows.push_back(host);
+
+    // The ROM kernel the engine uses, a byte at a time from one table, against zlib's sliced kernel
+    row_t rom = kernelRow("crc32_rom_table", payload);
+    rom.crcNsPerChunk = timeKernel([&]() { kernelResult = esp_rom_crc32_le(0, data.data(), payload); });
+    rows.push_back(rom);
+
+    row_t sliced = kernelRow("crc32_zlib", payload);
+    sliced.crcNsPerChunk = timeKernel([&]() { kernelResult = crc32(0, data.data(), payload); });
+    rows.push_back(sliced);
+  }
+}
+
+static const char* COLUMNS[] = {
+  "scenario", "sink", "transport", "variant", "callback", "flash_model", "payload", "image_size", "chunks",
+  "ns_per_byte", "p50_ns", "p99_ns", "max_ns", "allocs_per_chunk", "callback_ns_per_chunk", "flash_ns_per_chunk",
+  "hash_ns_per_chunk", "crc_ns_per_chunk"
+};
+
+static std::vector<std::string> fields(const row_t& row, bool json) {
+  auto text = [json](const std::string& value) {
+    if (value.empty()) return std::string(json ? "null" : "");
+    return json ? "\"" + value + "\"" : value;
+  };
+  auto number = [json](double value) {
+    if (std::isnan(value)) return std::string(json ? "null" : "");
+    char buffer[32];
+    // Counts and sizes print whole, measurements to six significant digits
+    if (value == std::floor(value) && std::fabs(value) < 1e15) snprintf(buffer, sizeof(buffer), "%.0f", value);
+    else snprintf(buffer, sizeof(buffer), "%.6g", value);
+    return std::string(buffer);
+  };
+
+  return {
+    text(row.scenario), text(row.scenario == "kernel" ? "" : SINK_NAME), text(row.transport), text(row.variant),
+    text(row.callback), text(row.flashModel), number(row.payload), number(row.imageSize), number(row.chunks),
+    number(row.nsPerByte), number(row.p50Ns), number(row.p99Ns), number(row.maxNs), number(row.allocsPerChunk),
+    number(row.callbackNsPerChunk), number(row.flashNsPerChunk), number(row.hashNsPerChunk),
+    number(row.crcNsPerChunk)
+  };
+}
+
+static void printRows(const std::vector<row_t>& rows, bool json) {
+  const size_t columns = sizeof(COLUMNS) / sizeof(COLUMNS[0]);
+  if (!json) {
+    for (size_t i = 0; i < columns; i++) printf("%s%s", i ? "," : "", COLUMNS[i]);
+    printf("\n");
+    for (const row_t& row : rows) {
+      std::vector<std::string> values = fields(row, false);
+      for (size_t i = 0; i < columns; i++) printf("%s%s", i ? "," : "", values[i].c_str());
+      printf("\n");
+    }
+    return;
+  }
+
+  printf("[\n");
+  for (size_t r = 0; r < rows.size(); r++) {
+    std::vector<std::string> values = fields(rows[r], true);
+    printf("  {");
+    for (size_t i = 0; i < columns; i++) printf("%s\"%s\": %s", i ? ", " : "", COLUMNS[i], values[i].c_str());
+    printf("}%s\n", r + 1 < rows.size() ? "," : "");
+  }
+  printf("]\n");
+}
+
+static void usage(const char* program) {
+  fprintf(stderr, "usage: %s [--format csv|json] [--quick]\n", program);
+}
+
+int main(int argc, char** argv) {
+  bool json = false;
+  bool quick = false;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--format" && hasValue) {
+      std::string format = argv[++i];
+      if (format != "csv" && format != "json") {
+        usage(argv[0]);
+        return 2;
+      }
+      json = format == "json";
+    }
+    else if (arg == "--quick") quick = true;
+    else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
+  host_set_log_level(1);
+  host_set_update_dir(".");
+  // Output is discarded, the time it takes at the baud rate is what counts
+  host_set_serial(nullptr, SERIAL_BAUD);
+  host_set_running_image(make_image(64 * 1024, 1));
+  host_connect(1);
+
+  NimBLEServer* server = NimBLEDevice::createServer();
+  engine = new FastBLEOTAEngine();
+  engine->setCallbacks(&callbacks);
+  // Stalls on the modeled clock are not real time, the watchdog must not see them
+  engine->setSessionTimeout(0);
+  engine->begin(server);
+  server->start();
+  characteristic = host_find_characteristic("513fcda9-f46d-4e41-ac4f-42b768495a85");
+  host_subscribe(1, characteristic, true);
+  engine->beginL2CAP();
+  channel = host_l2cap_connect(1, FASTBLEOTA_L2CAP_PSM);
+
+  std::vector<size_t> payloads = { 20, 182, 244, 509 };
+  std::vector<size_t> imageSizes = { 64 * 1024, 256 * 1024, 1024 * 1024 };
+  std::vector<const host_flash_model_t*> flashModels = { &HOST_FLASH_NONE, &HOST_FLASH_TYPICAL, &HOST_FLASH_SLOW };
+  if (quick) {
+    payloads = { 20, 509 };
+    imageSizes = { 64 * 1024 };
+    flashModels = { &HOST_FLASH_NONE, &HOST_FLASH_TYPICAL };
+  }
+
+  std::vector<session_t> sessions;
+  for (const host_flash_model_t* flash : flashModels) {
+    for (size_t imageSize : imageSizes) {
+      for (size_t payload : payloads) {
+        sessions.push_back({ "sweep", "write", "raw", "empty", flash, payload, imageSize });
+      }
+    }
+  }
+
+  // Against the raw sweep without flash cost, each of these changes one thing
+  size_t imageSize = imageSizes.front();
+  for (size_t payload : payloads) {
+    sessions.push_back({ "transport", "characteristic", "raw", "empty", &HOST_FLASH_NONE, payload, imageSize });
+    sessions.push_back({ "transport", "l2cap", "raw", "empty", &HOST_FLASH_NONE, payload, imageSize });
+    sessions.push_back({ "callback", "write", "raw", "serial_println", &HOST_FLASH_NONE, payload, imageSize });
+    for (const char* variant : { "deflate", "sparse", "crc" }) {
+      sessions.push_back({ "encoding", "write", variant, "empty", &HOST_FLASH_NONE, payload, imageSize });
+    }
+  }
+
+  std::vector<row_t> rows;
+  bool failed = false;
+  for (const session_t& session : sessions) {
+    row_t row;
+    if (runSession(session, row)) rows.push_back(row);
+    else failed = true;
+  }
+  runKernels(payloads, rows);
+
+  printRows(rows, json);
+  return failed ? 1 : 0;
+}
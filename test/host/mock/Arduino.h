@@ -0,0 +1,121 @@
+#ifndef FASTBLEOTA_HOST_ARDUINO_H
+#define FASTBLEOTA_HOST_ARDUINO_H
+
+// Host stand-in for the parts of the Arduino ESP32 core, ESP-IDF and FreeRTOS that FastBLEOTA uses
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#define CONFIG_IDF_FIRMWARE_CHIP_ID 0x0000 //!< ESP_CHIP_ID_ESP32
+
+typedef int esp_err_t;
+
+#define ESP_OK                      0
+#define ESP_FAIL                    -1
+#define ESP_ERR_NO_MEM              0x101
+#define ESP_ERR_INVALID_ARG         0x102
+#define ESP_ERR_INVALID_STATE       0x103
+#define ESP_ERR_INVALID_SIZE        0x104
+#define ESP_ERR_NOT_FOUND           0x105
+#define ESP_ERR_TIMEOUT             0x107
+#define ESP_ERR_OTA_VALIDATE_FAILED 0x1503
+
+const char* esp_err_to_name(esp_err_t code);
+
+class Print {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(const uint8_t* buffer, size_t size) = 0;
+
+    size_t print(const char* text);
+    size_t print(double value, int digits = 2);
+    size_t println(const char* text = "");
+    size_t println(double value, int digits = 2);
+    size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class HardwareSerial : public Print {
+  public:
+    size_t write(const uint8_t* buffer, size_t size) override;
+};
+
+extern HardwareSerial Serial;
+
+class EspClass {
+  public:
+    uint32_t getFreeHeap(); //!< The host has no heap of the device's size, so this is a constant
+};
+
+extern EspClass ESP;
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+
+void host_log(int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+#define log_e(format, ...) host_log(1, "[E] " format, ##__VA_ARGS__)
+#define log_w(format, ...) host_log(2, "[W] " format, ##__VA_ARGS__)
+#define log_i(format, ...) host_log(3, "[I] " format, ##__VA_ARGS__)
+
+// FreeRTOS, one thread per task with a tick of a millisecond
+
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t TickType_t;
+typedef void (*TaskFunction_t)(void*);
+
+typedef struct HostTask* TaskHandle_t;
+typedef struct HostQueue* QueueHandle_t;
+typedef struct HostSemaphore* SemaphoreHandle_t;
+
+#define pdTRUE  1
+#define pdFALSE 0
+#define pdPASS  pdTRUE
+#define portMAX_DELAY ((TickType_t)0xffffffff)
+#define tskNO_AFFINITY 0x7fffffff
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+#define taskSCHEDULER_SUSPENDED   0
+#define taskSCHEDULER_NOT_STARTED 1
+#define taskSCHEDULER_RUNNING     2
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char* name, uint32_t stackSize, void* parameters,
+                                   UBaseType_t priority, TaskHandle_t* handle, BaseType_t core);
+TaskHandle_t xTaskGetCurrentTaskHandle();
+BaseType_t xTaskGetSchedulerState(); //!< Always running, every thread of the process counts as a task
+void vTaskDelay(TickType_t ticks);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks);
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize);
+void vQueueDelete(QueueHandle_t queue);
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t ticks);
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t ticks);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
+
+SemaphoreHandle_t xSemaphoreCreateBinary();
+SemaphoreHandle_t xSemaphoreCreateMutex();
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex();
+void vSemaphoreDelete(SemaphoreHandle_t semaphore);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t semaphore, TickType_t ticks);
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t semaphore);
+
+typedef struct {
+  volatile int locked;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED { 0 }
+#define portMUX_INITIALIZE(mux) ((mux)->locked = 0)
+
+void portENTER_CRITICAL(portMUX_TYPE* mux);
+void portEXIT_CRITICAL(portMUX_TYPE* mux);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef FASTBLEOTA_HOST_NIMBLEDEVICE_H
+#define FASTBLEOTA_HOST_NIMBLEDEVICE_H
+
+// Host stand-in for the parts of NimBLE-Arduino 1.x that FastBLEOTA uses. Like the real library it pulls in the
+// NimBLE host C API, which is where the GATT server lives; clients are driven with the host_* functions of host.h
+
+#include "Arduino.h"
+#include "host/ble_hs.h"
+#include <string>
+
+class NimBLEUUID {
+  public:
+    NimBLEUUID(const char* uuid);
+    const ble_uuid_any_t* getNative() const { return &_uuid; }
+    std::string toString() const { return _string; }
+
+  private:
+    std::string _string;
+    ble_uuid_any_t _uuid = {};
+};
+
+class NimBLEServer;
+
+class NimBLEServerCallbacks {
+  public:
+    virtual ~NimBLEServerCallbacks() {}
+    virtual void onConnect(NimBLEServer* pServer) {}
+    virtual void onConnect(NimBLEServer* pServer, ble_gap_conn_desc* desc) {}
+    virtual void onDisconnect(NimBLEServer* pServer) {}
+    virtual void onDisconnect(NimBLEServer* pServer, ble_gap_conn_desc* desc) {}
+};
+
+class NimBLEServer {
+  public:
+    void start(); //!< Starts the GATT server, which advertising does on a device
+    void setCallbacks(NimBLEServerCallbacks* pCallbacks, bool deleteCallbacks = true) { _callbacks = pCallbacks; }
+    void setDataLen(uint16_t conn_handle, uint16_t tx_octets);
+    void updateConnParams(uint16_t conn_handle, uint16_t minInterval, uint16_t maxInterval, uint16_t latency,
+                          uint16_t timeout);
+
+  private:
+    NimBLEServerCallbacks* _callbacks = nullptr;
+};
+
+class NimBLEDevice {
+  public:
+    static void init(const std::string& deviceName) {}
+    static NimBLEServer* createServer();
+};
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef FASTBLEOTA_HOST_PREFERENCES_H
+#define FASTBLEOTA_HOST_PREFERENCES_H
+
+#include "Arduino.h"
+
+// NVS kept in memory for the life of the process, so it survives the engines that write it like NVS survives a reboot
+class Preferences {
+  public:
+    bool begin(const char* name, bool readOnly = false);
+    void end();
+
+    size_t getBytes(const char* key, void* buffer, size_t length);
+    size_t putBytes(const char* key, const void* value, size_t length);
+    bool isKey(const char* key);
+    bool remove(const char* key);
+
+  private:
+    char _namespace[16] = {};
+    bool _started = false;
+    bool _readOnly = false;
+};
+
+#endif
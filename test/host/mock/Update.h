@@ -0,0 +1,57 @@
+#ifndef FASTBLEOTA_HOST_UPDATE_H
+#define FASTBLEOTA_HOST_UPDATE_H
+
+#include "Arduino.h"
+
+#define U_FLASH  0
+#define U_SPIFFS 100
+#define UPDATE_SIZE_UNKNOWN 0xFFFFFFFF
+
+#define UPDATE_ERROR_OK             0
+#define UPDATE_ERROR_WRITE          1
+#define UPDATE_ERROR_ERASE          2
+#define UPDATE_ERROR_SPACE          4
+#define UPDATE_ERROR_SIZE           5
+#define UPDATE_ERROR_STREAM         6
+#define UPDATE_ERROR_MAGIC_BYTE     8
+#define UPDATE_ERROR_NO_PARTITION   10
+#define UPDATE_ERROR_BAD_ARGUMENT   11
+#define UPDATE_ERROR_ABORT          12
+
+/**
+ * Writes the image to update_app.bin or update_fs.bin in the directory set with host_set_update_dir(). Like the
+ * Arduino Update it copies writes into a sector buffer and erases and programs a sector at a time, charging the
+ * flash model for both.
+ */
+class UpdateClass {
+  public:
+    UpdateClass();
+    ~UpdateClass();
+
+    bool begin(size_t size = UPDATE_SIZE_UNKNOWN, int command = U_FLASH, int ledPin = -1, uint8_t ledOn = 0,
+               const char* label = NULL);
+    size_t write(uint8_t* data, size_t length);
+    bool end(bool evenIfRemaining = false);
+    void abort();
+    void printError(Print& output);
+    uint8_t getError() { return _error; }
+    bool hasError() { return _error != UPDATE_ERROR_OK; }
+    bool isRunning() { return _size > 0; }
+
+  private:
+    bool writeBuffer();
+    void close();
+
+    FILE* _file = nullptr;
+    char _path[256] = {};
+    int _command = U_FLASH;
+    uint8_t* _buffer = nullptr;
+    size_t _bufferLength = 0;
+    size_t _size = 0;
+    size_t _progress = 0;
+    uint8_t _error = UPDATE_ERROR_OK;
+};
+
+extern UpdateClass Update;
+
+#endif
@@ -0,0 +1,114 @@
+#include "Arduino.h"
+#include "host.h"
+#include <chrono>
+#include <thread>
+
+HardwareSerial Serial;
+EspClass ESP;
+
+static const auto startTime = std::chrono::steady_clock::now();
+static thread_local uint64_t chargedNs = 0;
+static host_time_mode_t timeMode = HOST_TIME_VIRTUAL;
+
+static FILE* serialOutput = nullptr;
+static uint32_t serialBaud = 0;
+static int logLevel = 1;
+
+void host_set_time_mode(host_time_mode_t mode) {
+  timeMode = mode;
+}
+
+uint64_t host_now_ns() {
+  auto elapsed = std::chrono::steady_clock::now() - startTime;
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() + chargedNs;
+}
+
+void host_charge_ns(uint64_t ns) {
+  if (ns == 0) return;
+  if (timeMode == HOST_TIME_SLEEP) std::this_thread::sleep_for(std::chrono::nanoseconds(ns));
+  else chargedNs += ns;
+}
+
+uint32_t millis() {
+  return (uint32_t)(host_now_ns() / 1000000);
+}
+
+uint32_t micros() {
+  return (uint32_t)(host_now_ns() / 1000);
+}
+
+void delay(uint32_t ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void host_set_serial(FILE* output, uint32_t baud) {
+  serialOutput = output;
+  serialBaud = baud;
+}
+
+void host_set_log_level(int level) {
+  logLevel = level;
+}
+
+void host_log(int level, const char* format, ...) {
+  if (level > logLevel) return;
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputc('\n', stderr);
+}
+
+size_t Print::print(const char* text) {
+  return write((const uint8_t*)text, strlen(text));
+}
+
+size_t Print::print(double value, int digits) {
+  char buffer[32];
+  int length = snprintf(buffer, sizeof(buffer), "%.*f", digits, value);
+  return length > 0 ? write((const uint8_t*)buffer, length) : 0;
+}
+
+size_t Print::println(const char* text) {
+  return print(text) + write((const uint8_t*)"\r\n", 2);
+}
+
+size_t Print::println(double value, int digits) {
+  return print(value, digits) + write((const uint8_t*)"\r\n", 2);
+}
+
+size_t Print::printf(const char* format, ...) {
+  char buffer[1024];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  if (length < 0) return 0;
+  return write((const uint8_t*)buffer, (size_t)length < sizeof(buffer) ? length : sizeof(buffer) - 1);
+}
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size) {
+  if (serialOutput) fwrite(buffer, 1, size, serialOutput);
+  // Ten bit times a byte, the UART FIFO is assumed full as it is when printing from a hot path
+  if (serialBaud) host_charge_ns((uint64_t)size * 10 * 1000000000 / serialBaud);
+  return size;
+}
+
+uint32_t EspClass::getFreeHeap() {
+  return 200 * 1024;
+}
+
+const char* esp_err_to_name(esp_err_t code) {
+  switch (code) {
+    case ESP_OK: return "ESP_OK";
+    case ESP_FAIL: return "ESP_FAIL";
+    case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_OTA_VALIDATE_FAILED: return "ESP_ERR_OTA_VALIDATE_FAILED";
+    default: return "UNKNOWN ERROR";
+  }
+}
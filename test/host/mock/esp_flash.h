@@ -0,0 +1,10 @@
+#ifndef FASTBLEOTA_HOST_ESP_FLASH_H
+#define FASTBLEOTA_HOST_ESP_FLASH_H
+
+#include "Arduino.h"
+
+typedef struct esp_flash_t esp_flash_t;
+
+esp_err_t esp_flash_get_size(esp_flash_t* chip, uint32_t* size);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef FASTBLEOTA_HOST_ESP_HEAP_CAPS_H
+#define FASTBLEOTA_HOST_ESP_HEAP_CAPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The host build calls these from its malloc and operator new, as ESP-IDF does with CONFIG_HEAP_USE_HOOKS
+extern "C" void esp_heap_trace_alloc_hook(void* ptr, size_t size, uint32_t caps);
+extern "C" void esp_heap_trace_free_hook(void* ptr);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef FASTBLEOTA_HOST_ESP_IMAGE_FORMAT_H
+#define FASTBLEOTA_HOST_ESP_IMAGE_FORMAT_H
+
+#include <stdint.h>
+
+#define ESP_IMAGE_HEADER_MAGIC 0xE9
+
+typedef enum {
+  ESP_IMAGE_FLASH_SIZE_1MB = 0,
+  ESP_IMAGE_FLASH_SIZE_2MB,
+  ESP_IMAGE_FLASH_SIZE_4MB,
+  ESP_IMAGE_FLASH_SIZE_8MB,
+  ESP_IMAGE_FLASH_SIZE_16MB
+} esp_image_flash_size_t;
+
+typedef struct __attribute__((packed)) {
+  uint8_t magic;
+  uint8_t segment_count;
+  uint8_t spi_mode;
+  uint8_t spi_speed : 4;
+  uint8_t spi_size : 4;
+  uint32_t entry_addr;
+  uint8_t wp_pin;
+  uint8_t spi_pin_drv[3];
+  uint16_t chip_id;
+  uint8_t min_chip_rev;
+  uint16_t min_chip_rev_full;
+  uint16_t max_chip_rev_full;
+  uint8_t reserved[4];
+  uint8_t hash_appended;
+} esp_image_header_t;
+
+typedef struct {
+  uint32_t load_addr;
+  uint32_t data_len;
+} esp_image_segment_header_t;
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef FASTBLEOTA_HOST_ESP_OTA_OPS_H
+#define FASTBLEOTA_HOST_ESP_OTA_OPS_H
+
+#include "esp_partition.h"
+
+#define ESP_APP_DESC_MAGIC_WORD 0xABCD5432
+#define OTA_WITH_SEQUENTIAL_WRITES 0xfffffffe
+
+typedef uint32_t esp_ota_handle_t;
+
+typedef struct {
+  uint32_t magic_word;
+  uint32_t secure_version;
+  uint32_t reserv1[2];
+  char version[32];
+  char project_name[32];
+  char time[16];
+  char date[16];
+  char idf_ver[32];
+  uint8_t app_elf_sha256[32];
+  uint32_t reserv2[20];
+} esp_app_desc_t;
+
+const esp_partition_t* esp_ota_get_running_partition();
+const esp_partition_t* esp_ota_get_next_update_partition(const esp_partition_t* start);
+esp_err_t esp_ota_get_partition_description(const esp_partition_t* partition, esp_app_desc_t* app);
+esp_err_t esp_ota_begin(const esp_partition_t* partition, size_t size, esp_ota_handle_t* handle);
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void* data, size_t size);
+esp_err_t esp_ota_end(esp_ota_handle_t handle);
+esp_err_t esp_ota_abort(esp_ota_handle_t handle);
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t* partition);
+
+#endif
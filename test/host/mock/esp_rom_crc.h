@@ -0,0 +1,9 @@
+#ifndef FASTBLEOTA_HOST_ESP_ROM_CRC_H
+#define FASTBLEOTA_HOST_ESP_ROM_CRC_H
+
+#include <stdint.h>
+
+// The ROM's CRC-32, a byte at a time from a 256 entry table, matching zlib's crc32()
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t* buf, uint32_t len);
+
+#endif
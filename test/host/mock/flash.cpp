@@ -0,0 +1,416 @@
+#include "esp_partition.h"
+#include "esp_ota_ops.h"
+#include "esp_image_format.h"
+#include "esp_flash.h"
+#include "Update.h"
+#include "host.h"
+#include "mbedtls/sha256.h"
+#include <string>
+#include <vector>
+
+#define SECTOR_SIZE 4096
+#define PAGE_SIZE   256
+#define FLASH_SIZE  (4 * 1024 * 1024)
+
+const host_flash_model_t HOST_FLASH_NONE = { "none", 0, 0 };
+const host_flash_model_t HOST_FLASH_TYPICAL = { "typical", 45000, 700 };
+const host_flash_model_t HOST_FLASH_SLOW = { "slow", 400000, 3000 };
+
+static host_flash_model_t flashModel = HOST_FLASH_NONE;
+
+struct Partition {
+  esp_partition_t info;
+  std::vector<uint8_t> data;
+};
+
+// The default Arduino layout of a 4 MB module
+static Partition partitions[] = {
+  { { ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, 0x10000, 0x140000, SECTOR_SIZE, "app0", false }, {} },
+  { { ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, 0x150000, 0x140000, SECTOR_SIZE, "app1", false }, {} },
+  { { ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, 0x290000, 0x160000, SECTOR_SIZE, "spiffs", false }, {} }
+};
+
+static Partition& runningPartition = partitions[0];
+static Partition& updatePartition = partitions[1];
+static size_t runningImageSize = 0;
+static const esp_partition_t* bootPartition = nullptr;
+
+struct OtaHandle {
+  const esp_partition_t* partition;
+  size_t offset;
+  size_t erasedSize;
+  bool open;
+};
+
+static OtaHandle otaHandles[2] = {};
+
+static std::string updateDir = ".";
+
+const host_flash_model_t* host_find_flash_model(const char* name) {
+  static const host_flash_model_t* models[] = { &HOST_FLASH_NONE, &HOST_FLASH_TYPICAL, &HOST_FLASH_SLOW };
+  for (const host_flash_model_t* model : models) {
+    if (strcmp(model->name, name) == 0) return model;
+  }
+  return nullptr;
+}
+
+void host_set_flash_model(const host_flash_model_t& model) {
+  flashModel = model;
+}
+
+static void chargeErase(size_t size) {
+  host_charge_ns((uint64_t)(size / SECTOR_SIZE) * flashModel.eraseSectorUs * 1000);
+}
+
+static void chargeProgram(size_t size) {
+  host_charge_ns((uint64_t)size * flashModel.programPageUs * 1000 / PAGE_SIZE);
+}
+
+static Partition* findPartition(const esp_partition_t* info) {
+  for (Partition& partition : partitions) {
+    if (&partition.info != info) continue;
+    // Flash nobody reset reads as erased
+    if (partition.data.empty()) partition.data.assign(partition.info.size, 0xFF);
+    return &partition;
+  }
+  return nullptr;
+}
+
+static Partition* findPartition(const char* label) {
+  for (Partition& partition : partitions) {
+    if (strcmp(partition.info.label, label) == 0) return findPartition(&partition.info);
+  }
+  return nullptr;
+}
+
+void host_flash_reset(uint8_t fill) {
+  for (Partition& partition : partitions) {
+    partition.data.assign(partition.info.size, fill);
+    partition.info.encrypted = false;
+  }
+  runningImageSize = 0;
+  bootPartition = nullptr;
+  for (OtaHandle& handle : otaHandles) handle = {};
+}
+
+const uint8_t* host_partition_data(const char* label) {
+  Partition* partition = findPartition(label);
+  return partition ? partition->data.data() : nullptr;
+}
+
+void host_set_partition_encrypted(const char* label, bool encrypted) {
+  Partition* partition = findPartition(label);
+  if (partition) partition->info.encrypted = encrypted;
+}
+
+const char* host_boot_partition() {
+  return bootPartition ? bootPartition->label : nullptr;
+}
+
+void host_set_running_image(const std::vector<uint8_t>& image) {
+  std::vector<uint8_t>& data = runningPartition.data;
+  if (data.size() != runningPartition.info.size) data.assign(runningPartition.info.size, 0xFF);
+  memcpy(data.data(), image.data(), image.size());
+  memset(data.data() + image.size(), 0xFF, data.size() - image.size());
+  runningImageSize = image.size();
+}
+
+void host_set_update_dir(const char* path) {
+  updateDir = path;
+}
+
+std::vector<uint8_t> host_read_file(const char* path) {
+  std::vector<uint8_t> contents;
+  FILE* file = fopen(path, "rb");
+  if (!file) return contents;
+
+  uint8_t buffer[4096];
+  size_t length;
+  while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) contents.insert(contents.end(), buffer, buffer + length);
+  fclose(file);
+  return contents;
+}
+
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                const char* label) {
+  for (Partition& partition : partitions) {
+    if (partition.info.type != type) continue;
+    if (subtype != ESP_PARTITION_SUBTYPE_ANY && partition.info.subtype != subtype) continue;
+    if (label && strcmp(partition.info.label, label) != 0) continue;
+    return &partition.info;
+  }
+  return nullptr;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t* info, size_t offset, void* dst, size_t size) {
+  Partition* partition = findPartition(info);
+  if (!partition || offset + size > info->size) return ESP_ERR_INVALID_SIZE;
+  memcpy(dst, partition->data.data() + offset, size);
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t* info, size_t offset, const void* src, size_t size) {
+  Partition* partition = findPartition(info);
+  if (!partition || offset + size > info->size) return ESP_ERR_INVALID_SIZE;
+
+  // NOR flash only clears bits, so programming a sector that was not erased first corrupts it
+  uint8_t* data = partition->data.data() + offset;
+  const uint8_t* bytes = (const uint8_t*)src;
+  for (size_t i = 0; i < size; i++) data[i] &= bytes[i];
+  chargeProgram(size);
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* info, size_t offset, size_t size) {
+  Partition* partition = findPartition(info);
+  if (!partition || offset + size > info->size) return ESP_ERR_INVALID_SIZE;
+  if (offset % SECTOR_SIZE || size % SECTOR_SIZE) return ESP_ERR_INVALID_ARG;
+
+  memset(partition->data.data() + offset, 0xFF, size);
+  chargeErase(size);
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_get_sha256(const esp_partition_t* info, uint8_t* sha256) {
+  Partition* partition = findPartition(info);
+  if (!partition) return ESP_ERR_NOT_FOUND;
+
+  // The device hashes the app image it finds in the partition, here that is the image installed as running
+  size_t size = partition == &runningPartition && runningImageSize ? runningImageSize : info->size;
+  mbedtls_sha256_context context;
+  mbedtls_sha256_init(&context);
+  mbedtls_sha256_starts(&context, 0);
+  mbedtls_sha256_update(&context, partition->data.data(), size);
+  mbedtls_sha256_finish(&context, sha256);
+  mbedtls_sha256_free(&context);
+  return ESP_OK;
+}
+
+esp_err_t esp_flash_get_size(esp_flash_t* chip, uint32_t* size) {
+  *size = FLASH_SIZE;
+  return ESP_OK;
+}
+
+const esp_partition_t* esp_ota_get_running_partition() {
+  return &runningPartition.info;
+}
+
+const esp_partition_t* esp_ota_get_next_update_partition(const esp_partition_t* start) {
+  return &updatePartition.info;
+}
+
+esp_err_t esp_ota_get_partition_description(const esp_partition_t* info, esp_app_desc_t* app) {
+  if (!info || info->type != ESP_PARTITION_TYPE_APP) return ESP_ERR_NOT_FOUND;
+
+  size_t offset = sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t);
+  if (esp_partition_read(info, offset, app, sizeof(*app)) != ESP_OK) return ESP_FAIL;
+  return app->magic_word == ESP_APP_DESC_MAGIC_WORD ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+// Stands in for the image verification ESP-IDF runs, which also checks the segment checksums and appended hash
+static bool validImage(const esp_partition_t* info) {
+  uint8_t magic;
+  esp_app_desc_t app;
+  return esp_partition_read(info, 0, &magic, sizeof(magic)) == ESP_OK && magic == ESP_IMAGE_HEADER_MAGIC &&
+         esp_ota_get_partition_description(info, &app) == ESP_OK;
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t* info, size_t size, esp_ota_handle_t* handle) {
+  if (!info || info == &runningPartition.info || info->type != ESP_PARTITION_TYPE_APP) return ESP_ERR_INVALID_ARG;
+
+  for (esp_ota_handle_t i = 0; i < sizeof(otaHandles) / sizeof(otaHandles[0]); i++) {
+    OtaHandle& ota = otaHandles[i];
+    if (ota.open) continue;
+
+    ota = { info, 0, 0, true };
+    // Without sequential writes the whole image is erased up front, as esp_ota_begin does
+    if (size != OTA_WITH_SEQUENTIAL_WRITES) {
+      size_t eraseSize = size == 0 || size > info->size ? info->size : (size + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+      esp_err_t error = esp_partition_erase_range(info, 0, eraseSize);
+      if (error != ESP_OK) {
+        ota.open = false;
+        return error;
+      }
+      ota.erasedSize = eraseSize;
+    }
+
+    // Handles count from 1, 0 is never a valid handle
+    *handle = i + 1;
+    return ESP_OK;
+  }
+  return ESP_ERR_NO_MEM;
+}
+
+static OtaHandle* findHandle(esp_ota_handle_t handle) {
+  if (handle == 0 || handle > sizeof(otaHandles) / sizeof(otaHandles[0])) return nullptr;
+  OtaHandle* ota = &otaHandles[handle - 1];
+  return ota->open ? ota : nullptr;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void* data, size_t size) {
+  OtaHandle* ota = findHandle(handle);
+  if (!ota) return ESP_ERR_INVALID_ARG;
+  if (ota->offset == 0 && size > 0 && ((const uint8_t*)data)[0] != ESP_IMAGE_HEADER_MAGIC) {
+    return ESP_ERR_OTA_VALIDATE_FAILED;
+  }
+  if (ota->offset + size > ota->partition->size) return ESP_ERR_INVALID_SIZE;
+
+  size_t end = ota->offset + size;
+  if (end > ota->erasedSize) {
+    size_t eraseEnd = (end + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    esp_err_t error = esp_partition_erase_range(ota->partition, ota->erasedSize, eraseEnd - ota->erasedSize);
+    if (error != ESP_OK) return error;
+    ota->erasedSize = eraseEnd;
+  }
+
+  esp_err_t error = esp_partition_write(ota->partition, ota->offset, data, size);
+  ota->offset = end;
+  return error;
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle) {
+  OtaHandle* ota = findHandle(handle);
+  if (!ota) return ESP_ERR_NOT_FOUND;
+  ota->open = false;
+  return validImage(ota->partition) ? ESP_OK : ESP_ERR_OTA_VALIDATE_FAILED;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle) {
+  OtaHandle* ota = findHandle(handle);
+  if (!ota) return ESP_ERR_NOT_FOUND;
+  ota->open = false;
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t* info) {
+  if (!info || info->type != ESP_PARTITION_TYPE_APP) return ESP_ERR_INVALID_ARG;
+  if (!validImage(info)) return ESP_ERR_OTA_VALIDATE_FAILED;
+  bootPartition = info;
+  return ESP_OK;
+}
+
+UpdateClass Update;
+
+UpdateClass::UpdateClass() {}
+
+UpdateClass::~UpdateClass() {
+  close();
+}
+
+bool UpdateClass::begin(size_t size, int command, int ledPin, uint8_t ledOn, const char* label) {
+  if (_size > 0) {
+    _error = UPDATE_ERROR_BAD_ARGUMENT;
+    return false;
+  }
+  _error = UPDATE_ERROR_OK;
+
+  const esp_partition_t* partition = command == U_SPIFFS
+    ? esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, label)
+    : esp_ota_get_next_update_partition(nullptr);
+  if (!partition) {
+    _error = UPDATE_ERROR_NO_PARTITION;
+    return false;
+  }
+  if (size == 0 || size == UPDATE_SIZE_UNKNOWN || size > partition->size) {
+    _error = UPDATE_ERROR_SIZE;
+    return false;
+  }
+
+  snprintf(_path, sizeof(_path), "%s/%s", updateDir.c_str(), command == U_SPIFFS ? "update_fs.bin" : "update_app.bin");
+  _file = fopen(_path, "wb");
+  if (!_file) {
+    _error = UPDATE_ERROR_WRITE;
+    return false;
+  }
+  // Whole sectors are written at once, and a stdio buffer would be one more allocation than the device makes
+  setvbuf(_file, nullptr, _IONBF, 0);
+
+  // Allocated by begin() like the Arduino Update, so writes copy into it without allocating
+  _buffer = new uint8_t[SECTOR_SIZE];
+  _bufferLength = 0;
+  _command = command;
+  _size = size;
+  _progress = 0;
+  return true;
+}
+
+size_t UpdateClass::write(uint8_t* data, size_t length) {
+  if (hasError() || !isRunning()) return 0;
+  if (length > _size - _progress) length = _size - _progress;
+
+  size_t written = 0;
+  while (written < length) {
+    size_t copyBytes = SECTOR_SIZE - _bufferLength;
+    if (copyBytes > length - written) copyBytes = length - written;
+    memcpy(_buffer + _bufferLength, data + written, copyBytes);
+    _bufferLength += copyBytes;
+    written += copyBytes;
+
+    if ((_bufferLength == SECTOR_SIZE || _progress + _bufferLength == _size) && !writeBuffer()) return written;
+  }
+  return written;
+}
+
+bool UpdateClass::writeBuffer() {
+  if (_progress == 0 && _command == U_FLASH && _buffer[0] != ESP_IMAGE_HEADER_MAGIC) {
+    _error = UPDATE_ERROR_MAGIC_BYTE;
+    close();
+    return false;
+  }
+
+  // Every sector is erased and programmed as it fills, which is what makes Update's write path stall
+  chargeErase(SECTOR_SIZE);
+  chargeProgram(_bufferLength);
+  if (fwrite(_buffer, 1, _bufferLength, _file) != _bufferLength) {
+    _error = UPDATE_ERROR_WRITE;
+    close();
+    return false;
+  }
+
+  _progress += _bufferLength;
+  _bufferLength = 0;
+  return true;
+}
+
+bool UpdateClass::end(bool evenIfRemaining) {
+  if (hasError() || !isRunning()) return false;
+  if (_progress + _bufferLength < _size && !evenIfRemaining) {
+    _error = UPDATE_ERROR_ABORT;
+    close();
+    return false;
+  }
+  if (_bufferLength > 0 && !writeBuffer()) return false;
+
+  bool closed = fclose(_file) == 0;
+  _file = nullptr;
+  if (_command == U_FLASH) bootPartition = esp_ota_get_next_update_partition(nullptr);
+  delete[] _buffer;
+  _buffer = nullptr;
+  _size = 0;
+  return closed;
+}
+
+void UpdateClass::abort() {
+  _error = UPDATE_ERROR_ABORT;
+  close();
+}
+
+void UpdateClass::close() {
+  if (_file) {
+    fclose(_file);
+    remove(_path);
+    _file = nullptr;
+  }
+  delete[] _buffer;
+  _buffer = nullptr;
+  _size = 0;
+}
+
+void UpdateClass::printError(Print& output) {
+  static const char* messages[] = {
+    "No Error", "Flash Write Failed", "Flash Erase Failed", "Flash Read Failed", "Not Enough Space",
+    "Bad Size Given", "Stream Read Timeout", "MD5 Check Failed", "Wrong Magic Byte", "Could Not Activate The Firmware",
+    "Partition Could Not be Found", "Bad Argument", "Aborted"
+  };
+  output.println(_error < sizeof(messages) / sizeof(messages[0]) ? messages[_error] : "Unknown Error");
+}
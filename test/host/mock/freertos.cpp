@@ -0,0 +1,221 @@
+#include "Arduino.h"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+struct HostTask {
+  std::mutex mutex;
+  std::condition_variable notified;
+  uint32_t notifications = 0;
+};
+
+struct HostQueue {
+  std::mutex mutex;
+  std::condition_variable changed;
+  uint8_t* items;
+  UBaseType_t length;
+  UBaseType_t itemSize;
+  UBaseType_t head = 0;
+  UBaseType_t count = 0;
+};
+
+struct HostSemaphore {
+  std::mutex mutex;
+  std::condition_variable given;
+  UBaseType_t count;
+  UBaseType_t maxCount;
+  TaskHandle_t holder = nullptr; //!< Recursive mutexes only
+  UBaseType_t depth = 0;
+  // Recursive mutexes are handed to the tasks waiting for them in turn, as FreeRTOS unblocks a waiting task when the
+  // holder gives the mutex, rather than letting the holder take it straight back
+  uint32_t nextTurn = 0;
+  uint32_t turn = 0;
+  bool skipped[32] = {}; //!< Turns of waiters that timed out, by turn modulo 32
+};
+
+// Plain data, so asking for the current task never allocates, which the heap hooks rely on
+static thread_local TaskHandle_t currentTask = nullptr;
+static thread_local char threadIdentity;
+
+// Waits on condition until ready, for ticks milliseconds or forever with portMAX_DELAY
+template <typename Ready>
+static bool waitFor(std::condition_variable& condition, std::unique_lock<std::mutex>& lock, TickType_t ticks,
+                    Ready ready) {
+  if (ticks == portMAX_DELAY) {
+    condition.wait(lock, ready);
+    return true;
+  }
+  return condition.wait_for(lock, std::chrono::milliseconds(ticks), ready);
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char* name, uint32_t stackSize, void* parameters,
+                                   UBaseType_t priority, TaskHandle_t* handle, BaseType_t core) {
+  // Tasks run for the life of the process, like the engine's tasks on the device
+  TaskHandle_t task = new HostTask();
+  if (handle) *handle = task;
+
+  std::thread([=]() {
+    currentTask = task;
+    function(parameters);
+  }).detach();
+  return pdPASS;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+  return currentTask ? currentTask : (TaskHandle_t)&threadIdentity;
+}
+
+BaseType_t xTaskGetSchedulerState() {
+  return taskSCHEDULER_RUNNING;
+}
+
+void vTaskDelay(TickType_t ticks) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  std::lock_guard<std::mutex> lock(task->mutex);
+  task->notifications++;
+  task->notified.notify_one();
+  return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks) {
+  HostTask* task = currentTask;
+  std::unique_lock<std::mutex> lock(task->mutex);
+  waitFor(task->notified, lock, ticks, [task]() { return task->notifications > 0; });
+
+  uint32_t notifications = task->notifications;
+  if (notifications) task->notifications = clearOnExit ? 0 : notifications - 1;
+  return notifications;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) {
+  HostQueue* queue = new HostQueue();
+  queue->items = new uint8_t[length * itemSize];
+  queue->length = length;
+  queue->itemSize = itemSize;
+  return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+  delete[] queue->items;
+  delete queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t ticks) {
+  std::unique_lock<std::mutex> lock(queue->mutex);
+  if (!waitFor(queue->changed, lock, ticks, [queue]() { return queue->count < queue->length; })) return pdFALSE;
+
+  UBaseType_t tail = (queue->head + queue->count) % queue->length;
+  memcpy(queue->items + tail * queue->itemSize, item, queue->itemSize);
+  queue->count++;
+  queue->changed.notify_all();
+  return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t ticks) {
+  std::unique_lock<std::mutex> lock(queue->mutex);
+  if (!waitFor(queue->changed, lock, ticks, [queue]() { return queue->count > 0; })) return pdFALSE;
+
+  memcpy(item, queue->items + queue->head * queue->itemSize, queue->itemSize);
+  queue->head = (queue->head + 1) % queue->length;
+  queue->count--;
+  queue->changed.notify_all();
+  return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+  std::lock_guard<std::mutex> lock(queue->mutex);
+  return queue->count;
+}
+
+static SemaphoreHandle_t createSemaphore(UBaseType_t count, UBaseType_t maxCount) {
+  HostSemaphore* semaphore = new HostSemaphore();
+  semaphore->count = count;
+  semaphore->maxCount = maxCount;
+  return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary() {
+  return createSemaphore(0, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+  return createSemaphore(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex() {
+  return createSemaphore(1, 1);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+  delete semaphore;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+  std::unique_lock<std::mutex> lock(semaphore->mutex);
+  if (!waitFor(semaphore->given, lock, ticks, [semaphore]() { return semaphore->count > 0; })) return pdFALSE;
+  semaphore->count--;
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+  std::lock_guard<std::mutex> lock(semaphore->mutex);
+  if (semaphore->count >= semaphore->maxCount) return pdFALSE;
+  semaphore->count++;
+  semaphore->given.notify_one();
+  return pdTRUE;
+}
+
+static void nextTurn(HostSemaphore* semaphore) {
+  semaphore->turn++;
+  while (semaphore->turn != semaphore->nextTurn && semaphore->skipped[semaphore->turn % 32]) {
+    semaphore->skipped[semaphore->turn % 32] = false;
+    semaphore->turn++;
+  }
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t semaphore, TickType_t ticks) {
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  std::unique_lock<std::mutex> lock(semaphore->mutex);
+  if (semaphore->holder == task) {
+    semaphore->depth++;
+    return pdTRUE;
+  }
+
+  uint32_t turn = semaphore->nextTurn++;
+  auto ready = [semaphore, turn]() { return semaphore->count > 0 && semaphore->turn == turn; };
+  if (!waitFor(semaphore->given, lock, ticks, ready)) {
+    if (semaphore->turn == turn) nextTurn(semaphore);
+    else semaphore->skipped[turn % 32] = true;
+    semaphore->given.notify_all();
+    return pdFALSE;
+  }
+
+  semaphore->count--;
+  semaphore->holder = task;
+  semaphore->depth = 1;
+  nextTurn(semaphore);
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t semaphore) {
+  std::lock_guard<std::mutex> lock(semaphore->mutex);
+  if (semaphore->holder != xTaskGetCurrentTaskHandle()) return pdFALSE;
+  if (--semaphore->depth > 0) return pdTRUE;
+
+  semaphore->holder = nullptr;
+  semaphore->count++;
+  semaphore->given.notify_all();
+  return pdTRUE;
+}
+
+void portENTER_CRITICAL(portMUX_TYPE* mux) {
+  while (__atomic_exchange_n(&mux->locked, 1, __ATOMIC_ACQUIRE)) std::this_thread::yield();
+}
+
+void portEXIT_CRITICAL(portMUX_TYPE* mux) {
+  __atomic_store_n(&mux->locked, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,50 @@
+#include "esp_heap_caps.h"
+#include "host.h"
+#include <atomic>
+
+// glibc's allocator, which the overrides below count and forward to
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void __libc_free(void* ptr);
+
+// Builds without the engine's hooks still link, and count allocations all the same
+extern "C" __attribute__((weak)) void esp_heap_trace_alloc_hook(void* ptr, size_t size, uint32_t caps) {}
+extern "C" __attribute__((weak)) void esp_heap_trace_free_hook(void* ptr) {}
+
+static std::atomic<uint64_t> allocations(0);
+static thread_local int untrackedDepth = 0;
+
+uint64_t host_heap_allocations() {
+  return allocations.load(std::memory_order_relaxed);
+}
+
+void host_heap_untracked(bool untracked) {
+  untrackedDepth += untracked ? 1 : -1;
+}
+
+static void* allocated(void* ptr, size_t size) {
+  if (ptr && untrackedDepth == 0) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    esp_heap_trace_alloc_hook(ptr, size, 0);
+  }
+  return ptr;
+}
+
+// operator new allocates with malloc, so replacing the C allocator counts C++ allocations as well
+extern "C" void* malloc(size_t size) {
+  return allocated(__libc_malloc(size), size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+  return allocated(__libc_calloc(count, size), count * size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size) {
+  return allocated(__libc_realloc(ptr, size), size);
+}
+
+extern "C" void free(void* ptr) {
+  if (ptr) esp_heap_trace_free_hook(ptr);
+  __libc_free(ptr);
+}
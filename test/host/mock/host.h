@@ -0,0 +1,88 @@
+#ifndef FASTBLEOTA_HOST_H
+#define FASTBLEOTA_HOST_H
+
+// Controls of the host stand-ins, used by the tests and benchmarks to set up the simulated device and inspect it
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <vector>
+
+/**
+ * Cost of flash operations, charged to the clock of the task performing them. Erasing a sector and programming a
+ * 256 byte page take the same time whichever API does it, so Update, esp_ota and esp_partition writes compare fairly.
+ */
+typedef struct {
+  const char* name;
+  uint32_t eraseSectorUs;  //!< Erasing one 4096 byte sector
+  uint32_t programPageUs;  //!< Programming one 256 byte page, charged pro rata for partial pages
+} host_flash_model_t;
+
+extern const host_flash_model_t HOST_FLASH_NONE;    //!< Flash costs nothing, isolates the cost of the ingest path
+extern const host_flash_model_t HOST_FLASH_TYPICAL; //!< Typical figures of the SPI NOR flash fitted to ESP32 modules
+extern const host_flash_model_t HOST_FLASH_SLOW;    //!< Worst case figures of the same parts
+
+const host_flash_model_t* host_find_flash_model(const char* name);
+
+typedef enum {
+  HOST_TIME_VIRTUAL, //!< Modeled costs advance the clock of the task incurring them, nothing waits
+  HOST_TIME_SLEEP    //!< Modeled costs are slept, so tasks running at once overlap them like on the device
+} host_time_mode_t;
+
+void host_set_flash_model(const host_flash_model_t& model);
+void host_set_time_mode(host_time_mode_t mode);
+
+// Time as micros() reports it, in nanoseconds: real time plus what was charged to the calling task
+uint64_t host_now_ns();
+void host_charge_ns(uint64_t ns);
+
+/**
+ * Restore the flash to its initial layout: two 1.25 MB app partitions, app0 running and app1 the next update
+ * partition, and a 1.375 MB SPIFFS partition. The partitions are filled with fill, so a sector that is programmed
+ * without being erased first reads back wrong unless fill is 0xFF.
+ */
+void host_flash_reset(uint8_t fill = 0x00);
+const uint8_t* host_partition_data(const char* label);
+void host_set_partition_encrypted(const char* label, bool encrypted);
+const char* host_boot_partition(); //!< Label of the partition set to boot, nullptr until one is
+
+// Install an image in the running partition, whose SHA-256 and app description answer queries and image checks
+void host_set_running_image(const std::vector<uint8_t>& image);
+
+void host_nvs_clear();
+
+// Directory the file backed Update writes its images to, update_app.bin and update_fs.bin
+void host_set_update_dir(const char* path);
+std::vector<uint8_t> host_read_file(const char* path);
+
+// Where Serial prints, and the baud rate its time is modeled at, 0 to leave printing unmodeled
+void host_set_serial(FILE* output, uint32_t baud = 0);
+void host_set_log_level(int level); //!< 0 silent, 1 errors, 2 warnings, 3 everything
+
+// Every heap allocation made by the process, including those the engine attributes to its ingest path
+uint64_t host_heap_allocations();
+// Leave the calling thread's allocations uncounted, for stand-ins of what the device takes from pools instead
+void host_heap_untracked(bool untracked);
+
+// A BLE connection as ble_gap_conn_find reports it, and its end as a disconnect event to every gap listener
+void host_connect(uint16_t connHandle, uint16_t interval = 24, uint16_t latency = 0);
+void host_disconnect(uint16_t connHandle);
+
+// A GATT client. Characteristics are found by UUID once NimBLEServer::start() has assigned their handles, 0 if none is
+uint16_t host_find_characteristic(const char* uuid);
+// Deliver a write from the client connected as connHandle, running the access callback on the calling thread
+int host_write(uint16_t handle, uint16_t connHandle, const uint8_t* data, size_t length);
+std::vector<uint8_t> host_read(uint16_t handle, uint16_t connHandle);
+// Enable or disable notifications, as a subscribe event to every gap listener
+void host_subscribe(uint16_t connHandle, uint16_t handle, bool notify);
+// Notifications sent since the last call, oldest first
+std::vector<std::vector<uint8_t>> host_take_notifications(uint16_t handle);
+
+// An L2CAP channel opened by the client connected as connHandle, nullptr if no server listens on psm or it refused
+struct ble_l2cap_chan* host_l2cap_connect(uint16_t connHandle, uint16_t psm);
+// Deliver an SDU on the calling thread, BLE_HS_EBUSY while the server has no receive buffer ready for it
+int host_l2cap_send(struct ble_l2cap_chan* chan, const uint8_t* data, size_t length);
+// Refuse the next buffer the server asks of the pool chan receives into, as if other channels held them all
+void host_l2cap_fail_rx(struct ble_l2cap_chan* chan);
+
+#endif
@@ -0,0 +1,232 @@
+#ifndef FASTBLEOTA_HOST_BLE_HS_H
+#define FASTBLEOTA_HOST_BLE_HS_H
+
+// Host stand-in for the parts of the NimBLE host C API that FastBLEOTA uses: gap, mbufs, L2CAP and the GATT server
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BLE_HS_CONN_HANDLE_NONE 0xffff
+#define BLE_HS_EALREADY         2
+#define BLE_HS_EINVAL           3
+#define BLE_HS_ENOMEM           6
+#define BLE_HS_ENOTCONN         7
+#define BLE_HS_EBUSY            15
+
+#define BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN 0x0d
+#define BLE_ATT_ERR_INSUFFICIENT_RES       0x11
+
+#define BLE_GAP_LE_PHY_1M_MASK    0x01
+#define BLE_GAP_LE_PHY_2M_MASK    0x02
+#define BLE_GAP_LE_PHY_CODED_MASK 0x04
+#define BLE_GAP_LE_PHY_CODED_ANY  0
+
+#define BLE_GAP_EVENT_CONNECT    0
+#define BLE_GAP_EVENT_DISCONNECT 1
+#define BLE_GAP_EVENT_SUBSCRIBE  14
+
+struct ble_gap_conn_desc {
+  uint16_t conn_handle;
+  uint16_t conn_itvl;
+  uint16_t conn_latency;
+  uint16_t supervision_timeout;
+};
+
+struct ble_gap_event {
+  uint8_t type;
+  union {
+    struct {
+      int reason;
+      struct ble_gap_conn_desc conn;
+    } disconnect;
+
+    struct {
+      uint16_t conn_handle;
+      uint16_t attr_handle;
+      uint8_t reason;
+      uint8_t prev_notify : 1;
+      uint8_t cur_notify : 1;
+      uint8_t prev_indicate : 1;
+      uint8_t cur_indicate : 1;
+    } subscribe;
+  };
+};
+
+typedef int ble_gap_event_fn(struct ble_gap_event* event, void* arg);
+
+struct ble_gap_event_listener {
+  ble_gap_event_fn* fn;
+  void* arg;
+  struct ble_gap_event_listener* next;
+};
+
+int ble_gap_event_listener_register(struct ble_gap_event_listener* listener, ble_gap_event_fn* fn, void* arg);
+int ble_gap_conn_find(uint16_t handle, struct ble_gap_conn_desc* out_desc);
+int ble_gap_read_le_phy(uint16_t conn_handle, uint8_t* tx_phy, uint8_t* rx_phy);
+int ble_gap_set_prefered_le_phy(uint16_t conn_handle, uint8_t tx_phys_mask, uint8_t rx_phys_mask, uint16_t phy_opts);
+
+// Memory pools and mbufs, blocks are carved out of the memory handed to os_mempool_init like NimBLE does.
+// Blocks are aligned for the host's pointers, as NimBLE builds with OS_ALIGNMENT 8 do
+
+typedef uint64_t os_membuf_t;
+
+#define OS_MEMPOOL_SIZE(n, blksize) ((((blksize) + sizeof(os_membuf_t) - 1) / sizeof(os_membuf_t)) * (n))
+
+struct os_memblock {
+  struct os_memblock* next;
+};
+
+struct os_mempool {
+  uint32_t mp_block_size;
+  uint16_t mp_num_blocks;
+  uint16_t mp_num_free;
+  struct os_memblock* mp_free;
+  const char* name;
+};
+
+struct os_mbuf_pool {
+  uint16_t omp_databuf_len;
+  struct os_mempool* omp_pool;
+};
+
+struct os_mbuf_pkthdr {
+  uint16_t omp_len;
+  uint16_t omp_flags;
+};
+
+struct os_mbuf {
+  uint8_t* om_data;
+  uint8_t om_flags;
+  uint8_t om_pkthdr_len;
+  uint16_t om_len;
+  struct os_mbuf_pool* om_omp;
+  struct os_mbuf* om_next;
+  uint8_t om_databuf[];
+};
+
+#define OS_MBUF_PKTHDR(om) ((struct os_mbuf_pkthdr*)((om)->om_databuf))
+#define OS_MBUF_PKTLEN(om) (OS_MBUF_PKTHDR(om)->omp_len)
+
+int os_mempool_init(struct os_mempool* mp, uint16_t blocks, uint32_t block_size, void* membuf, const char* name);
+int os_mbuf_pool_init(struct os_mbuf_pool* omp, struct os_mempool* mp, uint16_t buf_len, uint16_t nbufs);
+struct os_mbuf* os_mbuf_get(struct os_mbuf_pool* omp, uint16_t leadingspace);
+struct os_mbuf* os_mbuf_get_pkthdr(struct os_mbuf_pool* omp, uint8_t user_pkthdr_len);
+int os_mbuf_append(struct os_mbuf* om, const void* data, uint16_t len);
+int os_mbuf_copydata(const struct os_mbuf* om, int off, int len, void* dst);
+int os_mbuf_free_chain(struct os_mbuf* om);
+
+// An mbuf of the host's own pool holding a copy of buf, nullptr once the pool is exhausted
+struct os_mbuf* ble_hs_mbuf_from_flat(const void* buf, uint16_t len);
+
+// LE credit based L2CAP channels, SDUs are received into the buffer the server last handed to ble_l2cap_recv_ready
+
+#define BLE_L2CAP_EVENT_COC_CONNECTED     0
+#define BLE_L2CAP_EVENT_COC_DISCONNECTED  1
+#define BLE_L2CAP_EVENT_COC_ACCEPT        2
+#define BLE_L2CAP_EVENT_COC_DATA_RECEIVED 3
+
+struct ble_l2cap_chan;
+
+struct ble_l2cap_event {
+  uint8_t type;
+  union {
+    struct {
+      int status;
+      uint16_t conn_handle;
+      struct ble_l2cap_chan* chan;
+    } connect;
+
+    struct {
+      uint16_t conn_handle;
+      struct ble_l2cap_chan* chan;
+    } disconnect;
+
+    struct {
+      uint16_t conn_handle;
+      uint16_t peer_sdu_size;
+      struct ble_l2cap_chan* chan;
+    } accept;
+
+    struct {
+      uint16_t conn_handle;
+      struct ble_l2cap_chan* chan;
+      struct os_mbuf* sdu_rx;
+    } receive;
+  };
+};
+
+typedef int ble_l2cap_event_fn(struct ble_l2cap_event* event, void* arg);
+
+int ble_l2cap_create_server(uint16_t psm, uint16_t mtu, ble_l2cap_event_fn* cb, void* cb_arg);
+int ble_l2cap_recv_ready(struct ble_l2cap_chan* chan, struct os_mbuf* sdu_rx);
+int ble_l2cap_disconnect(struct ble_l2cap_chan* chan);
+
+// GATT server, attribute handles are assigned when the server starts
+
+#define BLE_UUID_TYPE_128 128
+
+typedef struct {
+  uint8_t type;
+} ble_uuid_t;
+
+typedef struct {
+  ble_uuid_t u;
+  uint8_t value[16];
+} ble_uuid128_t;
+
+typedef union {
+  ble_uuid_t u;
+  ble_uuid128_t u128;
+} ble_uuid_any_t;
+
+int ble_uuid_cmp(const ble_uuid_t* uuid1, const ble_uuid_t* uuid2);
+
+#define BLE_GATT_SVC_TYPE_END     0
+#define BLE_GATT_SVC_TYPE_PRIMARY 1
+
+#define BLE_GATT_CHR_F_READ         0x0002
+#define BLE_GATT_CHR_F_WRITE_NO_RSP 0x0004
+#define BLE_GATT_CHR_F_WRITE        0x0008
+#define BLE_GATT_CHR_F_NOTIFY       0x0010
+
+#define BLE_GATT_ACCESS_OP_READ_CHR  0
+#define BLE_GATT_ACCESS_OP_WRITE_CHR 1
+
+typedef uint16_t ble_gatt_chr_flags;
+
+struct ble_gatt_access_ctxt;
+typedef int ble_gatt_access_fn(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt* ctxt,
+                               void* arg);
+
+struct ble_gatt_chr_def {
+  const ble_uuid_t* uuid;
+  ble_gatt_access_fn* access_cb;
+  void* arg;
+  struct ble_gatt_dsc_def* descriptors;
+  ble_gatt_chr_flags flags;
+  uint8_t min_key_size;
+  uint16_t* val_handle;
+};
+
+struct ble_gatt_svc_def {
+  uint8_t type;
+  const ble_uuid_t* uuid;
+  const struct ble_gatt_svc_def** includes;
+  const struct ble_gatt_chr_def* characteristics;
+};
+
+struct ble_gatt_access_ctxt {
+  uint8_t op;
+  struct os_mbuf* om;
+  const struct ble_gatt_chr_def* chr;
+};
+
+// Reserve the attributes of defs, ble_gatts_start fails when the registered services need more than were reserved
+int ble_gatts_count_cfg(const struct ble_gatt_svc_def* defs);
+// Only keeps the pointer, defs are read when the server starts
+int ble_gatts_add_svcs(const struct ble_gatt_svc_def* svcs);
+int ble_gatts_start(void);
+// Consumes om whether or not it is sent
+int ble_gattc_notify_custom(uint16_t conn_handle, uint16_t att_handle, struct os_mbuf* om);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef FASTBLEOTA_HOST_MBEDTLS_SHA256_H
+#define FASTBLEOTA_HOST_MBEDTLS_SHA256_H
+
+// SHA-256 in software, as mbedtls runs it on chips without the SHA accelerator
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+  uint32_t total[2];
+  uint32_t state[8];
+  unsigned char buffer[64];
+  int is224;
+} mbedtls_sha256_context;
+
+void mbedtls_sha256_init(mbedtls_sha256_context* ctx);
+void mbedtls_sha256_free(mbedtls_sha256_context* ctx);
+int mbedtls_sha256_starts(mbedtls_sha256_context* ctx, int is224);
+int mbedtls_sha256_update(mbedtls_sha256_context* ctx, const unsigned char* input, size_t ilen);
+int mbedtls_sha256_finish(mbedtls_sha256_context* ctx, unsigned char* output);
+
+#endif
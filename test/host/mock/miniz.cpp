@@ -0,0 +1,93 @@
+#include "rom/miniz.h"
+#include <string.h>
+
+#define DECOMPRESSOR_MAGIC 0x4C464E49
+
+// zlib's state is not an allocation of the engine's, so it bypasses the counting malloc
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void __libc_free(void* ptr);
+
+static voidpf zalloc(voidpf opaque, uInt items, uInt size) {
+  return __libc_malloc((size_t)items * size);
+}
+
+static void zfree(voidpf opaque, voidpf address) {
+  __libc_free(address);
+}
+
+static void endStream(tinfl_decompressor* r) {
+  if (r->started) inflateEnd(&r->stream);
+  r->started = false;
+}
+
+void host_tinfl_init(tinfl_decompressor* r) {
+  if (r->magic == DECOMPRESSOR_MAGIC && r->self == r) endStream(r);
+  r->magic = DECOMPRESSOR_MAGIC;
+  r->self = r;
+  r->started = false;
+  r->ended = false;
+  r->pending = false;
+}
+
+static tinfl_status fail(tinfl_decompressor* r, tinfl_status status) {
+  endStream(r);
+  return status;
+}
+
+tinfl_status tinfl_decompress(tinfl_decompressor* r, const uint8_t* pIn_buf_next, size_t* pIn_buf_size,
+                              uint8_t* pOut_buf_start, uint8_t* pOut_buf_next, size_t* pOut_buf_size,
+                              const uint32_t decomp_flags) {
+  size_t inSize = *pIn_buf_size;
+  size_t outSize = *pOut_buf_size;
+  *pIn_buf_size = 0;
+  *pOut_buf_size = 0;
+  if (r->magic != DECOMPRESSOR_MAGIC || r->self != r) return TINFL_STATUS_BAD_PARAM;
+
+  if (!r->started && !r->ended) {
+    memset(&r->stream, 0, sizeof(r->stream));
+    r->stream.zalloc = zalloc;
+    r->stream.zfree = zfree;
+    int windowBits = decomp_flags & TINFL_FLAG_PARSE_ZLIB_HEADER ? 15 : -15;
+    if (inflateInit2(&r->stream, windowBits) != Z_OK) return TINFL_STATUS_FAILED;
+    r->started = true;
+  }
+
+  uint8_t* out = pOut_buf_next;
+  if (r->pending && outSize > 0) {
+    *out++ = r->pendingByte;
+    outSize--;
+    r->pending = false;
+  }
+  if (r->ended) {
+    *pOut_buf_size = out - pOut_buf_next;
+    return r->pending ? TINFL_STATUS_HAS_MORE_OUTPUT : TINFL_STATUS_DONE;
+  }
+
+  r->stream.next_in = (Bytef*)pIn_buf_next;
+  r->stream.avail_in = (uInt)inSize;
+  r->stream.next_out = out;
+  r->stream.avail_out = (uInt)outSize;
+  int result = outSize > 0 ? inflate(&r->stream, Z_NO_FLUSH) : Z_OK;
+  out = r->stream.next_out;
+
+  // tinfl knows whether output is left over when the buffer fills, zlib only finds out by inflating one more byte
+  if (result == Z_OK && r->stream.avail_out == 0 && !r->pending) {
+    r->stream.next_out = &r->pendingByte;
+    r->stream.avail_out = 1;
+    result = inflate(&r->stream, Z_NO_FLUSH);
+    r->pending = r->stream.avail_out == 0;
+  }
+
+  *pIn_buf_size = inSize - r->stream.avail_in;
+  *pOut_buf_size = out - pOut_buf_next;
+
+  if (result == Z_STREAM_END) {
+    r->ended = true;
+    endStream(r);
+    return r->pending ? TINFL_STATUS_HAS_MORE_OUTPUT : TINFL_STATUS_DONE;
+  }
+  if (result != Z_OK && result != Z_BUF_ERROR) return fail(r, TINFL_STATUS_FAILED);
+  if (r->pending) return TINFL_STATUS_HAS_MORE_OUTPUT;
+  if (!(decomp_flags & TINFL_FLAG_HAS_MORE_INPUT)) return fail(r, TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS);
+  return TINFL_STATUS_NEEDS_MORE_INPUT;
+}
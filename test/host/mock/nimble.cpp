@@ -0,0 +1,551 @@
+#include "NimBLEDevice.h"
+#include "host.h"
+#include <map>
+#include <mutex>
+#include <vector>
+
+struct Connection {
+  ble_gap_conn_desc desc;
+  uint8_t txPhy;
+  uint8_t rxPhy;
+};
+
+static std::mutex gapMutex;
+static std::map<uint16_t, Connection> connections;
+static ble_gap_event_listener* listeners = nullptr;
+
+// Listeners run on the host task in NimBLE, and may look the connection up, so the lock is not held
+static void dispatchGapEvent(ble_gap_event* event) {
+  for (ble_gap_event_listener* listener = listeners; listener; listener = listener->next) {
+    listener->fn(event, listener->arg);
+  }
+}
+
+void host_connect(uint16_t connHandle, uint16_t interval, uint16_t latency) {
+  std::lock_guard<std::mutex> lock(gapMutex);
+  connections[connHandle] = { { connHandle, interval, latency, 400 }, 1, 1 };
+}
+
+static void closeL2capChannels(uint16_t connHandle);
+
+void host_disconnect(uint16_t connHandle) {
+  ble_gap_event event = {};
+  {
+    std::lock_guard<std::mutex> lock(gapMutex);
+    auto connection = connections.find(connHandle);
+    if (connection == connections.end()) return;
+    event.type = BLE_GAP_EVENT_DISCONNECT;
+    event.disconnect.reason = 0x213; // Remote user terminated the connection
+    event.disconnect.conn = connection->second.desc;
+    connections.erase(connection);
+  }
+
+  // NimBLE closes the L2CAP channels of the connection before telling the listeners
+  closeL2capChannels(connHandle);
+  dispatchGapEvent(&event);
+}
+
+int ble_gap_event_listener_register(ble_gap_event_listener* listener, ble_gap_event_fn* fn, void* arg) {
+  std::lock_guard<std::mutex> lock(gapMutex);
+  for (ble_gap_event_listener* registered = listeners; registered; registered = registered->next) {
+    if (registered == listener) return 2; // BLE_HS_EALREADY
+  }
+  listener->fn = fn;
+  listener->arg = arg;
+  listener->next = listeners;
+  listeners = listener;
+  return 0;
+}
+
+int ble_gap_conn_find(uint16_t handle, ble_gap_conn_desc* out_desc) {
+  std::lock_guard<std::mutex> lock(gapMutex);
+  auto connection = connections.find(handle);
+  if (connection == connections.end()) return BLE_HS_ENOTCONN;
+  if (out_desc) *out_desc = connection->second.desc;
+  return 0;
+}
+
+int ble_gap_read_le_phy(uint16_t conn_handle, uint8_t* tx_phy, uint8_t* rx_phy) {
+  std::lock_guard<std::mutex> lock(gapMutex);
+  auto connection = connections.find(conn_handle);
+  if (connection == connections.end()) return BLE_HS_ENOTCONN;
+  *tx_phy = connection->second.txPhy;
+  *rx_phy = connection->second.rxPhy;
+  return 0;
+}
+
+static uint8_t preferredPhy(uint8_t mask, uint8_t current) {
+  if (mask & BLE_GAP_LE_PHY_2M_MASK) return 2;
+  if (mask & BLE_GAP_LE_PHY_1M_MASK) return 1;
+  if (mask & BLE_GAP_LE_PHY_CODED_MASK) return 3;
+  return current;
+}
+
+// The client is taken to accept whatever is asked of it
+int ble_gap_set_prefered_le_phy(uint16_t conn_handle, uint8_t tx_phys_mask, uint8_t rx_phys_mask, uint16_t phy_opts) {
+  std::lock_guard<std::mutex> lock(gapMutex);
+  auto connection = connections.find(conn_handle);
+  if (connection == connections.end()) return BLE_HS_ENOTCONN;
+  connection->second.txPhy = preferredPhy(tx_phys_mask, connection->second.txPhy);
+  connection->second.rxPhy = preferredPhy(rx_phys_mask, connection->second.rxPhy);
+  return 0;
+}
+
+// Pools are shared by the host task and the tasks notifying from the engine
+static std::mutex poolMutex;
+static os_mbuf_pool* failingPool = nullptr; //!< The next buffer asked of this pool is refused, see host_l2cap_fail_rx
+
+int os_mempool_init(os_mempool* mp, uint16_t blocks, uint32_t block_size, void* membuf, const char* name) {
+  uint32_t size = OS_MEMPOOL_SIZE(1, block_size) * sizeof(os_membuf_t);
+  mp->mp_block_size = size;
+  mp->mp_num_blocks = blocks;
+  mp->mp_num_free = blocks;
+  mp->mp_free = nullptr;
+  mp->name = name;
+  for (uint16_t i = blocks; i-- > 0;) {
+    os_memblock* block = (os_memblock*)((uint8_t*)membuf + (size_t)i * size);
+    block->next = mp->mp_free;
+    mp->mp_free = block;
+  }
+  return 0;
+}
+
+int os_mbuf_pool_init(os_mbuf_pool* omp, os_mempool* mp, uint16_t buf_len, uint16_t nbufs) {
+  if (buf_len <= sizeof(os_mbuf) + sizeof(os_mbuf_pkthdr)) return BLE_HS_EINVAL;
+  omp->omp_databuf_len = buf_len - sizeof(os_mbuf);
+  omp->omp_pool = mp;
+  return 0;
+}
+
+os_mbuf* os_mbuf_get(os_mbuf_pool* omp, uint16_t leadingspace) {
+  if (leadingspace > omp->omp_databuf_len) return nullptr;
+
+  os_mbuf* om;
+  {
+    std::lock_guard<std::mutex> lock(poolMutex);
+    if (omp == failingPool) {
+      failingPool = nullptr;
+      return nullptr;
+    }
+    os_memblock* block = omp->omp_pool->mp_free;
+    if (!block) return nullptr;
+    omp->omp_pool->mp_free = block->next;
+    omp->omp_pool->mp_num_free--;
+    om = (os_mbuf*)block;
+  }
+  om->om_data = om->om_databuf + leadingspace;
+  om->om_flags = 0;
+  om->om_pkthdr_len = 0;
+  om->om_len = 0;
+  om->om_omp = omp;
+  om->om_next = nullptr;
+  return om;
+}
+
+os_mbuf* os_mbuf_get_pkthdr(os_mbuf_pool* omp, uint8_t user_pkthdr_len) {
+  uint16_t pkthdrLength = sizeof(os_mbuf_pkthdr) + user_pkthdr_len;
+  os_mbuf* om = os_mbuf_get(omp, pkthdrLength);
+  if (!om) return nullptr;
+  om->om_pkthdr_len = pkthdrLength;
+  OS_MBUF_PKTHDR(om)->omp_len = 0;
+  OS_MBUF_PKTHDR(om)->omp_flags = 0;
+  return om;
+}
+
+static uint16_t trailingSpace(const os_mbuf* om) {
+  return om->om_omp->omp_databuf_len - (om->om_data - om->om_databuf) - om->om_len;
+}
+
+int os_mbuf_append(os_mbuf* om, const void* data, uint16_t len) {
+  const uint8_t* source = (const uint8_t*)data;
+  os_mbuf* last = om;
+  while (last->om_next) last = last->om_next;
+
+  // Appended data spills over into new buffers of the chain's pool
+  uint16_t remaining = len;
+  while (remaining) {
+    uint16_t space = trailingSpace(last);
+    if (!space) {
+      os_mbuf* next = os_mbuf_get(om->om_omp, 0);
+      if (!next) return BLE_HS_ENOMEM;
+      last->om_next = next;
+      last = next;
+      continue;
+    }
+    uint16_t copied = remaining < space ? remaining : space;
+    memcpy(last->om_data + last->om_len, source, copied);
+    last->om_len += copied;
+    source += copied;
+    remaining -= copied;
+    if (om->om_pkthdr_len) OS_MBUF_PKTLEN(om) += copied;
+  }
+  return 0;
+}
+
+int os_mbuf_copydata(const os_mbuf* om, int off, int len, void* dst) {
+  uint8_t* destination = (uint8_t*)dst;
+  for (; om && len > 0; om = om->om_next) {
+    if (off >= om->om_len) {
+      off -= om->om_len;
+      continue;
+    }
+    int copied = om->om_len - off < len ? om->om_len - off : len;
+    memcpy(destination, om->om_data + off, copied);
+    destination += copied;
+    len -= copied;
+    off = 0;
+  }
+  return len > 0 ? -1 : 0;
+}
+
+int os_mbuf_free_chain(os_mbuf* om) {
+  std::lock_guard<std::mutex> lock(poolMutex);
+  while (om) {
+    os_mbuf* next = om->om_next;
+    os_mempool* pool = om->om_omp->omp_pool;
+    os_memblock* block = (os_memblock*)om;
+    block->next = pool->mp_free;
+    pool->mp_free = block;
+    pool->mp_num_free++;
+    om = next;
+  }
+  return 0;
+}
+
+// The host's own pool, sized like the default msys pool of NimBLE on the ESP32
+#define MSYS_BLOCK_COUNT 24
+#define MSYS_BLOCK_SIZE  (256 + sizeof(os_mbuf))
+
+static os_membuf_t msysMemory[OS_MEMPOOL_SIZE(MSYS_BLOCK_COUNT, MSYS_BLOCK_SIZE)];
+static os_mempool msysPool;
+static os_mbuf_pool msys;
+static std::once_flag msysInitialized;
+
+static os_mbuf_pool* msysMbufPool() {
+  std::call_once(msysInitialized, [] {
+    os_mempool_init(&msysPool, MSYS_BLOCK_COUNT, MSYS_BLOCK_SIZE, msysMemory, "msys");
+    os_mbuf_pool_init(&msys, &msysPool, MSYS_BLOCK_SIZE, MSYS_BLOCK_COUNT);
+  });
+  return &msys;
+}
+
+os_mbuf* ble_hs_mbuf_from_flat(const void* buf, uint16_t len) {
+  os_mbuf* om = os_mbuf_get_pkthdr(msysMbufPool(), 0);
+  if (!om) return nullptr;
+  if (os_mbuf_append(om, buf, len) != 0) {
+    os_mbuf_free_chain(om);
+    return nullptr;
+  }
+  return om;
+}
+
+struct L2capServer {
+  uint16_t psm;
+  uint16_t mtu;
+  ble_l2cap_event_fn* cb;
+  void* arg;
+};
+
+struct ble_l2cap_chan {
+  uint16_t connHandle;
+  const L2capServer* server;
+  os_mbuf* rx; //!< Handed over by the server with ble_l2cap_recv_ready, nullptr until it is
+  bool connected;
+};
+
+static std::mutex l2capMutex;
+static std::vector<L2capServer> l2capServers;
+static std::vector<ble_l2cap_chan*> l2capChannels;
+
+int ble_l2cap_create_server(uint16_t psm, uint16_t mtu, ble_l2cap_event_fn* cb, void* cb_arg) {
+  std::lock_guard<std::mutex> lock(l2capMutex);
+  for (const L2capServer& server : l2capServers) {
+    if (server.psm == psm) return BLE_HS_EALREADY;
+  }
+  l2capServers.push_back({ psm, mtu, cb, cb_arg });
+  return 0;
+}
+
+int ble_l2cap_recv_ready(ble_l2cap_chan* chan, os_mbuf* sdu_rx) {
+  if (!sdu_rx) return BLE_HS_EINVAL;
+  chan->rx = sdu_rx;
+  return 0;
+}
+
+// Events run on the host task in NimBLE, the server callback may call back into L2CAP, so no lock is held
+static int l2capEvent(ble_l2cap_chan* chan, ble_l2cap_event& event) {
+  return chan->server->cb(&event, chan->server->arg);
+}
+
+int ble_l2cap_disconnect(ble_l2cap_chan* chan) {
+  if (!chan->connected) return BLE_HS_ENOTCONN;
+  chan->connected = false;
+  if (chan->rx) os_mbuf_free_chain(chan->rx);
+  chan->rx = nullptr;
+
+  ble_l2cap_event event = {};
+  event.type = BLE_L2CAP_EVENT_COC_DISCONNECTED;
+  event.disconnect.conn_handle = chan->connHandle;
+  event.disconnect.chan = chan;
+  l2capEvent(chan, event);
+  return 0;
+}
+
+static void closeL2capChannels(uint16_t connHandle) {
+  std::vector<ble_l2cap_chan*> closed;
+  {
+    std::lock_guard<std::mutex> lock(l2capMutex);
+    for (ble_l2cap_chan* chan : l2capChannels) {
+      if (chan->connHandle == connHandle && chan->connected) closed.push_back(chan);
+    }
+  }
+  for (ble_l2cap_chan* chan : closed) ble_l2cap_disconnect(chan);
+}
+
+ble_l2cap_chan* host_l2cap_connect(uint16_t connHandle, uint16_t psm) {
+  if (ble_gap_conn_find(connHandle, nullptr) != 0) return nullptr;
+
+  ble_l2cap_chan* chan = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(l2capMutex);
+    for (const L2capServer& server : l2capServers) {
+      if (server.psm == psm) chan = new ble_l2cap_chan{ connHandle, &server, nullptr, false };
+    }
+    if (!chan) return nullptr;
+    l2capChannels.push_back(chan);
+  }
+
+  ble_l2cap_event event = {};
+  event.type = BLE_L2CAP_EVENT_COC_ACCEPT;
+  event.accept.conn_handle = connHandle;
+  event.accept.peer_sdu_size = chan->server->mtu;
+  event.accept.chan = chan;
+  // A server that refuses the channel, or accepts it without a receive buffer, has NimBLE turn the client down
+  if (l2capEvent(chan, event) != 0 || !chan->rx) {
+    if (chan->rx) os_mbuf_free_chain(chan->rx);
+    chan->rx = nullptr;
+    return nullptr;
+  }
+
+  chan->connected = true;
+  event = {};
+  event.type = BLE_L2CAP_EVENT_COC_CONNECTED;
+  event.connect.conn_handle = connHandle;
+  event.connect.chan = chan;
+  l2capEvent(chan, event);
+  return chan;
+}
+
+void host_l2cap_fail_rx(ble_l2cap_chan* chan) {
+  std::lock_guard<std::mutex> lock(poolMutex);
+  failingPool = chan->rx ? chan->rx->om_omp : nullptr;
+}
+
+int host_l2cap_send(ble_l2cap_chan* chan, const uint8_t* data, size_t length) {
+  if (!chan->connected) return BLE_HS_ENOTCONN;
+  if (length > chan->server->mtu) return BLE_HS_EINVAL;
+  // Without a receive buffer NimBLE grants the client no credits, so the SDU waits on the client
+  if (!chan->rx) return BLE_HS_EBUSY;
+
+  // Received into the buffer the server provided, chained across further buffers of its pool when it does not fit
+  os_mbuf* sdu = chan->rx;
+  chan->rx = nullptr;
+  if (os_mbuf_append(sdu, data, length) != 0) {
+    os_mbuf_free_chain(sdu);
+    ble_l2cap_disconnect(chan);
+    return BLE_HS_ENOMEM;
+  }
+
+  ble_l2cap_event event = {};
+  event.type = BLE_L2CAP_EVENT_COC_DATA_RECEIVED;
+  event.receive.conn_handle = chan->connHandle;
+  event.receive.chan = chan;
+  event.receive.sdu_rx = sdu;
+  l2capEvent(chan, event);
+  return 0;
+}
+
+NimBLEUUID::NimBLEUUID(const char* uuid) : _string(uuid) {
+  // Only 128 bit UUIDs are written in full, their 16 bytes are kept in the order they are written
+  _uuid.u.type = BLE_UUID_TYPE_128;
+  size_t byte = 0;
+  for (const char* digit = uuid; *digit && byte < 32; digit++) {
+    if (*digit == '-') continue;
+    uint8_t value = *digit <= '9' ? *digit - '0' : (*digit | 0x20) - 'a' + 10;
+    _uuid.u128.value[byte / 2] |= (byte % 2) ? value : value << 4;
+    byte++;
+  }
+}
+
+int ble_uuid_cmp(const ble_uuid_t* uuid1, const ble_uuid_t* uuid2) {
+  if (uuid1->type != uuid2->type) return uuid1->type - uuid2->type;
+  return memcmp(((const ble_uuid128_t*)uuid1)->value, ((const ble_uuid128_t*)uuid2)->value, 16);
+}
+
+struct Characteristic {
+  const ble_gatt_chr_def* def;
+  uint16_t valueHandle;
+  std::vector<std::vector<uint8_t>> notifications;
+};
+
+static std::mutex gattMutex;
+static std::vector<const ble_gatt_svc_def*> services;
+static uint32_t reservedAttributes = 0;
+static bool gattStarted = false;
+static std::vector<Characteristic> characteristics;
+
+// A service declaration, and per characteristic its declaration, value and client configuration if it notifies
+static uint32_t attributeCount(const ble_gatt_svc_def* defs) {
+  uint32_t attributes = 0;
+  for (const ble_gatt_svc_def* service = defs; service->type != BLE_GATT_SVC_TYPE_END; service++) {
+    attributes++;
+    for (const ble_gatt_chr_def* chr = service->characteristics; chr && chr->uuid; chr++) {
+      attributes += (chr->flags & BLE_GATT_CHR_F_NOTIFY) ? 3 : 2;
+    }
+  }
+  return attributes;
+}
+
+int ble_gatts_count_cfg(const ble_gatt_svc_def* defs) {
+  std::lock_guard<std::mutex> lock(gattMutex);
+  reservedAttributes += attributeCount(defs);
+  return 0;
+}
+
+int ble_gatts_add_svcs(const ble_gatt_svc_def* svcs) {
+  std::lock_guard<std::mutex> lock(gattMutex);
+  if (gattStarted) return BLE_HS_EBUSY;
+  services.push_back(svcs);
+  return 0;
+}
+
+int ble_gatts_start() {
+  std::lock_guard<std::mutex> lock(gattMutex);
+  if (gattStarted) return BLE_HS_EBUSY;
+
+  uint32_t needed = 0;
+  for (const ble_gatt_svc_def* defs : services) needed += attributeCount(defs);
+  if (needed > reservedAttributes) return BLE_HS_ENOMEM;
+
+  uint16_t handle = 1;
+  for (const ble_gatt_svc_def* defs : services) {
+    for (const ble_gatt_svc_def* service = defs; service->type != BLE_GATT_SVC_TYPE_END; service++) {
+      handle++;
+      for (const ble_gatt_chr_def* chr = service->characteristics; chr && chr->uuid; chr++) {
+        uint16_t valueHandle = handle + 1;
+        if (chr->val_handle) *chr->val_handle = valueHandle;
+        characteristics.push_back({ chr, valueHandle, {} });
+        handle += (chr->flags & BLE_GATT_CHR_F_NOTIFY) ? 3 : 2;
+      }
+    }
+  }
+  gattStarted = true;
+  return 0;
+}
+
+static Characteristic* findCharacteristic(uint16_t handle) {
+  for (Characteristic& characteristic : characteristics) {
+    if (characteristic.valueHandle == handle) return &characteristic;
+  }
+  return nullptr;
+}
+
+// NimBLE builds notifications in mbufs from its own pools, so recording them is not counted as a heap allocation
+int ble_gattc_notify_custom(uint16_t conn_handle, uint16_t att_handle, os_mbuf* om) {
+  int rc = ble_gap_conn_find(conn_handle, nullptr);
+  if (rc == 0) {
+    std::lock_guard<std::mutex> lock(gattMutex);
+    Characteristic* characteristic = findCharacteristic(att_handle);
+    if (characteristic) {
+      host_heap_untracked(true);
+      std::vector<uint8_t> value(OS_MBUF_PKTLEN(om));
+      os_mbuf_copydata(om, 0, value.size(), value.data());
+      characteristic->notifications.push_back(std::move(value));
+      host_heap_untracked(false);
+    }
+    else {
+      rc = BLE_HS_EINVAL;
+    }
+  }
+  os_mbuf_free_chain(om);
+  return rc;
+}
+
+uint16_t host_find_characteristic(const char* uuid) {
+  NimBLEUUID wanted(uuid);
+  std::lock_guard<std::mutex> lock(gattMutex);
+  for (Characteristic& characteristic : characteristics) {
+    if (ble_uuid_cmp(characteristic.def->uuid, &wanted.getNative()->u) == 0) return characteristic.valueHandle;
+  }
+  return 0;
+}
+
+// Access callbacks run on the host task in NimBLE, and may notify, so the lock is not held while they run
+static int access(uint16_t handle, uint16_t connHandle, uint8_t op, os_mbuf* om) {
+  const ble_gatt_chr_def* def;
+  {
+    std::lock_guard<std::mutex> lock(gattMutex);
+    Characteristic* characteristic = findCharacteristic(handle);
+    if (!characteristic) return BLE_HS_EINVAL;
+    def = characteristic->def;
+  }
+  ble_gatt_access_ctxt ctxt = { op, om, def };
+  return def->access_cb(connHandle, handle, &ctxt, def->arg);
+}
+
+int host_write(uint16_t handle, uint16_t connHandle, const uint8_t* data, size_t length) {
+  // Received writes are reassembled in mbufs of the host's pool, chained when they do not fit one buffer
+  os_mbuf* om = ble_hs_mbuf_from_flat(data, length);
+  if (!om) return BLE_HS_ENOMEM;
+  int rc = access(handle, connHandle, BLE_GATT_ACCESS_OP_WRITE_CHR, om);
+  os_mbuf_free_chain(om);
+  return rc;
+}
+
+std::vector<uint8_t> host_read(uint16_t handle, uint16_t connHandle) {
+  std::vector<uint8_t> value;
+  os_mbuf* om = os_mbuf_get_pkthdr(msysMbufPool(), 0);
+  if (!om) return value;
+  if (access(handle, connHandle, BLE_GATT_ACCESS_OP_READ_CHR, om) == 0) {
+    value.resize(OS_MBUF_PKTLEN(om));
+    os_mbuf_copydata(om, 0, value.size(), value.data());
+  }
+  os_mbuf_free_chain(om);
+  return value;
+}
+
+void host_subscribe(uint16_t connHandle, uint16_t handle, bool notify) {
+  ble_gap_event event = {};
+  event.type = BLE_GAP_EVENT_SUBSCRIBE;
+  event.subscribe.conn_handle = connHandle;
+  event.subscribe.attr_handle = handle;
+  event.subscribe.cur_notify = notify;
+  dispatchGapEvent(&event);
+}
+
+std::vector<std::vector<uint8_t>> host_take_notifications(uint16_t handle) {
+  std::lock_guard<std::mutex> lock(gattMutex);
+  std::vector<std::vector<uint8_t>> notifications;
+  Characteristic* characteristic = findCharacteristic(handle);
+  if (characteristic) notifications.swap(characteristic->notifications);
+  return notifications;
+}
+
+void NimBLEServer::start() {
+  if (ble_gatts_start() != 0) log_e("GATT server failed to start");
+}
+
+void NimBLEServer::setDataLen(uint16_t conn_handle, uint16_t tx_octets) {}
+
+void NimBLEServer::updateConnParams(uint16_t conn_handle, uint16_t minInterval, uint16_t maxInterval, uint16_t latency,
+                                    uint16_t timeout) {
+  std::lock_guard<std::mutex> lock(gapMutex);
+  auto connection = connections.find(conn_handle);
+  if (connection == connections.end()) return;
+  connection->second.desc.conn_itvl = maxInterval;
+  connection->second.desc.conn_latency = latency;
+}
+
+NimBLEServer* NimBLEDevice::createServer() {
+  return new NimBLEServer();
+}
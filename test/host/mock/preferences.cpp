@@ -0,0 +1,68 @@
+#include "Preferences.h"
+#include "host.h"
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define NVS_KEY_NAME_MAX_SIZE 16 //!< Including the terminator, longer keys are rejected like on the device
+
+typedef std::map<std::string, std::vector<uint8_t>> Namespace;
+
+static std::mutex nvsMutex;
+static std::map<std::string, Namespace> nvs;
+
+void host_nvs_clear() {
+  std::lock_guard<std::mutex> lock(nvsMutex);
+  nvs.clear();
+}
+
+static bool validKey(const char* key) {
+  return key && key[0] != '\0' && strlen(key) < NVS_KEY_NAME_MAX_SIZE;
+}
+
+bool Preferences::begin(const char* name, bool readOnly) {
+  if (_started || !validKey(name)) return false;
+  snprintf(_namespace, sizeof(_namespace), "%s", name);
+  _readOnly = readOnly;
+  _started = true;
+  return true;
+}
+
+void Preferences::end() {
+  _started = false;
+}
+
+size_t Preferences::getBytes(const char* key, void* buffer, size_t length) {
+  if (!_started || !validKey(key)) return 0;
+  std::lock_guard<std::mutex> lock(nvsMutex);
+
+  Namespace& values = nvs[_namespace];
+  auto value = values.find(key);
+  if (value == values.end() || value->second.size() > length) return 0;
+  memcpy(buffer, value->second.data(), value->second.size());
+  return value->second.size();
+}
+
+size_t Preferences::putBytes(const char* key, const void* value, size_t length) {
+  if (!_started || _readOnly || !validKey(key)) return 0;
+  std::lock_guard<std::mutex> lock(nvsMutex);
+
+  const uint8_t* bytes = (const uint8_t*)value;
+  nvs[_namespace][key].assign(bytes, bytes + length);
+  return length;
+}
+
+bool Preferences::isKey(const char* key) {
+  if (!_started || !validKey(key)) return false;
+  std::lock_guard<std::mutex> lock(nvsMutex);
+
+  Namespace& values = nvs[_namespace];
+  return values.find(key) != values.end();
+}
+
+bool Preferences::remove(const char* key) {
+  if (!_started || _readOnly || !validKey(key)) return false;
+  std::lock_guard<std::mutex> lock(nvsMutex);
+  return nvs[_namespace].erase(key) > 0;
+}
@@ -0,0 +1,43 @@
+#ifndef FASTBLEOTA_HOST_MINIZ_H
+#define FASTBLEOTA_HOST_MINIZ_H
+
+// The ROM's tinfl, carried out with zlib's inflate. Statuses follow tinfl, so the engine drives both the same way
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#define TINFL_LZ_DICT_SIZE 32768
+
+#define TINFL_FLAG_PARSE_ZLIB_HEADER 1
+#define TINFL_FLAG_HAS_MORE_INPUT    2
+
+typedef enum {
+  TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS = -4,
+  TINFL_STATUS_BAD_PARAM = -3,
+  TINFL_STATUS_ADLER32_MISMATCH = -2,
+  TINFL_STATUS_FAILED = -1,
+  TINFL_STATUS_DONE = 0,
+  TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+  TINFL_STATUS_HAS_MORE_OUTPUT = 2
+} tinfl_status;
+
+typedef struct {
+  uint32_t magic;  //!< Together with self, tells a stream to end from memory that was never initialized
+  const void* self;
+  bool started;    //!< inflateInit ran, deferred to the first call since only it knows the flags
+  bool ended;
+  bool pending;    //!< pendingByte was inflated to tell whether more output follows, and is due first
+  uint8_t pendingByte;
+  z_stream stream;
+} tinfl_decompressor;
+
+void host_tinfl_init(tinfl_decompressor* r);
+
+#define tinfl_init(r) host_tinfl_init(r)
+
+tinfl_status tinfl_decompress(tinfl_decompressor* r, const uint8_t* pIn_buf_next, size_t* pIn_buf_size,
+                              uint8_t* pOut_buf_start, uint8_t* pOut_buf_next, size_t* pOut_buf_size,
+                              const uint32_t decomp_flags);
+
+#endif
@@ -0,0 +1,85 @@
+#include "esp_timer.h"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+struct esp_timer {
+  esp_timer_cb_t callback;
+  void* arg;
+  bool armed;
+  Clock::time_point deadline;
+};
+
+// One task runs every callback, like the esp_timer task, so callbacks never run concurrently with each other.
+// Never destroyed, the task is still waiting on them when the process exits
+static std::mutex& timerMutex = *new std::mutex();
+static std::condition_variable& timersChanged = *new std::condition_variable();
+static std::vector<esp_timer*>& timers = *new std::vector<esp_timer*>();
+static bool timerTaskStarted = false;
+
+static void timerTask() {
+  std::unique_lock<std::mutex> lock(timerMutex);
+  for (;;) {
+    esp_timer* due = nullptr;
+    Clock::time_point next = Clock::time_point::max();
+    for (esp_timer* timer : timers) {
+      if (!timer->armed) continue;
+      if (timer->deadline <= Clock::now()) {
+        due = timer;
+        break;
+      }
+      if (timer->deadline < next) next = timer->deadline;
+    }
+
+    if (due) {
+      due->armed = false;
+      lock.unlock();
+      due->callback(due->arg);
+      lock.lock();
+    }
+    else if (next == Clock::time_point::max()) {
+      timersChanged.wait(lock);
+    }
+    else {
+      timersChanged.wait_until(lock, next);
+    }
+  }
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* handle) {
+  std::lock_guard<std::mutex> lock(timerMutex);
+  if (!timerTaskStarted) {
+    std::thread(timerTask).detach();
+    timerTaskStarted = true;
+  }
+
+  esp_timer* timer = new esp_timer{ args->callback, args->arg, false, {} };
+  timers.push_back(timer);
+  *handle = timer;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeoutUs) {
+  std::lock_guard<std::mutex> lock(timerMutex);
+  if (timer->armed) return ESP_ERR_INVALID_STATE;
+  timer->armed = true;
+  timer->deadline = Clock::now() + std::chrono::microseconds(timeoutUs);
+  timersChanged.notify_all();
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+  std::lock_guard<std::mutex> lock(timerMutex);
+  if (!timer->armed) return ESP_ERR_INVALID_STATE;
+  timer->armed = false;
+  timersChanged.notify_all();
+  return ESP_OK;
+}
+
+int64_t esp_timer_get_time() {
+  return (int64_t)micros();
+}
@@ -0,0 +1,186 @@
+#include "stream.h"
+#include <esp_image_format.h>
+#include <esp_ota_ops.h>
+#include <mbedtls/sha256.h>
+#include <zlib.h>
+
+static uint32_t nextRandom(uint32_t& state) {
+  state = state * 1664525 + 1013904223;
+  return state >> 8;
+}
+
+bytes_t make_image(size_t size, uint32_t seed, const char* project, const char* version) {
+  bytes_t image(size);
+  uint32_t state = seed;
+
+  // Instructions repeat from a small vocabulary, which is what makes firmware compressible
+  uint32_t words[256];
+  for (uint32_t& word : words) word = nextRandom(state) ^ nextRandom(state) << 16;
+
+  size_t offset = FASTBLEOTA_IMAGE_HEAD_SIZE;
+  while (offset < size) {
+    size_t run = (nextRandom(state) % 4 == 0) ? 64 + nextRandom(state) % 2048 : 0;
+    size_t code = 1024 + nextRandom(state) % 16384;
+
+    for (size_t end = offset + code; offset < end && offset < size; offset += 4) {
+      // Opcodes repeat, their operands mostly do not
+      uint32_t word = words[nextRandom(state) % 256];
+      if (nextRandom(state) % 3 == 0) word = (word & 0xFFFFFF00) | (nextRandom(state) & 0xFF);
+      for (size_t i = 0; i < 4 && offset + i < size; i++) image[offset + i] = (uint8_t)(word >> (i * 8));
+    }
+    for (size_t end = offset + run; offset < end && offset < size; offset++) image[offset] = 0xFF;
+  }
+
+  esp_image_header_t header = {};
+  header.magic = ESP_IMAGE_HEADER_MAGIC;
+  header.segment_count = 1;
+  header.spi_size = ESP_IMAGE_FLASH_SIZE_4MB;
+  header.entry_addr = 0x40080000;
+  header.chip_id = CONFIG_IDF_FIRMWARE_CHIP_ID;
+
+  esp_image_segment_header_t segment = { 0x3F400020, (uint32_t)(size - sizeof(header) - sizeof(segment)) };
+
+  esp_app_desc_t app = {};
+  app.magic_word = ESP_APP_DESC_MAGIC_WORD;
+  snprintf(app.version, sizeof(app.version), "%s", version);
+  snprintf(app.project_name, sizeof(app.project_name), "%s", project);
+
+  memcpy(image.data(), &header, sizeof(header));
+  memcpy(image.data() + sizeof(header), &segment, sizeof(segment));
+  memcpy(image.data() + sizeof(header) + sizeof(segment), &app, sizeof(app));
+  return image;
+}
+
+bytes_t modify_image(const bytes_t& image, uint32_t seed) {
+  bytes_t modified = image;
+  uint32_t state = seed;
+  for (int edit = 0; edit < 32; edit++) {
+    size_t offset = FASTBLEOTA_IMAGE_HEAD_SIZE + nextRandom(state) % (image.size() - FASTBLEOTA_IMAGE_HEAD_SIZE);
+    size_t length = 1 + nextRandom(state) % 64;
+    for (size_t i = offset; i < offset + length && i < modified.size(); i++) modified[i] = (uint8_t)nextRandom(state);
+  }
+  return modified;
+}
+
+bytes_t sha256(const bytes_t& data) {
+  bytes_t digest(32);
+  mbedtls_sha256_context context;
+  mbedtls_sha256_init(&context);
+  mbedtls_sha256_starts(&context, 0);
+  mbedtls_sha256_update(&context, data.data(), data.size());
+  mbedtls_sha256_finish(&context, digest.data());
+  mbedtls_sha256_free(&context);
+  return digest;
+}
+
+bytes_t legacy_size(const bytes_t& image) {
+  uint32_t size = image.size();
+  return bytes_t((const uint8_t*)&size, (const uint8_t*)&size + sizeof(size));
+}
+
+bytes_t make_header(const bytes_t& image, size_t streamSize, const session_options_t& options) {
+  return make_header(image, streamSize, options.digest ? sha256(image) : bytes_t(32), options);
+}
+
+bytes_t make_header(const bytes_t& image, size_t streamSize, const bytes_t& digest, const session_options_t& options) {
+  fastbleota_header_t header = {};
+  header.magic = FASTBLEOTA_HEADER_MAGIC;
+  header.version = FASTBLEOTA_HEADER_VERSION;
+  header.headerSize = sizeof(header);
+  header.compression = options.compression;
+  header.encoding = options.encoding;
+  header.imageSize = image.size();
+  header.streamSize = streamSize;
+  header.flags = options.flags;
+  header.target = options.target;
+  header.windowSize = options.windowSize;
+  memcpy(header.sha256, digest.data(), sizeof(header.sha256));
+  return bytes_t((const uint8_t*)&header, (const uint8_t*)&header + sizeof(header));
+}
+
+bytes_t make_query(const bytes_t& image) {
+  fastbleota_query_t query = {};
+  query.magic = FASTBLEOTA_QUERY_MAGIC;
+  // The version field of esp_app_desc_t, 16 bytes into it
+  memcpy(query.version, image.data() + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + 16,
+         sizeof(query.version));
+  bytes_t digest = sha256(image);
+  memcpy(query.sha256, digest.data(), sizeof(query.sha256));
+  return bytes_t((const uint8_t*)&query, (const uint8_t*)&query + sizeof(query));
+}
+
+bytes_t deflate(const bytes_t& data) {
+  uLongf size = compressBound(data.size());
+  bytes_t compressed(size);
+  compress2(compressed.data(), &size, data.data(), data.size(), 9);
+  compressed.resize(size);
+  return compressed;
+}
+
+static void appendRecord(bytes_t& stream, uint8_t type, uint8_t value, uint32_t length) {
+  fastbleota_sparse_record_t record = { type, value, length };
+  stream.insert(stream.end(), (const uint8_t*)&record, (const uint8_t*)&record + sizeof(record));
+}
+
+bytes_t make_sparse(const bytes_t& image, size_t minRun) {
+  bytes_t stream;
+  size_t literal = 0;
+  size_t offset = 0;
+  while (offset < image.size()) {
+    size_t end = offset + 1;
+    while (end < image.size() && image[end] == image[offset]) end++;
+
+    if (end - offset < minRun) {
+      offset = end;
+      continue;
+    }
+    if (offset > literal) {
+      appendRecord(stream, FASTBLEOTA_SPARSE_LITERAL, 0, offset - literal);
+      stream.insert(stream.end(), image.begin() + literal, image.begin() + offset);
+    }
+    appendRecord(stream, FASTBLEOTA_SPARSE_FILL, image[offset], end - offset);
+    offset = end;
+    literal = end;
+  }
+  if (image.size() > literal) {
+    appendRecord(stream, FASTBLEOTA_SPARSE_LITERAL, 0, image.size() - literal);
+    stream.insert(stream.end(), image.begin() + literal, image.end());
+  }
+  return stream;
+}
+
+bytes_t make_patch(const bytes_t& from, const bytes_t& to) {
+  uint32_t overlap = from.size() < to.size() ? from.size() : to.size();
+  uint32_t extra = to.size() - overlap;
+  int32_t seek = 0;
+
+  bytes_t patch;
+  patch.insert(patch.end(), (const uint8_t*)&overlap, (const uint8_t*)&overlap + sizeof(overlap));
+  patch.insert(patch.end(), (const uint8_t*)&extra, (const uint8_t*)&extra + sizeof(extra));
+  patch.insert(patch.end(), (const uint8_t*)&seek, (const uint8_t*)&seek + sizeof(seek));
+  for (uint32_t i = 0; i < overlap; i++) patch.push_back((uint8_t)(to[i] - from[i]));
+  patch.insert(patch.end(), to.begin() + overlap, to.end());
+  return patch;
+}
+
+std::vector<bytes_t> split(const bytes_t& payload, size_t chunkSize, size_t offset) {
+  std::vector<bytes_t> chunks;
+  for (; offset < payload.size(); offset += chunkSize) {
+    size_t end = offset + chunkSize < payload.size() ? offset + chunkSize : payload.size();
+    chunks.emplace_back(payload.begin() + offset, payload.begin() + end);
+  }
+  return chunks;
+}
+
+bytes_t sequenced(uint16_t sequence, const bytes_t& chunk, bool crc) {
+  // Sized up front, growing a two byte vector trips a false -Warray-bounds in GCC 12 release builds
+  bytes_t packet;
+  packet.reserve(sizeof(sequence) + chunk.size() + (crc ? sizeof(uint32_t) : 0));
+  packet.insert(packet.end(), { uint8_t(sequence), uint8_t(sequence >> 8) });
+  packet.insert(packet.end(), chunk.begin(), chunk.end());
+  if (crc) {
+    uint32_t value = crc32(0, packet.data(), packet.size());
+    packet.insert(packet.end(), { uint8_t(value), uint8_t(value >> 8), uint8_t(value >> 16), uint8_t(value >> 24) });
+  }
+  return packet;
+}
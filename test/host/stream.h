@@ -0,0 +1,48 @@
+#ifndef FASTBLEOTA_HOST_STREAM_H
+#define FASTBLEOTA_HOST_STREAM_H
+
+// Builds the images and write streams a client sends, the same way BLE_OTA.py and its helper scripts do
+
+#include <FastBLEOTA.h>
+#include <vector>
+
+typedef std::vector<uint8_t> bytes_t;
+
+#define HOST_PROJECT_NAME "fastbleota_host"
+
+/**
+ * An app image that passes the engine's image checks, with the body firmware usually has: code that deflate
+ * shrinks by about half, and runs of 0xFF padding between segments that sparse encoding removes.
+ */
+bytes_t make_image(size_t size, uint32_t seed, const char* project = HOST_PROJECT_NAME, const char* version = "1.0.0");
+// A copy of image with a few small edits, the way a rebuilt firmware differs from the one it replaces
+bytes_t modify_image(const bytes_t& image, uint32_t seed);
+
+bytes_t sha256(const bytes_t& data);
+
+// The legacy first write, only the image size
+bytes_t legacy_size(const bytes_t& image);
+
+typedef struct {
+  uint8_t compression = FASTBLEOTA_COMPRESSION_NONE;
+  uint8_t encoding = FASTBLEOTA_ENCODING_RAW;
+  uint8_t flags = 0;
+  uint8_t target = FASTBLEOTA_TARGET_APP;
+  uint16_t windowSize = 0;
+  bool digest = true; //!< Send the image's SHA-256, otherwise leave it zeroed
+} session_options_t;
+
+bytes_t make_header(const bytes_t& image, size_t streamSize, const session_options_t& options);
+bytes_t make_header(const bytes_t& image, size_t streamSize, const bytes_t& digest, const session_options_t& options);
+bytes_t make_query(const bytes_t& image);
+
+bytes_t deflate(const bytes_t& data);
+bytes_t make_sparse(const bytes_t& image, size_t minRun = 16);
+bytes_t make_patch(const bytes_t& from, const bytes_t& to); //!< Diffs the images in place, like BLE_OTA_patch.py without bsdiff4
+
+// The payload cut into writes of chunkSize bytes
+std::vector<bytes_t> split(const bytes_t& payload, size_t chunkSize, size_t offset = 0);
+// A sequenced write, optionally followed by the CRC-32 of the sequence number and data
+bytes_t sequenced(uint16_t sequence, const bytes_t& chunk, bool crc);
+
+#endif
@@ -0,0 +1,758 @@
+// Drives the engine through whole sessions against the host stand-ins, once per flash sink it is built with
+
+#include "stream.h"
+#include <host.h>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+
+#define TEST_IMAGE_SIZE 150000 //!< Past FASTBLEOTA_RESUME_SAVE_INTERVAL, so a resumable transfer saves its offset
+#define TEST_CHUNK_SIZE 244
+#define TEST_CONN       1
+
+#define OTA_CHARACTERISTIC_UUID   "513fcda9-f46d-4e41-ac4f-42b768495a85"
+#define OTHER_CHARACTERISTIC_UUID "513fcda9-f46d-4e41-ac4f-42b768495a86"
+
+static int failures = 0;
+
+#define CHECK(condition)                                                                  \
+  do {                                                                                    \
+    if (!(condition)) {                                                                   \
+      fprintf(stderr, "  %s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition);     \
+      failures++;                                                                         \
+    }                                                                                     \
+  } while (0)
+
+#define CHECK_EQ(actual, expected)                                                        \
+  do {                                                                                    \
+    long long a_ = (long long)(actual), e_ = (long long)(expected);                      \
+    if (a_ != e_) {                                                                       \
+      fprintf(stderr, "  %s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, a_, e_); \
+      failures++;                                                                         \
+    }                                                                                     \
+  } while (0)
+
+class Recorder : public FastBLEOTACallbacks {
+  public:
+    void onOTAStart(size_t expectedSize) override { starts++; }
+    void onOTAProgress(size_t receivedSize, size_t expectedSize) override {
+      progress++;
+      lastProgress = receivedSize;
+      if (allocating) {
+        void* volatile block = malloc(16);
+        free(block);
+        allocations++;
+      }
+    }
+    void onOTAComplete() override { completes++; }
+    void onOTAError(fastbleota_error_t errorCode) override {
+      errors++;
+      lastError = errorCode;
+    }
+
+    void clear() {
+      starts = progress = completes = errors = 0;
+      lastProgress = 0;
+      allocating = false;
+      allocations = 0;
+      lastError = FASTBLEOTA_ERROR_NONE;
+    }
+
+    volatile int starts = 0;
+    volatile int progress = 0;
+    volatile size_t lastProgress = 0;
+    volatile int completes = 0;
+    volatile int errors = 0;
+    volatile fastbleota_error_t lastError = FASTBLEOTA_ERROR_NONE;
+    bool allocating = false; //!< Allocate in onOTAProgress, which runs while the chunk is ingested
+    volatile int allocations = 0;
+};
+
+// Engines live for the whole run like they do on the device, their tasks, timer and gap listener are never torn down
+static NimBLEServer* server;
+static FastBLEOTAEngine* engine;
+static FastBLEOTAEngine* other;
+static FastBLEOTAEngine* threaded;
+static FastBLEOTAEngine* looped;
+static uint16_t characteristic;
+static Recorder recorder;
+static Recorder otherRecorder;
+static bytes_t running;
+
+static void setUp() {
+  host_flash_reset();
+  host_nvs_clear();
+  running = make_image(TEST_IMAGE_SIZE, 1);
+  host_set_running_image(running);
+
+  for (FastBLEOTAEngine* target : { engine, other, threaded, looped }) target->reset();
+  recorder.clear();
+  otherRecorder.clear();
+  host_take_notifications(characteristic);
+  host_connect(TEST_CONN);
+  host_subscribe(TEST_CONN, characteristic, true);
+}
+
+// What the sink wrote, for the image just sent to target
+static bytes_t installed(size_t size, uint8_t target = FASTBLEOTA_TARGET_APP, bool resumable = false) {
+  const char* label = target == FASTBLEOTA_TARGET_FILESYSTEM ? "spiffs" : "app1";
+#if FASTBLEOTA_SINK == FASTBLEOTA_SINK_UPDATE
+  if (!resumable) {
+    return host_read_file(target == FASTBLEOTA_TARGET_FILESYSTEM ? "./update_fs.bin" : "./update_app.bin");
+  }
+#elif FASTBLEOTA_SINK == FASTBLEOTA_SINK_FILE
+  if (!resumable) {
+    return host_read_file(target == FASTBLEOTA_TARGET_FILESYSTEM ? FASTBLEOTA_SINK_FILESYSTEM_FILE_PATH
+                                                                 : FASTBLEOTA_SINK_FILE_PATH);
+  }
+#endif
+  const uint8_t* data = host_partition_data(label);
+  return bytes_t(data, data + size);
+}
+
+static void checkBooted(bool booted) {
+#if FASTBLEOTA_SINK != FASTBLEOTA_SINK_FILE
+  const char* boot = host_boot_partition();
+  CHECK(booted ? boot && strcmp(boot, "app1") == 0 : boot == nullptr);
+#endif
+}
+
+static void send(FastBLEOTAEngine* target, const bytes_t& header, const bytes_t& payload,
+                 size_t chunkSize = TEST_CHUNK_SIZE, size_t offset = 0) {
+  target->write(header.data(), header.size());
+  for (const bytes_t& chunk : split(payload, chunkSize, offset)) target->write(chunk.data(), chunk.size());
+}
+
+// Waits for a task to catch up, the writer task and the callback task work behind the writes
+static bool waitFor(std::function<bool()> done, uint32_t timeoutMs = 5000) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+  while (!done()) {
+    if (std::chrono::steady_clock::now() > deadline) return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return true;
+}
+
+static void testRaw() {
+  bytes_t image = make_image(TEST_IMAGE_SIZE, 2);
+  send(engine, make_header(image, image.size(), {}), image);
+
+  CHECK_EQ(recorder.starts, 1);
+  CHECK_EQ(recorder.completes, 1);
+  CHECK_EQ(recorder.errors, 0);
+  CHECK_EQ(recorder.lastProgress, image.size());
+  CHECK(installed(image.size()) == image);
+  checkBooted(true);
+
+  fastbleota_stats_t stats = engine->getStats();
+  CHECK_EQ(stats.state, FASTBLEOTA_STATE_COMPLETE);
+  CHECK_EQ(stats.chunksReceived, 1 + (image.size() + TEST_CHUNK_SIZE - 1) / TEST_CHUNK_SIZE);
+  CHECK_EQ(stats.flashWrites, (image.size() + FASTBLEOTA_WRITE_BLOCK_SIZE - 1) / FASTBLEOTA_WRITE_BLOCK_SIZE);
+}
+
+static void testLegacySize() {
+  bytes_t image = make_image(TEST_IMAGE_SIZE, 3);
+  send(engine, legacy_size(image), image, 509);
+
+  CHECK_EQ(recorder.completes, 1);
+  CHECK_EQ(recorder.errors, 0);
+  CHECK(installed(image.size()) == image);
+}
+
+// A newer minor version of the header is read for the fields known here, a new major version is refused
+static void testHeaderVersions() {
+  bytes_t image = make_image(TEST_IMAGE_SIZE, 28);
+  bytes_t header = make_header(image, image.size(), {});
+  bytes_t newer = header;
+  newer[offsetof(fastbleota_header_t, version)] = FASTBLEOTA_HEADER_VERSION + 1;
+  newer.insert(newer.end(), 8, 0xA5);
+  newer[offsetof(fastbleota_header_t, headerSize)] = newer.size();
+  send(engine, newer, image);
+
+  CHECK_EQ(recorder.completes, 1);
+  CHECK_EQ(recorder.errors, 0);
+  CHECK(installed(image.size()) == image);
+
+  // Fields known here may not be left out of a newer header, nor may a major version change
+  bytes_t truncated(newer.begin(), newer.begin() + offsetof(fastbleota_header_t, flags));
+  truncated[offsetof(fastbleota_header_t, headerSize)] = truncated.size();
+  bytes_t major = header;
+  major[offsetof(fastbleota_header_t, version)] = FASTBLEOTA_HEADER_VERSION + 0x10;
+  for (const bytes_t& rejected : { truncated, major }) {
+    engine->reset();
+    recorder.clear();
+    engine->write(rejected.data(), rejected.size());
+    CHECK_EQ(recorder.errors, 1);
+    CHECK_EQ(recorder.lastError, FASTBLEOTA_ERROR_INVALID_HEADER);
+    CHECK_EQ(recorder.starts, 0);
+  }
+}
+
+static void testDeflate() {
+  bytes_t image = make_image(TEST_IMAGE_SIZE, 4);
+  bytes_t compressed = deflate(image);
+  CHECK(compressed.size() < image.size());
+
+  session_options_t options;
+  options.compression = FASTBLEOTA_COMPRESSION_DEFLATE;
+  send(engine, make_header(image, compressed.size(), options), compressed);
+
+  CHECK_EQ(recorder.completes, 1);
+  CHECK_EQ(recorder.errors, 0);
+  CHECK(installed(image.size()) == image);
+}
+
+static void testTruncatedDeflate() {
+  bytes_t image = make_image(TEST_IMAGE_SIZE, 5);
+  bytes_t compressed = deflate(image);
+  compressed.resize(compressed.size() - 8);
+
+  session_options_t options;
+  options.compression = FASTBLEOTA_COMPRESSION_DEFLATE;
+  send(engine, make_header(image, compressed.size(), options), compressed);
+
+  CHECK_EQ(recorder.completes, 0);
+  CHECK_EQ(recorder.errors, 1);
+  CHECK_EQ(recorder.lastError, FASTBLEOTA_ERROR_DECOMPRESS);
+  checkBooted(false);
+}
+
+static void testSparse() {
+  bytes_t image = make_image(TEST_IMAGE_SIZE, 6);
+  // A long tail of padding, which partition writes leave erased instead of programming
+  std::fill(image.end() - 3 * FASTBLEOTA_WRITE_BLOCK_SIZE, image.end(), 0xFF);
+  bytes_t stream = make_sparse(image);
+  CHECK(stream.size() < image.size());
+
+  session_options_t options;
+  options.encoding = FASTBLEOTA_ENCODING_SPARSE;
+  send(engine, make_header(image, stream.size(), options), stream);
+
+  CHECK_EQ(recorder.completes, 1);
+  CHECK_EQ(recorder.errors, 0);
+  CHECK(installed(image.size()) == image);
+}
+
+static void testSparseDeflate() {
+  bytes_t image = make_image(TEST_IMAGE_SIZE, 7);
+  bytes_t stream = deflate(make_sparse(image));
+
+  session_options_t options;
+  options.compression = FASTBLEOTA_COMPRESSION_DEFLATE;
+  options.encoding = FASTBLEOTA_ENCODING_SPARSE;
+  send(engine, make_header(image, stream.size(), options), stream);
+
+  CHECK_EQ(recorder.completes, 1);
+  CHECK(installed(image.size()) == image);
+}
+
+static void testDelta() {
+  bytes_t image = modify_image(running, 8);
+  image.resize(image.size() + 5000, 0x5A);
+  bytes_t patch = deflate(make_patch(running, image));
+  CHECK(patch.size() < image.size() / 4);
+
+  session_options_t options;
+  options.compression = FASTBLEOTA_COMPRESSION_DEFLATE;
+  options.encoding = FASTBLEOTA_ENCODING_DELTA;
+  send(engine, make_header(image, patch.size(), options), patch);
+
+  CHECK_EQ(recorder.completes, 1);
+  CHECK_EQ(recorder.errors, 0);
+  CHECK(installed(image.size()) == image);
+}
+
+static void testHashMismatch() {
+  bytes_t image = make_image(TEST_IMAGE_SIZE, 9);
+  send(engine, make_header(image, image.size(), sha256(make_image(TEST_IMAGE_SIZE, 10)), {}), image);
+
+  CHECK_EQ(recorder.completes, 0);
+  CHECK_EQ(recorder.lastError, FASTBLEOTA_ERROR_HASH_MISMATCH);
+  checkBooted(false);
+}
+
+static void testImageChecks() {
+  bytes_t image = make_image(TEST_IMAGE_SIZE, 11, "another_project");
+  send(engine, make_header(image, image.size(), {}), image);
+  CHECK_EQ(recorder.lastError, FASTBLEOTA_ERROR_WRONG_PROJECT);
+
+  engine->reset();
+  image = make_image(TEST_IMAGE_SIZE, 11);
+  image[0] = 0x00;
+  send(engine, make_header(image, image.size(), {}), image);
+  CHECK_EQ(recorder.lastError, FASTBLEOTA_ERROR_INVALID_IMAGE);
+  checkBooted(false);
+}
+
+// A failed session drops whatever else the client sends until it is reset, instead of failing every chunk again
+static void testErrorDropsChunks() {
+  bytes_t image = make_image(TEST_IMAGE_SIZE, 12);
+  image[0] = 0x00;
+  send(engine, make_header(image, image.size(), {}), image);
+
+  CHECK_EQ(recorder.errors, 1);
+  CHECK_EQ(engine->getStats().state, FASTBLEOTA_STATE_ERROR);
+  CHECK_EQ(engine->getStats().flashWrites, 0);
+
+  // The failed session released the partition, so another engine can update it at once
+  bytes_t valid = make_image(TEST_IMAGE_SIZE, 13);
+  send(other, make_header(valid, valid.size(), {}), valid);
+  CHECK_EQ(otherRecorder.completes, 1);
+  CHECK(installed(valid.size()) == valid);
+}
+
+static void testFilesystem() {
+  bytes_t image(64 * 1024, 0xFF);
+  for (size_t i = 0; i < 8192; i++) image[i] = (uint8_t)(i * 7);
+
+  session_options_t options;
+  options.target = FASTBLEOTA_TARGET_FILESYSTEM;
+  send(engine, make_header(image, image.size(), options), image);
+
+  CHECK_EQ(recorder.completes, 1);
+  CHECK_EQ(engine->getTarget(), FASTBLEOTA_TARGET_FILESYSTEM);
+  CHECK(installed(image.size(), FASTBLEOTA_TARGET_FILESYSTEM) == image);
+  checkBooted(false);
+}
+
+// Whether a notification of type was sent, found is set to the latest one
+static bool notified(const std::vector<bytes_t>& notifications, uint8_t type, bytes_t* found = nullptr) {
+  for (auto notification = notifications.rbegin(); notification != notifications.rend(); notification++) {
+    if (!notification->empty() && (*notification)[0] == type) {
+      if (found) *found = *notification;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void write(const bytes_t& data) {
+  host_write(characteristic, TEST_CONN, data.data(), data.size());
+}
+
+static void testQuery() {
+  write(make_query(running));
+  bytes_t answer;
+  CHECK(notified(host_take_notifications(characteristic), FASTBLEOTA_NOTIFY_QUERY, &answer));
+  CHECK_EQ(answer[1], 1);
+
+  write(make_query(make_image(TEST_IMAGE_SIZE, 14)));
+  CHECK(notified(host_take_notifications(characteristic), FASTBLEOTA_NOTIFY_QUERY, &answer));
+  CHECK_EQ(answer[1], 0);
+  CHECK_EQ(recorder.starts, 0);
+}
+
+// A corrupt chunk is rejected by its CRC and the client is asked to resend from the first chunk not accepted
+static void testSequencedCrc() {
+  bytes_t image = make_image(TEST_IMAGE_SIZE, 15);
+  session_options_t options;
+  options.flags = FASTBLEOTA_FLAG_SEQUENCED | FASTBLEOTA_FLAG_CRC;
+  options.windowSize = 8;
+  write(make_header(image, image.size(), options));
+
+  std::vector<bytes_t> chunks = split(image, TEST_CHUNK_SIZE - 6);
+  for (size_t i = 0; i < chunks.size(); i++) {
+    bytes_t packet = sequenced(i, chunks[i], true);
+    if (i == 20) {
+      bytes_t corrupt = packet;
+      corrupt[10] ^= 0x01;
+      write(corrupt);
+      // Chunks in flight behind the corrupt one arrive out of order and are dropped
+      write(sequenced(i + 1, chunks[i + 1], true));
+
+      fastbleota_ack_t ack;
+      bytes_t notification;
+      CHECK(notified(host_take_notifications(characteristic), FASTBLEOTA_NOTIFY_ACK, &notification));
+      memcpy(&ack, notification.data(), sizeof(ack));
+      CHECK(ack.flags & FASTBLEOTA_ACK_RETRANSMIT);
+      CHECK_EQ(ack.nextSequence, 20);
+    }
+    if (i == 40) {
+      // A write cut off before its sequence number and CRC is as corrupt as one that fails its CRC
+      write(bytes_t(packet.begin(), packet.begin() + 5));
+
+      fastbleota_ack_t ack;
+      bytes_t notification;
+      CHECK(notified(host_take_notifications(characteristic), FASTBLEOTA_NOTIFY_ACK, &notification));
+      memcpy(&ack, notification.data(), sizeof(ack));
+      CHECK(ack.flags & FASTBLEOTA_ACK_RETRANSMIT);
+      CHECK_EQ(ack.nextSequence, 40);
+    }
+    write(packet);
+  }
+
+  CHECK_EQ(recorder.completes, 1);
+  CHECK_EQ(recorder.errors, 0);
+  CHECK_EQ(engine->getStats().crcErrors, 2);
+  CHECK(installed(image.size()) == image);
+}
+
+// An interrupted resumable transfer continues from the last saved offset in the next session
+static void testResume() {
+  bytes_t image = make_image(TEST_IMAGE_SIZE, 16);
+  session_options_t options;
+  options.flags = FASTBLEOTA_FLAG_RESUMABLE;
+  bytes_t header = make_header(image, image.size(), options);
+
+  write(header);
+  std::vector<bytes_t> chunks = split(image, TEST_CHUNK_SIZE);
+  for (size_t i = 0; i < chunks.size() * 3 / 4; i++) write(chunks[i]);
+  host_disconnect(TEST_CONN);
+  CHECK_EQ(recorder.lastError, FASTBLEOTA_ERROR_DISCONNECTED);
+  host_take_notifications(characteristic);
+
+  host_connect(TEST_CONN);
+  host_subscribe(TEST_CONN, characteristic, true);
+  write(header);
+  bytes_t notification;
+  CHECK(notified(host_take_notifications(characteristic), FASTBLEOTA_NOTIFY_START, &notification));
+  fastbleota_start_notify_t start;
+  memcpy(&start, notification.data(), sizeof(start));
+  CHECK(start.offset >= FASTBLEOTA_RESUME_SAVE_INTERVAL);
+  CHECK_EQ(start.offset % 4096, 0);
+
+  for (const bytes_t& chunk : split(image, TEST_CHUNK_SIZE, start.offset)) write(chunk);
+  CHECK_EQ(recorder.completes, 1);
+  CHECK(installed(image.size(), FASTBLEOTA_TARGET_APP, true) == image);
+  checkBooted(true);
+}
+
+// Two engines cannot write the same partition at once, whichever sink they use
+static void testClaimConflict() {
+  bytes_t image = make_image(TEST_IMAGE_SIZE, 17);
+  bytes_t header = make_header(image, image.size(), {});
+
+  engine->write(header.data(), header.size());
+  other->write(header.data(), header.size());
+  CHECK_EQ(otherRecorder.lastError, FASTBLEOTA_ERROR_START_UPDATE);
+
+  for (const bytes_t& chunk : split(image, TEST_CHUNK_SIZE)) engine->write(chunk.data(), chunk.size());
+  CHECK_EQ(recorder.completes, 1);
+
+  // Released once the session completes
+  otherRecorder.clear();
+  other->reset();
+  send(other, header, image);
+  CHECK_EQ(otherRecorder.completes, 1);
+}
+
+static void testDisconnect() {
+  bytes_t image = make_image(TEST_IMAGE_SIZE, 18);
+  write(make_header(image, image.size(), {}));
+  std::vector<bytes_t> chunks = split(image, TEST_CHUNK_SIZE);
+  for (size_t i = 0; i < 10; i++) write(chunks[i]);
+
+  host_disconnect(TEST_CONN);
+  CHECK_EQ(recorder.lastError, FASTBLEOTA_ERROR_DISCONNECTED);
+  CHECK_EQ(engine->getStats().state, FASTBLEOTA_STATE_ERROR);
+  checkBooted(false);
+
+  // The session was torn down, so the partition is free for another engine
+  bytes_t header = make_header(image, image.size(), {});
+  send(other, header, image);
+  CHECK_EQ(otherRecorder.completes, 1);
+}
+
+static void testTimeout() {
+  engine->setSessionTimeout(50);
+  bytes_t image = make_image(TEST_IMAGE_SIZE, 19);
+  write(make_header(image, image.size(), {}));
+
+  CHECK(waitFor([]() { return recorder.errors > 0; }, 2000));
+  CHECK_EQ(recorder.lastError, FASTBLEOTA_ERROR_TIMEOUT);
+  engine->setSessionTimeout(FASTBLEOTA_SESSION_TIMEOUT_MS);
+}
+
+// stdio allocates the buffer of the image file on its first write
+#if FASTBLEOTA_SINK == FASTBLEOTA_SINK_FILE
+#define SINK_ALLOCATIONS 1
+#else
+#define SINK_ALLOCATIONS 0
+#endif
+
+// Neither write() nor writes through the characteristic, which are read out of their mbufs, allocate for a chunk
+static void testHeapAllocations() {
+  bytes_t image = make_image(TEST_IMAGE_SIZE, 20);
+  bytes_t header = make_header(image, image.size(), {});
+  std::vector<bytes_t> chunks = split(image, TEST_CHUNK_SIZE);
+
+  engine->write(header.data(), header.size());
+  uint32_t afterHeader = engine->getStats().heapAllocations;
+  for (const bytes_t& chunk : chunks) engine->write(chunk.data(), chunk.size());
+  fastbleota_stats_t stats = engine->getStats();
+  CHECK_EQ(recorder.completes, 1);
+
+#if CONFIG_HEAP_USE_HOOKS
+  CHECK_EQ(stats.heapAllocations - afterHeader, SINK_ALLOCATIONS);
+
+  engine->reset();
+  write(header);
+  afterHeader = engine->getStats().heapAllocations;
+  for (const bytes_t& chunk : chunks) write(chunk);
+  CHECK_EQ(engine->getStats().heapAllocations - afterHeader, SINK_ALLOCATIONS);
+#else
+  CHECK_EQ(afterHeader, FASTBLEOTA_NOT_MEASURED);
+  CHECK_EQ(stats.heapAllocations, FASTBLEOTA_NOT_MEASURED);
+#endif
+}
+
+// Each engine counts the allocations made while it ingests, even while another engine ingests on another task
+static void testParallelAllocations() {
+#if CONFIG_HEAP_USE_HOOKS
+  bytes_t image = make_image(32 * 1024, 23);
+  session_options_t options;
+  options.target = FASTBLEOTA_TARGET_FILESYSTEM;
+  bytes_t header = make_header(image, image.size(), {});
+  bytes_t otherHeader = make_header(image, image.size(), options);
+  engine->write(header.data(), header.size());
+  other->write(otherHeader.data(), otherHeader.size());
+  uint32_t engineAfterHeader = engine->getStats().heapAllocations;
+  uint32_t otherAfterHeader = other->getStats().heapAllocations;
+  recorder.allocating = true;
+  otherRecorder.allocating = true;
+
+  // Flash writes really take their time, so both tasks are in the middle of a chunk most of the time
+  host_set_time_mode(HOST_TIME_SLEEP);
+  host_set_flash_model(HOST_FLASH_TYPICAL);
+  std::vector<bytes_t> chunks = split(image, TEST_CHUNK_SIZE);
+  auto run = [&chunks](FastBLEOTAEngine* target) {
+    for (const bytes_t& chunk : chunks) target->write(chunk.data(), chunk.size());
+  };
+  std::thread first(run, engine);
+  std::thread second(run, other);
+  first.join();
+  second.join();
+  host_set_time_mode(HOST_TIME_VIRTUAL);
+  host_set_flash_model(HOST_FLASH_NONE);
+
+  CHECK_EQ(recorder.completes, 1);
+  CHECK_EQ(otherRecorder.completes, 1);
+  CHECK(recorder.allocations > 0);
+  CHECK_EQ(engine->getStats().heapAllocations - engineAfterHeader, recorder.allocations + SINK_ALLOCATIONS);
+  CHECK_EQ(other->getStats().heapAllocations - otherAfterHeader, otherRecorder.allocations + SINK_ALLOCATIONS);
+#endif
+}
+
+static void testWriterTask() {
+  bytes_t image = make_image(TEST_IMAGE_SIZE, 21);
+  bytes_t stream = deflate(image);
+  session_options_t options;
+  options.compression = FASTBLEOTA_COMPRESSION_DEFLATE;
+  send(threaded, make_header(image, stream.size(), options), stream);
+
+  CHECK(waitFor([]() { return recorder.completes + recorder.errors > 0; }));
+  CHECK_EQ(recorder.completes, 1);
+  CHECK_EQ(recorder.errors, 0);
+  CHECK(installed(image.size()) == image);
+}
+
+// A chunk the writer task ring cannot take fails the session and releases its partition at once
+static void testRejectedChunk() {
+  bytes_t image = make_image(TEST_IMAGE_SIZE, 26);
+  bytes_t header = make_header(image, image.size(), {});
+  threaded->write(header.data(), header.size());
+  CHECK(waitFor([]() { return recorder.starts > 0; }));
+
+  bytes_t oversized(FASTBLEOTA_MAX_CHUNK_SIZE + 1, 0);
+  threaded->write(oversized.data(), oversized.size());
+  CHECK(waitFor([]() { return recorder.errors > 0; }));
+  CHECK_EQ(recorder.lastError, FASTBLEOTA_ERROR_CHUNK_TOO_LARGE);
+
+  send(other, header, image);
+  CHECK_EQ(otherRecorder.errors, 0);
+  CHECK_EQ(otherRecorder.completes, 1);
+}
+
+// Chunks still queued for the writer task when the session is reset never reach the next session, not even the one
+// the writer task took off the queue just before the reset
+static void testResetWhileQueued() {
+  bytes_t stale = make_image(64 * 1024, 24);
+  bytes_t staleHeader = make_header(stale, stale.size(), {});
+  std::vector<bytes_t> chunks = split(stale, TEST_CHUNK_SIZE);
+  host_set_time_mode(HOST_TIME_SLEEP);
+  host_set_flash_model(HOST_FLASH_TYPICAL);
+
+  // The chunk that fills the first write block holds the writer task in a flash write while the ring fills up
+  // behind it, so the reset waits for the writer task, which may then take the next chunk off the ring before the
+  // reset discards them. Whether it does is down to timing, so it gets a few chances
+  for (int round = 0; round < 5; round++) {
+    threaded->write(staleHeader.data(), staleHeader.size());
+    for (size_t i = 0; i < FASTBLEOTA_WRITE_BLOCK_SIZE / TEST_CHUNK_SIZE + FASTBLEOTA_QUEUE_LENGTH; i++) {
+      threaded->write(chunks[i].data(), chunks[i].size());
+    }
+    threaded->reset();
+  }
+  host_set_time_mode(HOST_TIME_VIRTUAL);
+  host_set_flash_model(HOST_FLASH_NONE);
+
+  bytes_t image = make_image(32 * 1024, 25);
+  send(threaded, make_header(image, image.size(), {}), image);
+  CHECK(waitFor([]() { return recorder.completes > 0; }));
+  CHECK_EQ(recorder.errors, 0);
+  CHECK(installed(image.size()) == image);
+}
+
+// Outcomes that find the event queue full are latched, so no session's completion is ever lost
+static void testLatchedEvents() {
+  bytes_t image = make_image(8192, 22);
+  bytes_t header = make_header(image, image.size(), {});
+
+  // Every session queues its start and completion and the first also a progress event, so the completion of the
+  // last session finds the queue full
+  const int sessions = FASTBLEOTA_EVENT_QUEUE_LENGTH / 2;
+  for (int i = 0; i < sessions; i++) {
+    looped->reset();
+    send(looped, header, image, 509);
+  }
+  CHECK_EQ(recorder.completes, 0);
+
+  looped->handleEvents();
+  CHECK_EQ(recorder.starts, sessions);
+  CHECK_EQ(recorder.completes, sessions);
+  CHECK_EQ(recorder.errors, 0);
+}
+
+// After the header on the characteristic, SDUs on the L2CAP channel are handled like writes, read out of the channel's
+// own receive buffers
+static void testL2CAP() {
+#if CONFIG_BT_NIMBLE_L2CAP_COC_MAX_NUM
+  // Already listening since main(), a second call neither registers the server again nor resets its buffers
+  CHECK(engine->beginL2CAP());
+  ble_l2cap_chan* chan = host_l2cap_connect(TEST_CONN, FASTBLEOTA_L2CAP_PSM);
+  CHECK(chan != nullptr);
+  if (!chan) return;
+
+  bytes_t image = make_image(TEST_IMAGE_SIZE, 26);
+  bytes_t header = make_header(image, image.size(), {});
+  write(header);
+  uint32_t afterHeader = engine->getStats().heapAllocations;
+  // A full SDU does not fit one receive buffer, so it arrives chained across two
+  std::vector<bytes_t> sdus = split(image, FASTBLEOTA_L2CAP_MTU);
+  for (const bytes_t& sdu : sdus) CHECK_EQ(host_l2cap_send(chan, sdu.data(), sdu.size()), 0);
+
+  CHECK_EQ(recorder.completes, 1);
+  CHECK_EQ(recorder.errors, 0);
+  CHECK(installed(image.size()) == image);
+  checkBooted(true);
+  fastbleota_stats_t stats = engine->getStats();
+  CHECK_EQ(stats.chunksReceived, 1 + sdus.size());
+  CHECK_EQ(stats.heapAllocations - afterHeader, SINK_ALLOCATIONS);
+
+  // An SDU over the MTU never reaches the engine
+  bytes_t oversized(FASTBLEOTA_L2CAP_MTU + 1, 0);
+  CHECK_EQ(host_l2cap_send(chan, oversized.data(), oversized.size()), BLE_HS_EINVAL);
+  ble_l2cap_disconnect(chan);
+#else
+  CHECK(!engine->beginL2CAP());
+#endif
+}
+
+// A channel is refused without a buffer to receive into, and closed when it has none for its next SDU, failing the
+// session rather than leaving the client without credits
+static void testL2CAPBuffers() {
+#if CONFIG_BT_NIMBLE_L2CAP_COC_MAX_NUM
+  std::vector<ble_l2cap_chan*> channels;
+  for (int i = 0; i < FASTBLEOTA_L2CAP_BUFFER_COUNT; i++) {
+    channels.push_back(host_l2cap_connect(TEST_CONN, FASTBLEOTA_L2CAP_PSM));
+  }
+  for (ble_l2cap_chan* chan : channels) CHECK(chan != nullptr);
+  CHECK(host_l2cap_connect(TEST_CONN, FASTBLEOTA_L2CAP_PSM) == nullptr);
+  for (size_t i = 1; i < channels.size(); i++) ble_l2cap_disconnect(channels[i]);
+  ble_l2cap_chan* chan = channels[0];
+  if (!chan) return;
+
+  bytes_t image = make_image(TEST_IMAGE_SIZE, 27);
+  write(make_header(image, image.size(), {}));
+  std::vector<bytes_t> sdus = split(image, TEST_CHUNK_SIZE);
+  CHECK_EQ(host_l2cap_send(chan, sdus[0].data(), sdus[0].size()), 0);
+  host_l2cap_fail_rx(chan);
+  CHECK_EQ(host_l2cap_send(chan, sdus[1].data(), sdus[1].size()), 0);
+
+  CHECK_EQ(recorder.errors, 1);
+  CHECK_EQ(recorder.lastError, FASTBLEOTA_ERROR_L2CAP_BUFFER);
+  CHECK_EQ(engine->getStats().state, FASTBLEOTA_STATE_ERROR);
+  CHECK_EQ(host_l2cap_send(chan, sdus[2].data(), sdus[2].size()), BLE_HS_ENOTCONN);
+  checkBooted(false);
+
+  // The buffers were all returned, so the client can open a channel again and start over
+  chan = host_l2cap_connect(TEST_CONN, FASTBLEOTA_L2CAP_PSM);
+  CHECK(chan != nullptr);
+  if (chan) ble_l2cap_disconnect(chan);
+#endif
+}
+
+int main() {
+  // Results appear as each test finishes, even if a later one crashes
+  setvbuf(stdout, nullptr, _IOLBF, 0);
+  host_set_log_level(0);
+  host_set_update_dir(".");
+
+  server = NimBLEDevice::createServer();
+  engine = new FastBLEOTAEngine();
+  engine->setCallbacks(&recorder);
+  engine->begin(server);
+
+  other = new FastBLEOTAEngine();
+  other->setCallbacks(&otherRecorder);
+  other->begin(server, OTHER_CHARACTERISTIC_UUID);
+
+  threaded = new FastBLEOTAEngine();
+  threaded->setCallbacks(&recorder);
+  threaded->setWriterTaskEnabled(true);
+  threaded->setPreEraseEnabled(true);
+  threaded->setCallbackDispatch(FASTBLEOTA_DISPATCH_TASK);
+  threaded->begin(server, "513fcda9-f46d-4e41-ac4f-42b768495a87");
+
+  looped = new FastBLEOTAEngine();
+  looped->setCallbacks(&recorder);
+  looped->setCallbackDispatch(FASTBLEOTA_DISPATCH_LOOP);
+  looped->begin(server, "513fcda9-f46d-4e41-ac4f-42b768495a88");
+
+#if CONFIG_BT_NIMBLE_L2CAP_COC_MAX_NUM
+  engine->beginL2CAP();
+#endif
+
+  server->start();
+  characteristic = host_find_characteristic(OTA_CHARACTERISTIC_UUID);
+
+  static const struct {
+    const char* name;
+    void (*run)();
+  } tests[] = {
+    { "raw", testRaw },
+    { "legacy_size", testLegacySize },
+    { "header_versions", testHeaderVersions },
+    { "deflate", testDeflate },
+    { "truncated_deflate", testTruncatedDeflate },
+    { "sparse", testSparse },
+    { "sparse_deflate", testSparseDeflate },
+    { "delta", testDelta },
+    { "hash_mismatch", testHashMismatch },
+    { "image_checks", testImageChecks },
+    { "error_drops_chunks", testErrorDropsChunks },
+    { "filesystem", testFilesystem },
+    { "query", testQuery },
+    { "sequenced_crc", testSequencedCrc },
+    { "resume", testResume },
+    { "claim_conflict", testClaimConflict },
+    { "disconnect", testDisconnect },
+    { "timeout", testTimeout },
+    { "heap_allocations", testHeapAllocations },
+    { "parallel_allocations", testParallelAllocations },
+    { "writer_task", testWriterTask },
+    { "rejected_chunk", testRejectedChunk },
+    { "reset_while_queued", testResetWhileQueued },
+    { "latched_events", testLatchedEvents },
+    { "l2cap", testL2CAP },
+    { "l2cap_buffers", testL2CAPBuffers },
+  };
+
+  for (const auto& test : tests) {
+    int before = failures;
+    setUp();
+    test.run();
+    printf("%-20s %s\n", test.name, failures == before ? "ok" : "FAILED");
+  }
+  return failures ? 1 : 0;
+}